@@ -0,0 +1,130 @@
+
+#include "coconut.h"
+
+#include <errno.h>
+#include <pthread.h>
+
+
+/* Cancellation runs in three phases.  The first marks the coros and takes
+ * them out of their schedulers, so nothing else runs them.  The second resets
+ * their conuts, and those of their peers, so that pipe operations during the
+ * teardown return an error without touching another coro.  The third gives
+ * the coros their finalise turn and cleans up their resources; as the coros
+ * are now independent, this is done in batches over a number of threads.
+ */
+
+#define COCANCEL_BATCH 64
+
+#define cocancel_pipenuts(C) ((coconut_pipenut_t) ((C) + 1))
+
+
+struct cocancel_work {
+	coconut_coro_t *coros;
+	unsigned count;
+	unsigned next;			// First coro of the next batch to take
+};
+
+
+/* Reset the conuts of a coro and its peers.
+ */
+static void cocancel_reset (coconut_coro_t co) {
+	coconut_pipenut_t pn = cocancel_pipenuts (co);
+	unsigned i;
+	for (i = 0; i < co->coclass->conutcount; i++) {
+		pn [i].err = ECONNRESET;
+		if (pn [i].peer != NULL) {
+			pn [i].peer->err = ECONNRESET;
+		}
+	}
+}
+
+
+/* Give a coro that waits in its event loop a turn to handle its finalise
+ * event, and then cleanup what it still holds, unless it ended already.
+ */
+static void cocancel_one (coconut_coro_t co) {
+	if ((co->coswitch == -11999) && !cogo (*co)) {
+		return;
+	}
+	_codestroy (co);
+}
+
+static void *cocancel_worker (void *arg) {
+	struct cocancel_work *w = arg;
+	unsigned first, i;
+	while ((first = __atomic_fetch_add (&w->next, COCANCEL_BATCH, __ATOMIC_RELAXED)) < w->count) {
+		unsigned last = (w->count - first > COCANCEL_BATCH)? first + COCANCEL_BATCH: w->count;
+		for (i = first; i < last; i++) {
+			cocancel_one (w->coros [i]);
+		}
+	}
+	return NULL;
+}
+
+
+/* Cancel a coronet, and return when the resources of all its coros have been
+ * cleaned up.  Returns 0 or a negative error; -EINVAL for coros without a
+ * coclass and -EBUSY for a coro that is running.  Nothing is cancelled then.
+ */
+int cocancel (coconut_coro_t *coros, unsigned count, unsigned threads) {
+	struct cocancel_work work;
+	pthread_t *helpers = NULL;
+	unsigned i, started = 0;
+	for (i = 0; i < count; i++) {
+		if (coros [i]->coclass == NULL) {
+			return -EINVAL;
+		}
+		if (coros [i]->schedstate == COSCHED_RUNNING) {
+			return -EBUSY;
+		}
+	}
+	//
+	// Mark the coros, and take them out of their schedulers
+	for (i = 0; i < count; i++) {
+		coros [i]->cancelled = 1;
+	}
+	for (i = 0; i < count; i++) {
+		coconut_coro_t co = coros [i];
+		if (co->schedstate == COSCHED_PARKED) {
+			co->sched->parked--;
+			co->schedstate = COSCHED_OFF;
+			if (co->sched->timercount > 0) {
+				// Takes out the timers of parked cancelled coros
+				_cosched_purge (co->sched);
+			}
+			co->sched = NULL;
+		} else if (co->sched != NULL) {
+			// Purges all cancelled coros in this scheduler at once
+			_cosched_purge (co->sched);
+		}
+	}
+	//
+	// Disconnect the conuts and deliver the finalise event
+	for (i = 0; i < count; i++) {
+		cocancel_reset (coros [i]);
+		conut_trigger (conut_activity_finalise, coros [i]);
+	}
+	//
+	// Run the finalise turns and cleanups in batches
+	work.coros = coros;
+	work.count = count;
+	work.next = 0;
+	if (threads > count / COCANCEL_BATCH) {
+		threads = count / COCANCEL_BATCH;
+	}
+	if (threads > 1) {
+		// Without memory for the helpers, the calling thread does all
+		helpers = calloc (threads - 1, sizeof (pthread_t));
+	}
+	for (i = 1; (helpers != NULL) && (i < threads); i++) {
+		if (pthread_create (&helpers [started], NULL, cocancel_worker, &work) == 0) {
+			started++;
+		}
+	}
+	cocancel_worker (&work);
+	for (i = 0; i < started; i++) {
+		pthread_join (helpers [i], NULL);
+	}
+	free (helpers);
+	return 0;
+}
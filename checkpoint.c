@@ -0,0 +1,329 @@
+
+#include "coconut.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* A snapshot file holds a header, a table with an entry for each coro, and
+ * then the images of the coros, each as it was in memory.  The entries note
+ * the address where each coro was, so pointers between them can be found and
+ * rebased on restore.  The images start at cache line boundaries.
+ *
+ * Snapshots are meant for restarting the same program on the same machine;
+ * they are not portable between builds or architectures.
+ */
+
+#define COSNAP_MAGIC   "coconut\001"
+#define COSNAP_NAMELEN 48
+#define COSNAP_ALIGN   64
+
+struct cosnap_header {
+	char magic [8];
+	uint32_t count;			// Number of coros in the table
+	uint32_t entrysize;		// Size of one table entry
+};
+
+struct cosnap_entry {
+	uint64_t oldaddr;		// Where the coro was at checkpoint time
+	uint64_t offset;		// Where the image is in the file
+	uint64_t size;			// Size of the image
+	char name [COSNAP_NAMELEN];	// Name of the coclass
+};
+
+
+/* An index over the coros, sorted by their old addresses, to find the coro
+ * that a pointer points into.
+ */
+struct cosnap_index {
+	uint64_t oldaddr, size;
+	uint8_t *newaddr;
+};
+
+static int cosnap_cmp (const void *a, const void *b) {
+	uint64_t aa = ((const struct cosnap_index *) a)->oldaddr;
+	uint64_t bb = ((const struct cosnap_index *) b)->oldaddr;
+	return (aa < bb)? -1: (aa > bb)? 1: 0;
+}
+
+static struct cosnap_index *cosnap_find (struct cosnap_index *idx, unsigned count, const void *ptr) {
+	uint64_t addr = (uint64_t) (uintptr_t) ptr;
+	unsigned lo = 0, hi = count;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (idx [mid].oldaddr <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((lo > 0) && (addr - idx [lo - 1].oldaddr < idx [lo - 1].size)) {
+		return &idx [lo - 1];
+	}
+	return NULL;
+}
+
+/* Test if a pointer can be saved, that is if it is NULL or inside a coro.
+ */
+static bool cosnap_inside (struct cosnap_index *idx, unsigned count, const void *ptr) {
+	return (ptr == NULL) || (cosnap_find (idx, count, ptr) != NULL);
+}
+
+/* Rebase a pointer from its old coro to the same place in the new one.
+ */
+static void *cosnap_rebase (struct cosnap_index *idx, unsigned count, void *ptr) {
+	struct cosnap_index *in = cosnap_find (idx, count, ptr);
+	if (in == NULL) {
+		return ptr;
+	}
+	return in->newaddr + ((uint64_t) (uintptr_t) ptr - in->oldaddr);
+}
+
+#define cosnap_pipenuts(C) ((coconut_pipenut_t) ((C) + 1))
+
+/* Deadlines are times of cotime_now(), which do not carry over to another
+ * run of the program, so they are saved as the time that was left, and on
+ * restore they count from then.  A deadline that has passed is saved as 1,
+ * so it is still due right away, and 0 still means that there is none.
+ */
+static uint64_t cosnap_timeleft (uint64_t deadline, uint64_t now) {
+	if (deadline == 0) {
+		return 0;
+	}
+	return (deadline > now)? deadline - now: 1;
+}
+
+static uint64_t cosnap_deadline (uint64_t timeleft, uint64_t now) {
+	return (timeleft != 0)? now + timeleft: 0;
+}
+
+
+/* Save a quiescent coronet to a snapshot file.  Returns 0 or a negative
+ * error; -EINVAL for coros without a proper coclass, -EBUSY for a coro that
+ * is running and -EXDEV for pointers that lead out of the coronet.
+ */
+int cocheckpoint (const char *path, coconut_coro_t *coros, unsigned count) {
+	struct cosnap_header hdr;
+	struct cosnap_entry *tab = calloc (count, sizeof (struct cosnap_entry));
+	struct cosnap_index *idx = calloc (count, sizeof (struct cosnap_index));
+	FILE *f = NULL;
+	uint64_t offset;
+	unsigned i, j;
+	int retval = 0;
+	if ((tab == NULL) || (idx == NULL)) {
+		retval = -ENOMEM;
+		goto done;
+	}
+	//
+	// Describe the coros and check that they can be saved
+	offset = (sizeof (hdr) + count * sizeof (struct cosnap_entry) + COSNAP_ALIGN - 1) & ~ (uint64_t) (COSNAP_ALIGN - 1);
+	for (i = 0; i < count; i++) {
+		const struct coclass *cls = coros [i]->coclass;
+		if ((cls == NULL) || (strlen (cls->coroname) >= COSNAP_NAMELEN) ||
+		    (cls->datasize < sizeof (coconut_coro_st) + cls->conutcount * sizeof (coconut_pipenut_st))) {
+			retval = -EINVAL;
+			goto done;
+		}
+		if (coros [i]->schedstate == COSCHED_RUNNING) {
+			retval = -EBUSY;
+			goto done;
+		}
+		tab [i].oldaddr = (uint64_t) (uintptr_t) coros [i];
+		tab [i].offset = offset;
+		tab [i].size = cls->datasize;
+		strcpy (tab [i].name, cls->coroname);
+		idx [i].oldaddr = tab [i].oldaddr;
+		idx [i].size = tab [i].size;
+		offset += (cls->datasize + COSNAP_ALIGN - 1) & ~ (uint64_t) (COSNAP_ALIGN - 1);
+	}
+	qsort (idx, count, sizeof (struct cosnap_index), cosnap_cmp);
+	for (i = 0; i < count; i++) {
+		coconut_coro_t co = coros [i];
+		coconut_pipenut_t pn = cosnap_pipenuts (co);
+		if ((co->sched == NULL) && !cosnap_inside (idx, count, co->next)) {
+			retval = -EXDEV;
+			goto done;
+		}
+#ifndef COCONUT_COMPACT
+		if (!cosnap_inside (idx, count, co->subparent) ||
+		    !cosnap_inside (idx, count, co->subleaf)) {
+			// A cocall() to a coro outside of the coronet
+			retval = -EXDEV;
+			goto done;
+		}
+#endif
+		for (j = 0; j < co->coclass->conutcount; j++) {
+			if (!cosnap_inside (idx, count, pn [j].peer) ||
+			    !cosnap_inside (idx, count, pn [j].buf) ||
+			    !cosnap_inside (idx, count, pn [j].queue)) {
+				retval = -EXDEV;
+				goto done;
+			}
+		}
+	}
+	//
+	// Write the header, the table and the images
+	f = fopen (path, "wb");
+	if (f == NULL) {
+		retval = -errno;
+		goto done;
+	}
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, COSNAP_MAGIC, sizeof (hdr.magic));
+	hdr.count = count;
+	hdr.entrysize = sizeof (struct cosnap_entry);
+	if ((fwrite (&hdr, sizeof (hdr), 1, f) != 1) ||
+	    (fwrite (tab, sizeof (struct cosnap_entry), count, f) != count)) {
+		retval = -EIO;
+		goto done;
+	}
+	uint64_t now = cotime_now ();
+	for (i = 0; i < count; i++) {
+		coconut_coro_st head = *coros [i];
+		size_t rest = tab [i].size - sizeof (head);
+		head.altdeadline = cosnap_timeleft (head.altdeadline, now);
+#ifndef COCONUT_COMPACT
+		head.deadline = cosnap_timeleft (head.deadline, now);
+#endif
+		if ((fseek (f, tab [i].offset, SEEK_SET) != 0) ||
+		    (fwrite (&head, sizeof (head), 1, f) != 1) ||
+		    (fwrite (coros [i] + 1, 1, rest, f) != rest)) {
+			retval = -EIO;
+			goto done;
+		}
+	}
+done:
+	if ((f != NULL) && (fclose (f) != 0) && (retval == 0)) {
+		retval = -EIO;
+	}
+	free (tab);
+	free (idx);
+	return retval;
+}
+
+
+/* Restore a snapshot, finding each coclass by name among the given classes.
+ * Returns 0 or a negative error; -ENOENT for an unknown coclass and -EINVAL
+ * for a snapshot that does not fit the classes or is damaged.
+ */
+int corestore (coconut_snapshot_t snap, const char *path, const struct coclass *const *classes, unsigned numclasses) {
+	struct cosnap_header *hdr;
+	struct cosnap_entry *tab;
+	struct cosnap_index *idx = NULL;
+	struct stat st;
+	unsigned i, j;
+	int retval = 0;
+	memset (snap, 0, sizeof (*snap));
+	int fd = open (path, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	if (fstat (fd, &st) != 0) {
+		retval = -errno;
+		close (fd);
+		return retval;
+	}
+	snap->maplen = st.st_size;
+	snap->map = mmap (NULL, snap->maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (snap->map == MAP_FAILED) {
+		snap->map = NULL;
+		return -errno;
+	}
+	//
+	// Check the header and table
+	hdr = snap->map;
+	tab = (struct cosnap_entry *) (hdr + 1);
+	if ((snap->maplen < sizeof (*hdr)) ||
+	    (memcmp (hdr->magic, COSNAP_MAGIC, sizeof (hdr->magic)) != 0) ||
+	    (hdr->entrysize != sizeof (struct cosnap_entry)) ||
+	    (snap->maplen < sizeof (*hdr) + (uint64_t) hdr->count * sizeof (struct cosnap_entry))) {
+		retval = -EINVAL;
+		goto fail;
+	}
+	snap->count = hdr->count;
+	snap->coros = calloc (snap->count, sizeof (coconut_coro_t));
+	idx = calloc (snap->count, sizeof (struct cosnap_index));
+	if ((snap->coros == NULL) || (idx == NULL)) {
+		retval = -ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < snap->count; i++) {
+		if ((tab [i].offset > snap->maplen) || (tab [i].size > snap->maplen - tab [i].offset) ||
+		    (tab [i].offset % COSNAP_ALIGN != 0)) {
+			retval = -EINVAL;
+			goto fail;
+		}
+		snap->coros [i] = (coconut_coro_t) ((uint8_t *) snap->map + tab [i].offset);
+		idx [i].oldaddr = tab [i].oldaddr;
+		idx [i].size = tab [i].size;
+		idx [i].newaddr = (uint8_t *) snap->coros [i];
+	}
+	qsort (idx, snap->count, sizeof (struct cosnap_index), cosnap_cmp);
+	//
+	// Relink each coro to its coclass, rebase its pointers, and start it out
+	// of any scheduler, with its deadlines counting from now
+	uint64_t now = cotime_now ();
+	for (i = 0; i < snap->count; i++) {
+		coconut_coro_t co = snap->coros [i];
+		const struct coclass *cls = NULL;
+		tab [i].name [COSNAP_NAMELEN - 1] = '\0';
+		for (j = 0; j < numclasses; j++) {
+			if (strcmp (classes [j]->coroname, tab [i].name) == 0) {
+				cls = classes [j];
+				break;
+			}
+		}
+		if (cls == NULL) {
+			retval = -ENOENT;
+			goto fail;
+		}
+		if (cls->datasize != tab [i].size) {
+			retval = -EINVAL;
+			goto fail;
+		}
+		co->corofun = cls->corofun;
+		co->coclass = cls;
+		co->services = NULL;
+		co->sched = NULL;
+		co->schedstate = COSCHED_OFF;
+		co->waiting = 0;
+		co->cancelled = 0;
+		co->altdeadline = cosnap_deadline (co->altdeadline, now);
+#ifndef COCONUT_COMPACT
+		co->deadline = cosnap_deadline (co->deadline, now);
+#endif
+		co->next = cosnap_find (idx, snap->count, co->next)? cosnap_rebase (idx, snap->count, co->next): NULL;
+#ifndef COCONUT_COMPACT
+		co->subparent = cosnap_rebase (idx, snap->count, co->subparent);
+		co->subleaf   = cosnap_rebase (idx, snap->count, co->subleaf);
+#endif
+		coconut_pipenut_t pn = cosnap_pipenuts (co);
+		for (j = 0; j < cls->conutcount; j++) {
+			pn [j].peer  = cosnap_rebase (idx, snap->count, pn [j].peer);
+			pn [j].buf   = cosnap_rebase (idx, snap->count, pn [j].buf);
+			pn [j].queue = cosnap_rebase (idx, snap->count, pn [j].queue);
+		}
+	}
+	free (idx);
+	return 0;
+fail:
+	free (idx);
+	corestore_free (snap);
+	return retval;
+}
+
+
+/* Release a restored snapshot, along with all its coros.
+ */
+void corestore_free (coconut_snapshot_t snap) {
+	if (snap->map != NULL) {
+		munmap (snap->map, snap->maplen);
+	}
+	free (snap->coros);
+	memset (snap, 0, sizeof (*snap));
+}
@@ -0,0 +1,90 @@
+/* Benchmark of resuming coros that wait deep down in cosubroutines.
+ *
+ * A chain of cosubroutines is built to a given depth, and the innermost one
+ * yields many times.  Each yield returns all the way out to the main loop,
+ * which resumes the chain with cogo().  This is done once with cosub(), where
+ * every resume passes through the switch of every level, and once with
+ * cocall(), where the innermost level is resumed directly.  The time per
+ * resume is printed for each depth.
+ *
+ * cc -std=gnu11 -O2 -I. -o cobench cobench.c cocall.c cotime.c destroy.c
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "coconut.h"
+
+
+#define MAXDEPTH 16
+#define YIELDS   1000000
+
+
+struct level {
+	coconut_coro_st coro;
+	struct level *child;
+	unsigned long yields;
+};
+
+
+/* One level that passes through cosub() to the next, or yields at the end.
+ */
+bool level_cosub (struct level *selfp) {
+cobegin ();
+	if (selfp->child != NULL) {
+		cosub (level_cosub (selfp->child));
+	} else {
+		while (selfp->yields > 0) {
+			selfp->yields--;
+			coyield ();
+		}
+	}
+coend ();
+}
+
+/* One level that calls the next with cocall(), or yields at the end.
+ */
+bool level_cocall (struct level *selfp) {
+cobegin ();
+	if (selfp->child != NULL) {
+		cocall (selfp->child->coro, level_cocall);
+	} else {
+		while (selfp->yields > 0) {
+			selfp->yields--;
+			coyield ();
+		}
+	}
+coend ();
+}
+
+
+/* Build a chain, run it until it ends, and return the nanoseconds per resume.
+ */
+double run_chain (struct level *chain, int depth, bool (*fun) (struct level *)) {
+	int i;
+	for (i = 0; i < depth; i++) {
+		memset (&chain [i], 0, sizeof (chain [i]));
+		coinit (chain [i].coro, fun);
+		chain [i].child = (i + 1 < depth)? &chain [i + 1]: NULL;
+	}
+	chain [depth - 1].yields = YIELDS;
+	uint64_t start = cotime_now ();
+	while (cogo (chain [0].coro)) {
+		;
+	}
+	return (double) (cotime_now () - start) / YIELDS;
+}
+
+
+int main (void) {
+	struct level chain [MAXDEPTH];
+	int depth;
+	printf ("depth\tcosub ns\tcocall ns\n");
+	for (depth = 1; depth <= MAXDEPTH; depth++) {
+		double nested = run_chain (chain, depth, level_cosub);
+		double direct = run_chain (chain, depth, level_cocall);
+		printf ("%d\t%.1f\t\t%.1f\n", depth, nested, direct);
+	}
+	return 0;
+}
@@ -0,0 +1,67 @@
+
+#include "coconut.h"
+
+
+/* With COCONUT_COMPACT, coros have no links for cocall(), which is cosub().
+ */
+#ifndef COCONUT_COMPACT
+
+
+/* Call a cosubroutine coro.  The root of the chain of calls remembers the
+ * innermost busy cosubroutine, so cogo() can resume it directly.  Returns
+ * nonzero while the cosubroutine is busy.
+ *
+ * A cosubroutine that is called for the first time is tied to its caller.
+ * The deepest busy one is recorded before it runs, so that any cocall() from
+ * inside it can record a deeper one.  When it ends, its caller is recorded
+ * again, or nothing when the caller is the root itself.
+ */
+bool _cocall (coconut_coro_t me, coconut_coro_t sub, bool (*corofun) (void *)) {
+	coconut_coro_t root = (me->subparent != NULL)? me->subleaf: me;
+	if (sub->subleaf == sub) {
+		// It ended while resumed by _cogo_deep(); do not run it again
+		sub->subleaf = NULL;
+		root->subleaf = (me == root)? NULL: me;
+		return 0;
+	}
+	if (sub->subparent != me) {
+		sub->corofun = corofun;
+		sub->subparent = me;
+		sub->subleaf = root;
+	}
+	root->subleaf = sub;
+	if ((*corofun) (sub)) {
+		return 1;
+	}
+	sub->subparent = NULL;
+	sub->subleaf = NULL;
+	root->subleaf = (me == root)? NULL: me;
+	return 0;
+}
+
+
+/* Resume a root coro by resuming its innermost busy cosubroutine.  When that
+ * ends, it is marked by pointing subleaf to itself, and its caller continues
+ * where it did cocall(), which finds it ended and moves on.  This goes up the
+ * chain until a caller is busy again, or until the root itself runs.
+ */
+bool _cogo_deep (coconut_coro_t root) {
+	coconut_coro_t leaf = root->subleaf;
+	while (leaf != NULL) {
+		if ((*leaf->corofun) (leaf)) {
+			return 1;
+		}
+		coconut_coro_t parent = leaf->subparent;
+		leaf->subparent = NULL;
+		leaf->subleaf = leaf;
+		if (parent == root) {
+			root->subleaf = NULL;
+			break;
+		}
+		root->subleaf = parent;
+		leaf = parent;
+	}
+	return (*root->corofun) (root);
+}
+
+#endif
@@ -1,9 +1,38 @@
 #ifndef COCONUT_H
 #define COCONUT_H
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Coros fall through into the case labels that the macros below place in
+ * their switch, and they may not use all the labels that the macros define.
+ * Both are intentional, so compilers that know about it are told, and coros
+ * build without warnings.
+ */
+#if defined (__has_attribute) && !defined (__cplusplus)
+#if __has_attribute (fallthrough)
+#define _cofallthrough __attribute__ ((fallthrough));
+#endif
+#endif
+#ifndef _cofallthrough
+#define _cofallthrough
+#endif
+
+#if defined (__GNUC__) && !defined (__cplusplus)
+#define _counused_label __attribute__ ((unused))
+#else
+#define _counused_label
+#endif
 
 
 /* BIG TODO: RESTRUCTURE SWITCH LABEL VALUES
@@ -25,12 +54,189 @@
  */
 
 
+/* Flags for open resources and for conut activity are held in words of type
+ * coflag_t, which are 32 bits unless COCONUT_FLAGS64 is defined.  To have more
+ * than fits in one word, define COCONUT_FLAG_WORDS to the number of words to
+ * use, up to the number of bits in a word.  A summary word then holds a bit
+ * for each word that has any flag set, so that the lowest or highest flag is
+ * still found with two bit scans, whatever the number of flags.
+ *
+ * The flags are manipulated through the coflags_xxx() functions only, so the
+ * code is the same for one word or many.  The topmost two flags are reserved
+ * for conut_activity_initialise and conut_activity_finalise, so the number of
+ * conuts is COCONUT_FLAG_BITS - 2 and the number of resources COCONUT_FLAG_BITS.
+ */
+#ifdef COCONUT_FLAGS64
+typedef uint64_t coflag_t;
+#else
+typedef uint32_t coflag_t;
+#endif
+
+#ifndef COCONUT_FLAG_WORDS
+#define COCONUT_FLAG_WORDS 1
+#endif
+
+#define COCONUT_WORD_BITS (8 * (int) sizeof (coflag_t))
+#define COCONUT_FLAG_BITS (COCONUT_WORD_BITS * COCONUT_FLAG_WORDS)
+
+#ifdef __cplusplus
+static_assert (COCONUT_FLAG_WORDS <= COCONUT_WORD_BITS, "COCONUT_FLAG_WORDS exceeds the bits in the summary word");
+#else
+_Static_assert (COCONUT_FLAG_WORDS <= COCONUT_WORD_BITS, "COCONUT_FLAG_WORDS exceeds the bits in the summary word");
+#endif
+
+/* Find the lowest or highest bit that is set in a non-zero word of flags.
+ * Compilers that know about it can use a single instruction for this.
+ */
+#ifdef __GNUC__
+#ifdef COCONUT_FLAGS64
+#define _cobit_lowest(F)  __builtin_ctzll (F)
+#define _cobit_highest(F) (63 - __builtin_clzll (F))
+#else
+#define _cobit_lowest(F)  __builtin_ctz (F)
+#define _cobit_highest(F) (31 - __builtin_clz (F))
+#endif
+#else
+static inline int _cobit_lowest (coflag_t flags) {
+	int bitnr = 0;
+	while (!(flags & 1)) {
+		flags >>= 1;
+		bitnr++;
+	}
+	return bitnr;
+}
+static inline int _cobit_highest (coflag_t flags) {
+	int bitnr = COCONUT_WORD_BITS - 1;
+	while (!(flags >> (COCONUT_WORD_BITS - 1))) {
+		flags <<= 1;
+		bitnr--;
+	}
+	return bitnr;
+}
+#endif
+
+#define _cobit(B) (((coflag_t) 1) << (B))
+
+#if COCONUT_FLAG_WORDS == 1
+
+typedef coflag_t coflags_t;
+
+static inline void coflags_zero (coflags_t *f) {
+	*f = 0;
+}
+static inline void coflags_set (coflags_t *f, unsigned bitnr) {
+	*f |= _cobit (bitnr);
+}
+static inline void coflags_clear (coflags_t *f, unsigned bitnr) {
+	*f &= ~ _cobit (bitnr);
+}
+static inline bool coflags_test (const coflags_t *f, unsigned bitnr) {
+	return (*f & _cobit (bitnr)) != 0;
+}
+static inline bool coflags_any (const coflags_t *f) {
+	return *f != 0;
+}
+static inline int coflags_lowest (const coflags_t *f) {
+	return (*f == 0)? -1: _cobit_lowest (*f);
+}
+static inline int coflags_highest (const coflags_t *f) {
+	return (*f == 0)? -1: _cobit_highest (*f);
+}
+
+/* Find the lowest flag set in both f and set, starting at bitnr start and
+ * wrapping around to 0 if nothing is found above it.  Return -1 if none is.
+ */
+static inline int coflags_next (const coflags_t *f, const coflags_t *set, unsigned start) {
+	coflag_t both = *f & *set;
+	coflag_t above = both & (~ (coflag_t) 0 << start);
+	if (above != 0) {
+		return _cobit_lowest (above);
+	}
+	return (both == 0)? -1: _cobit_lowest (both);
+}
+
+#else
+
+typedef struct coflags {
+	coflag_t sum;			// Bit for each word with any flag set
+	coflag_t word [COCONUT_FLAG_WORDS];
+} coflags_t;
+
+static inline void coflags_zero (coflags_t *f) {
+	memset (f, 0, sizeof (*f));
+}
+static inline void coflags_set (coflags_t *f, unsigned bitnr) {
+	unsigned w = bitnr / COCONUT_WORD_BITS;
+	f->word [w] |= _cobit (bitnr % COCONUT_WORD_BITS);
+	f->sum |= _cobit (w);
+}
+static inline void coflags_clear (coflags_t *f, unsigned bitnr) {
+	unsigned w = bitnr / COCONUT_WORD_BITS;
+	f->word [w] &= ~ _cobit (bitnr % COCONUT_WORD_BITS);
+	if (f->word [w] == 0) {
+		f->sum &= ~ _cobit (w);
+	}
+}
+static inline bool coflags_test (const coflags_t *f, unsigned bitnr) {
+	return (f->word [bitnr / COCONUT_WORD_BITS] & _cobit (bitnr % COCONUT_WORD_BITS)) != 0;
+}
+static inline bool coflags_any (const coflags_t *f) {
+	return f->sum != 0;
+}
+static inline int coflags_lowest (const coflags_t *f) {
+	if (f->sum == 0) {
+		return -1;
+	}
+	int w = _cobit_lowest (f->sum);
+	return w * COCONUT_WORD_BITS + _cobit_lowest (f->word [w]);
+}
+static inline int coflags_highest (const coflags_t *f) {
+	if (f->sum == 0) {
+		return -1;
+	}
+	int w = _cobit_highest (f->sum);
+	return w * COCONUT_WORD_BITS + _cobit_highest (f->word [w]);
+}
+
+/* Find the lowest flag set in both f and set, starting at bitnr start and
+ * wrapping around to 0 if nothing is found above it.  Return -1 if none is.
+ * The summary words guide the search to words that have flags in both.
+ */
+static inline int coflags_next (const coflags_t *f, const coflags_t *set, unsigned start) {
+	unsigned w = start / COCONUT_WORD_BITS;
+	coflag_t both = f->word [w] & set->word [w] & (~ (coflag_t) 0 << (start % COCONUT_WORD_BITS));
+	if (both != 0) {
+		return w * COCONUT_WORD_BITS + _cobit_lowest (both);
+	}
+	coflag_t sum = f->sum & set->sum;
+	coflag_t above = sum & (~ (coflag_t) 0 << w << 1);
+	coflag_t below = sum & ~ (~ (coflag_t) 0 << w << 1);
+	while ((above | below) != 0) {
+		int v = (above != 0)? _cobit_lowest (above): _cobit_lowest (below);
+		both = f->word [v] & set->word [v];
+		if (both != 0) {
+			return v * COCONUT_WORD_BITS + _cobit_lowest (both);
+		}
+		above &= ~ _cobit (v);
+		below &= ~ _cobit (v);
+	}
+	return -1;
+}
+
+#endif
+
+
 /* The structure for a "coconut coroutine" contains the variables that the coconut
  * functions assume to be present, or potentially present, for the coro instance.
  *
  * It is generally assumed that coconut_coro is followed by an array of
  * coconut_pipenut structures, each representing one local communication
  * end point.
+ *
+ * Defining COCONUT_COMPACT drops the scheduling deadline, the runtime
+ * accounting and the links of cocall(), so a coro takes 72 instead of 112
+ * bytes on 64-bit systems.  Deadlines then read as 0, every coro runs with
+ * the budget of its scheduler, and cocall() resumes through its callers.
  */
 
 typedef struct coconut_coro {
@@ -38,11 +244,33 @@ typedef struct coconut_coro {
 	struct coconut_coro *next;   // next in coro queue
 	int coswitch;                // the label to jump to inside of _coloop
 	int cleanpost;               // the label to jump to after a cleanup step
-	uint32_t resopen;	     // bits for each open resource
-	uint32_t activity;           // flags for unhandled pipe nut events
+	coflags_t resopen;	     // bits for each open resource
+	coflags_t activity;          // flags for unhandled pipe nut events
 	const uint32_t *services;    // one service entry for each following pipe nut
+	uint64_t altdeadline;        // cotime_now() to end coalt() waiting, or 0
+	struct coconut_scheduler *sched; // scheduler running this coro, if any
+	int16_t altlast;             // last conut returned by a fair coalt()
+	int16_t fairlast;            // last conut handled by copipenuts_fair
+	uint8_t schedclass;          // COSCHED_NORMAL, _CRITICAL or _BATCH
+	uint8_t schedstate;          // COSCHED_OFF, _READY, _RUNNING or _PARKED
+	uint8_t cancelled;           // set by cocancel() when torn down
+	uint8_t waiting;             // set when it yielded to wait for a trigger
+	const struct coclass *coclass; // static description, or NULL if unknown
+#ifndef COCONUT_COMPACT
+	uint64_t deadline;           // cotime_now() to finish by, or 0 if none
+	struct coconut_coro *subparent; // coro that cocall()ed us, or NULL
+	struct coconut_coro *subleaf; // innermost cocall(), or the root in subs
+	uint64_t runtime;            // time run under a scheduler that accounts
+	uint64_t budget;             // time to run before yielding, 0 for default
+#endif
 } coconut_coro_st, *coconut_coro_t;
 
+#ifndef COCONUT_COMPACT
+#define codeadline(C) ((C)->deadline)
+#else
+#define codeadline(C) ((void) (C), (uint64_t) 0)
+#endif
+
 
 /* Static description parts for "coconut pipes" are useful for creating them,
  * as well as for managing them.
@@ -57,13 +285,32 @@ struct coconut_coro_static {
 
 /* The structure for "coconut pipes" is the glue between two coconut functions.
  * There should never be both a reader and writer waiting to communicate.
+ *
+ * With millions of coros, pipe nuts can take most of the memory.  Defining
+ * COCONUT_COMPACT makes their lengths 32 bits and drops the backpressure
+ * metrics, which reads them as 0, so a pipe nut takes 48 instead of 88 bytes
+ * on 64-bit systems.  Transfers must then stay under 4 GB.
  */
+#ifdef COCONUT_COMPACT
+typedef uint32_t coconut_len_t;
+#else
+typedef size_t coconut_len_t;
+#endif
+
 typedef struct coconut_pipenut {
 	struct coconut_pipenut *peer;   // Current related peer for this pipenet
 	uint8_t *buf;			// Read/write buffer, or NULL if none
-	size_t ofs, len, todo;		// Buffer offset, length and minimum-to-do
-	int16_t errno;			// Error to report locally (EPIPE for EOF)
-	coconut_coro_t queue;		// Others queueing up for this port
+	coconut_len_t ofs, len, todo;	// Buffer offset, length and minimum-to-do
+	int16_t err;			// Error to report locally (EPIPE for EOF)
+	uint16_t nutnr;			// Our conut number + 1 once used, or 0
+	struct coconut_pipenut *queue;	// Others queueing up for this port
+	uint32_t credits;		// Writes granted by the reader, if used
+	bool writer, reader;		// Flags for our roles (both may be false)
+#ifndef COCONUT_COMPACT
+	uint64_t blocksince;		// When we started to wait, or 0 if not
+	uint64_t blockfull;		// Total time waited as a writer
+	uint64_t blockempty;		// Total time waited as a reader
+#endif
 } coconut_pipenut_st, *coconut_pipenut_t;
 
 
@@ -79,10 +326,25 @@ typedef struct coconut_pipenut {
  * This is not a coincidence, and there is a reason why we defined cosub() too.
  * Go ahead and have a ball -- benefit from resource management and exceptions!
  */
-#define coinit(C,F) ((coconut_coro_t)(&(C)))->corofun = (bool(*)(void*)) (F); ((coconut_coro_t)(&(C)))->next = NULL; ((coconut_coro_t)(&(C)))->coswitch = -99997; ((coconut_coro_t)(&(C)))->resopen = 0
+/* All coro fields start out cleared, so a coro that is reused does not carry
+ * the scheduler, timeouts, triggers or accounting of its previous life.  Only
+ * the scheduling class is kept, so cosched_class() may come before coinit().
+ */
+static inline void _coinit (coconut_coro_t co, bool (*corofun) (void *)) {
+	uint8_t schedclass = co->schedclass;
+	memset (co, 0, sizeof (*co));
+	co->corofun = corofun;
+	co->coswitch = -99997;
+	co->schedclass = schedclass;
+}
+
+#define coinit(C,F) _coinit ((coconut_coro_t)(&(C)), (bool(*)(void*)) (F))
+#define coinit_class(C,K) coinit ((C), (K)->corofun); ((coconut_coro_t)(&(C)))->coclass = (K)
 #define codeclare(T,C,F) (T) (C); coinit (&(C),(F))
 void _codestroy (coconut_coro_t selfp);
+void _codestroy_lifo (coconut_coro_t selfp);
 #define codestroy(C) _codestroy(&(C))
+#define codestroy_lifo(C) _codestroy_lifo(&(C))
 #define cosuicide(C) free (&_co)
 
 /* Invoke a standard-typed coroutine to make it run a bit more.  This is like
@@ -91,7 +353,12 @@ void _codestroy (coconut_coro_t selfp);
  * The same calling convention as for the other outsider macros is used,
  * namely referring to the structure instead of a pointer.
  */
-#define cogo(C) (*(C).corofun) (&(C))
+#ifndef COCONUT_COMPACT
+#define cogo(C) (((C).subleaf == NULL)? (*(C).corofun) (&(C)): _cogo_deep (&(C)))
+bool _cogo_deep (coconut_coro_t root);
+#else
+#define cogo(C) ((*(C).corofun) (&(C)))
+#endif
 
 
 /* The beginning and end of a coroutine are marked by cobegin() and coend().
@@ -106,12 +373,12 @@ void _codestroy (coconut_coro_t selfp);
  * restart a coroutine.  Use codone() to indicate that the coroutine should
  * finish -- that is, proceed towards either coend() or coendresources().
  */
-#define cobegin() _coloop: switch (_co.coswitch) { case -99997:
-#define coend() case -99998: _codestroy ((coconut_coro_t)selfp); return 0; }
+#define cobegin() _coloop: _counused_label switch (_co.coswitch) { case -99997:
+#define coend() _cofallthrough case -99998: _codestroy ((coconut_coro_t)selfp); return 0; } return 0
 
 //--OR-- use the form "cobody { ... }" --and-- move switch() to couroutine()
 
-#define cobody va_end (coarg); while (1) if (0) { case -99998: _codestroy ((coconut_coro_t)selfp); return 0; } else case -99997:
+#define cobody va_end (coarg); while (1) if (0) { case -99998: _codestroy ((coconut_coro_t)selfp); return 0; } else if (1) case -99997:
 
 #define codone() { _co.coswitch = -99998; goto _coloop; }
 
@@ -127,7 +394,23 @@ void _codestroy (coconut_coro_t selfp);
  * strictly required for coroutines.  The mechanism is fairly efficient because it
  * invokes the coroutines almost directly.
  */
-#define cosub(F) _co.coswitch = __LINE__; case __LINE__: if (F) { coyield (); }
+#define cosub(F) _co.coswitch = __LINE__; _cofallthrough case __LINE__: if (F) { return 1; }
+
+/* A cosubroutine can also be a coro of its own, with its own coro structure
+ * S and corofun F, which is initialised with coinit() before it is called.
+ * When cocall() finds it busy, the root coro that is at the start of the chain
+ * of calls records it as its innermost active cosubroutine.  Then, cogo() on
+ * the root resumes the innermost one directly, rather than going through all
+ * the switches in between.  When it returns 0, its parent is resumed, and so
+ * on, so the cost of a resume does not depend on the depth of the chain.
+ * With COCONUT_COMPACT there are no links for this, and cocall() is cosub().
+ */
+#ifndef COCONUT_COMPACT
+#define cocall(S,F) _co.coswitch = __LINE__; _cofallthrough case __LINE__: if (_cocall (&_co, (coconut_coro_t) &(S), (bool (*) (void *)) (F))) { return 1; }
+bool _cocall (coconut_coro_t me, coconut_coro_t sub, bool (*corofun) (void *));
+#else
+#define cocall(S,F) cosub ((((coconut_coro_t) &(S))->corofun = (bool (*) (void *)) (F)) (&(S)))
+#endif
 
 /* Exception handling is based on labels that MAY be declared after cobegin(), using
  * coexceptions { EXC_A, EXC_B, EXC_C }; note the braces.  When handling, one
@@ -146,15 +429,15 @@ void _codestroy (coconut_coro_t selfp);
  * skip this code if it hits upon it (making this a declaration).  When done,
  * exception handling continues to 
  */
-#define cocatch(E,F) if (0) while (1) if (1) goto EXCEPTION_ ## F; else EXCEPTION_ ## E:
-#define cocatch_done(E) if (0) while (1) if (1) codone (); else EXCEPTION_ ## E:
-#define cocatch_continue(E) if (0) while (1) if (1) conut_process (); else EXCEPTION_ ## E:
-#define cocatch_fatal(E) if (0) while (1) if (1) exit (1); else EXCEPTION_ ## E:
+#define cocatch(E,F) while (0) while (1) if (1) goto EXCEPTION_ ## F; else EXCEPTION_ ## E: _counused_label
+#define cocatch_done(E) while (0) while (1) if (1) codone () else EXCEPTION_ ## E: _counused_label
+#define cocatch_continue(E) while (0) while (1) if (1) conut_process (); else EXCEPTION_ ## E: _counused_label
+#define cocatch_fatal(E) while (0) while (1) if (1) exit (1); else EXCEPTION_ ## E: _counused_label
 
 /* Raise exceptions by jumping to special label values.
  */
 #define coraise(E) goto EXCEPTION_ ## E
-#define coraise_if(E,C) if (C) coraise (E) else { }
+#define coraise_if(E,C) if (C) { coraise (E); } else { }
 #define coraise_errno(E)       coraise_if (E,errno)
 #define coraise_zero(E,V)      coraise_if (E,(V)==0)
 #define coraise_nonzero(E,V)   coraise_if (E,(V)!=0)
@@ -166,13 +449,17 @@ void _codestroy (coconut_coro_t selfp);
 
 
 /* Use coresources { A, B, C } to declare resource names; note the braces.
- * The definition installs a cleanup routine that iterates over resource bits
- * and jumps to their respective cleanup operations, which then loop back to
- * the cleanup mechanism.  When nothing remains to be cleaned, the routine
- * jumps to the coend label.  Resources are cleaned in the order in which
- * they are declared in coresources.  TODO: separate routine can do the opposite.
+ * The definition installs a cleanup routine that jumps straight to the open
+ * resource bits and their respective cleanup operations, which then loop back
+ * to the cleanup mechanism.  This runs all cleanup actions in one entry of the
+ * coro.  When nothing remains to be cleaned, the routine returns 0, and
+ * _codestroy() leaves the coro at its end, so that it keeps returning 0 and
+ * does not run its cleanup again.  By default, resources are cleaned in the
+ * order in which they are declared in coresources; with codestroy_lifo() they
+ * are cleaned in the opposite order, which is the usual order for RAII.  The
+ * order is held in cleanpost while cleaning.
  */
-#define coresources _co.resopen = 0; while(0){ case -99999: coyield(); } enum _coresources
+#define coresources coflags_zero (&_co.resopen); while(0){ case -99996: case -99995: if (coflags_any (&_co.resopen)) { _co.coswitch = -100000 - ((_co.cleanpost == -99995)? coflags_highest (&_co.resopen): coflags_lowest (&_co.resopen)); goto _coloop; } _co.cleanpost = 0; return 0; } enum _coresources
 
 /* Define a cleanup todo, to be inserted at the place where the resource is created.
  * There is a variation with cleanup code, and one without.  For each resource, there
@@ -189,18 +476,18 @@ void _codestroy (coconut_coro_t selfp);
  * the other coro do this.
  */
 
-#define cocleantodo(R) _co.resopen |= (1<<(R))
-#define cocleandone(R) _co.resopen &= ~ (1<<(R))
+#define cocleantodo(R) coflags_set (&_co.resopen, (R))
+#define cocleandone(R) coflags_clear (&_co.resopen, (R))
 
-#define cocleanaction(R) if (0) while (1) if (1) { _co.coswitch = _co.cleanpost; goto _coloop; } else case -100000-(R): if (cocleandone (R), 1)
+#define cocleanaction(R) while (0) while (1) if (1) { _co.coswitch = _co.cleanpost; goto _coloop; } else if (1) case -100000-(R): if (cocleandone (R), 1)
 
-#define cocleantodoaction(R) if (1) cocleantodo (R) else while (1) if (1) { _co.coswitch = _co.cleanpost; goto _coloop; } else case -100000-(R): if (cocleandone (R), 1)
+#define cocleantodoaction(R) if (1) { cocleantodo (R); } else while (1) if (1) { _co.coswitch = _co.cleanpost; goto _coloop; } else if (1) case -100000-(R): if (cocleandone (R), 1)
 
 /* The cocleanwhen(R) invokes a cleanup action when the given resource is currently
  * open.  This is for example useful in exception handlers that want to assure that
  * certain resources are closed.
  */
-#define cocleanwhen(R) if (_co.resopen & (1<<(R))) { _co.cleanpost = __LINE__; _co.coswitch = -100000-(R); goto _coloop; case __LINE__: ; } else { }
+#define cocleanwhen(R) if (coflags_test (&_co.resopen, (R))) { _co.cleanpost = __LINE__; _co.coswitch = -100000-(R); goto _coloop; case __LINE__: ; } else { }
 
 /* The coread() and cowrite() macros expand to the more general minimax forms, then
  * invoke subroutines within a suitable context that allows them to leave.
@@ -222,8 +509,14 @@ void _codestroy (coconut_coro_t selfp);
 // #define comove(P,B,L) comove_minmax(P,B,1,L)
 // #define comove_minmax(P,B,M,L) _comoveprepminmax (P,B,M,L); case __LINE__: _coio = _comove_poll (P, &_coio); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; } /* TODO: release _coio */
 
-#define  conut_read(P,B,L) _coio=1;  conut_read_min ((P),(B),_coio,(L))
-#define conut_write(P,B,L) _coio=1; conut_write_min ((P),(B),_coio,(L))
+/* Pipe nuts are referred to by their conut number, as declared in copipenuts,
+ * and found in the array that follows the coro structure.  A pipe nut records
+ * its number when it is used, so its peer can find the coro to trigger.
+ */
+#define _conut_nut(P) (((coconut_pipenut_t) (&_co + 1)) + (P))
+
+#define  conut_read(P,B,L)  conut_read_min ((P),(B),1,(L))
+#define conut_write(P,B,L) conut_write_min ((P),(B),1,(L))
 
 /* Unfortunately we cannot return a pleasant value from coread() and cowrite()
  * because the coro structure makes them statements, not expressions.
@@ -232,29 +525,74 @@ void _codestroy (coconut_coro_t selfp);
  */
 #define conut_size() _coio
 
-#define  conut_read_min(P,B,M,L) conut_setupbuf ((P),0,(B),(L)) case __LINE__: _comove_sync ((P), &_coio); (M) = _coio
+#define  conut_read_min(P,B,M,L) conut_setupbuf ((P),0,(B),(L)); conut_sync ((P),(M))
 
-#define conut_write_min(P,B,M,L) conut_setupbuf ((P),1,(B),(L)) case __LINE__: _comove_sync ((P), &_coio); (M) = _coio
+#define conut_write_min(P,B,M,L) conut_setupbuf ((P),1,(B),(L)); conut_sync ((P),(M))
 
 //TODO// Possible form "comove_poll (P, &sz)) { coraise_neg (BAD,sz) ... continue; }"
 //TODO// Alt "comove_poll (P, &sz, TRIGGER); when (TRIGGER) { }; comove_process()
 // setupbuf sets actlen and offset to 0, sync updates minlen but will read at least 1
 // resetbuf is a shorthand for reset of actlen and offset and reuse of buf, maxlen
 
-void conut_setupbuf (coconut_pipenut_t pnut, bool wr, uint8_t *buf, size_t maxlen);
-void conut_resetbuf (coconut_pipenut_t pnet, bool wr);
+void _conut_setupbuf (coconut_pipenut_t pnut, uint16_t conut, bool wr, uint8_t *buf, size_t maxlen);
+void _conut_resetbuf (coconut_pipenut_t pnut, bool wr);
+int _conut_sync (coconut_pipenut_t pnut, size_t minlen);
+
+#define conut_setupbuf(P,W,B,L) _conut_setupbuf (_conut_nut (P), (P), (W), (uint8_t *) (B), (L))
+#define conut_resetbuf(P,W) _conut_resetbuf (_conut_nut (P), (W))
+#define conut_sync(P,M) _cofallthrough case __LINE__: _coio = _conut_sync (_conut_nut (P), (M)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
 
-#define conut_sync(P,sz) case __LINE__: _coio = _conut_sync (P, sz); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+/* Credit-based flow control lets a reader grant a number of writes to its
+ * writer with conut_credit_grant().  The writer does conut_credit_wait()
+ * before each write, which yields while no credits are left.  Afterwards,
+ * conut_size() holds the number of credits that remain.
+ */
+void _conut_credit_grant (coconut_pipenut_t pnut, uint32_t credits);
+int _conut_credit_take (coconut_pipenut_t pnut, uint16_t conut);
+#define conut_credit_grant(P,N) _conut_credit_grant (_conut_nut (P), (N))
+#define conut_credit_wait(P) _cofallthrough case __LINE__: _coio = _conut_credit_take (_conut_nut (P), (P)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+#define conut_credits(P) (_conut_nut (P)->credits)
+
+/* Backpressure metrics, in nanoseconds of cotime_now(), accumulated for each
+ * pipe nut while it waits for its peer.  Time blocked on full is spent as
+ * a writer, time blocked on empty is spent as a reader.  Reset them to 0 to
+ * start a new measurement.
+ */
+#ifndef COCONUT_COMPACT
+#define conut_blocked_full(P)  ((P)->blockfull)
+#define conut_blocked_empty(P) ((P)->blockempty)
+#else
+#define conut_blocked_full(P)  ((void) (P), (uint64_t) 0)
+#define conut_blocked_empty(P) ((void) (P), (uint64_t) 0)
+#endif
+
+
+/* Connect two conuts that have not been initialised, for use in a coronet
+ * factory.
+ */
+void conut_makepipe (coconut_pipenut_t a, coconut_pipenut_t b);
 
 //TODO// Interface to command conut processing (and possibly leaving the coro)
 //TODO// Usually, conut_process() is the "active" state of a coro after setup
-#define conut_process() goto -11999
 
 /* Return the highest-priority conut that is currently active, or -1 if none is.
  * Reset the flag when returning it.  The parameter is a pointer to the activity
  * flags of a coro.
  */
-int8_t _conut_active (uint32_t *activity);
+int16_t _conut_active (coflags_t *activity);
+
+/* Return the active conut among those in the set, or -1 if none is.  Reset the
+ * flag when returning it.  Without fairness this is the lowest-numbered one,
+ * as for _conut_active().  With fairness, the search starts just after the
+ * conut returned last time, as stored in *last, so every conut gets its turn.
+ */
+int16_t _conut_select (coflags_t *activity, coflags_t set, int16_t *last, bool fair);
+
+#if COCONUT_FLAG_WORDS == 1
+#define _coflags_all (~ (coflag_t) 0)
+#else
+extern const coflags_t _coflags_all;
+#endif
 
 /* Trigger an event with a conut in another coro.  This may even be run from
  * another pthread, so it is the one thing that enables thread crossover
@@ -262,7 +600,142 @@ int8_t _conut_active (uint32_t *activity);
  * TODO: Should we also add a way to pass variables?  Perhaps in each conut?
  * Or could we use conut communication between threads using atomic operations?
  */
-void conut_trigger (uint8_t conut, coconut_coro_t target);
+void conut_trigger (uint16_t conut, coconut_coro_t target);
+
+/* Trigger a peer that has just completed a rendezvous with us.  This is the
+ * same as conut_trigger(), except that a scheduler runs the peer right after
+ * the current coro, rather than behind all other ready coros.  This keeps the
+ * latency of request/response exchanges low.  The chain of such handoffs is
+ * bounded by the scheduler's handofflimit, so other coros still get a turn.
+ */
+void conut_handoff (uint16_t conut, coconut_coro_t target);
+
+/* Channels, combinators and shared memory pipes know the coro and conut to
+ * trigger for each of their ends.  An end consumes its own trigger before it
+ * looks at the other end, so a trigger that comes in after the look is kept.
+ * When it has to wait, it marks its coro as waiting and returns -EAGAIN, so
+ * a scheduler parks the coro until it is triggered, instead of running it
+ * again and again.  Pipe nuts do the same for the coro that holds them.  An
+ * end without a coro relies on polling, and is left alone.
+ */
+static inline void _conut_consume (coconut_coro_t co, uint16_t conut) {
+	if ((co != NULL) && (conut < COCONUT_FLAG_BITS)) {
+		coflags_clear (&co->activity, conut);
+	}
+}
+
+static inline int _conut_block (coconut_coro_t co) {
+	if (co != NULL) {
+		co->waiting = 1;
+	}
+	return -EAGAIN;
+}
+
+
+/* Typed channels are pipe nuts that always exchange one element of a type
+ * that is fixed when the coro data is declared, which is then passed to
+ * coroutine_decl() as usual.  For example,
+ *
+ * struct filter { cochannel (unsigned long) prev, next; ... };
+ *
+ * Since both ends exchange the same size, there is no need for minimum and
+ * maximum bookkeeping or partial transfers; the element is copied with a size
+ * that is known at compile time.  The element type is only used to type check
+ * at compile time; it overlays the peer pointer, so it does not occupy space
+ * and it must never be accessed.  Typed channels start out filled with zeroes,
+ * and are setup with cochannel_owner() and cochannel_makepipe(), the latter
+ * failing to compile when the ends differ in element type.  Owners are needed
+ * to trigger the other end; pass a NULL coro to rely on polling instead.
+ */
+typedef struct coconut_channel {
+	coconut_pipenut_st nut;		// The pipe nut; first, so a peer casts to us
+	coconut_coro_t coro;		// Coro holding this end, to trigger
+	uint16_t conut;			// Conut number to trigger in that coro
+} coconut_channel_st, *coconut_channel_t;
+
+#define cochannel(T) union { coconut_channel_st chan; T *_cotype; }
+
+#define cochannel_owner(C,O,N) ((C).chan.coro = (coconut_coro_t) (O), (C).chan.conut = (N))
+#ifdef __GNUC__
+#define _cotypecheck(A,B) ((void) sizeof (char [__builtin_types_compatible_p (__typeof__ (A), __typeof__ (B)) ? 1 : -1]))
+#else
+#define _cotypecheck(A,B) ((void) sizeof ((A) = (B)))
+#endif
+#define cochannel_makepipe(A,B) (_cotypecheck ((A)._cotype, (B)._cotype), conut_makepipe (&(A).chan.nut, &(B).chan.nut))
+
+/* Read or write one element over a typed channel, or send EOF.  These yield
+ * until done, and leave the outcome in conut_size(), being the element size,
+ * 0 for EOF or a negative errno value.  The variable must match the element
+ * type of the channel, or the code does not compile.  Reading and writing
+ * at both ends at the same time is reported as -EPROTO at both ends.
+ *
+ * The address of the variable is posted to the other end while waiting, and
+ * the copy is done from or into it when the other end arrives, which may be
+ * after a yield.  So the variable must live in the coro data, like self.x,
+ * and not in a local variable of the corofun, which is gone after a return.
+ */
+#define cochannel_write(C,V) _cofallthrough case __LINE__: _coio = _cochannel_sync (&(C).chan, (void *) &(V), sizeof (*(C)._cotype) + 0 * sizeof (_cotypecheck ((C)._cotype, &(V)), 0), 1); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+#define cochannel_read(C,V)  case __LINE__: _coio = _cochannel_sync (&(C).chan, (void *) &(V), sizeof (*(C)._cotype) + 0 * sizeof (_cotypecheck ((C)._cotype, &(V)), 0), 0); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+#define cochannel_close(C) _cochannel_close (&(C).chan)
+
+/* Exchange one element of a fixed size.  The first end to arrive posts its
+ * element, with ofs noting whether it writes.  The second end finds it, does
+ * the copy and marks completion for the first end in its len.  Errors are
+ * delivered once, and EOF is delivered as 0.  When inlined with a constant
+ * size, the copy is as fast as an assignment.
+ */
+static inline int _cochannel_sync (coconut_channel_t me, void *elem, size_t size, bool wr) {
+	coconut_channel_t peer = (coconut_channel_t) me->nut.peer;
+	_conut_consume (me->coro, me->conut);
+	int err = me->nut.err;
+	if (me->nut.len != 0) {
+		// The peer found our posted element and did the copy; any EOF or
+		// error that it sent after that is for the next call
+		me->nut.len = 0;
+		return size;
+	}
+	if (err != 0) {
+		me->nut.err = 0;
+		me->nut.buf = NULL;
+		return (err == EPIPE)? 0: -err;
+	}
+	if ((peer->nut.buf == NULL) || (peer->nut.len != 0)) {
+		// The peer is not ready yet; post our element, if not done yet
+		me->nut.buf = (uint8_t *) elem;
+		me->nut.ofs = wr;
+		return _conut_block (me->coro);
+	}
+	if (peer->nut.ofs == wr) {
+		me->nut.buf = peer->nut.buf = NULL;
+		peer->nut.err = EPROTO;
+		if (peer->coro != NULL) {
+			conut_trigger (peer->conut, peer->coro);
+		}
+		return -EPROTO;
+	}
+	if (wr) {
+		memcpy (peer->nut.buf, elem, size);
+	} else {
+		memcpy (elem, peer->nut.buf, size);
+	}
+	me->nut.buf = peer->nut.buf = NULL;
+	peer->nut.len = size;
+	if (peer->coro != NULL) {
+		conut_handoff (peer->conut, peer->coro);
+	}
+	return size;
+}
+
+/* Send EOF over a typed channel.  It is delivered to the other end as 0 on
+ * its next read.
+ */
+static inline void _cochannel_close (coconut_channel_t me) {
+	coconut_channel_t peer = (coconut_channel_t) me->nut.peer;
+	peer->nut.err = EPIPE;
+	if (peer->coro != NULL) {
+		conut_trigger (peer->conut, peer->coro);
+	}
+}
 
 /* Fixed conut activity codes, not actually assigned to pipe nuts but used for
  * initialisation and finalisation as requested from the outside.  These are
@@ -278,12 +751,15 @@ void conut_trigger (uint8_t conut, coconut_coro_t target);
  * The macros cocatch_initialise() and cocatch_finalise() indicate where
  * control can start working on these events when they are sent.
  * TODO: This looks like they are exceptions.  Are they, really?!?
+ *
+ * Like other conut numbers, they are sent with conut_trigger().  They follow
+ * the width of the activity flags, so they always are the topmost two.
  */
-#define conut_activity_initialise (1UL << 31)
-#define conut_activity_finalise   (1UL << 30)
+#define conut_activity_initialise (COCONUT_FLAG_BITS - 1)
+#define conut_activity_finalise   (COCONUT_FLAG_BITS - 2)
 
-#define cocatch_initialise() case -12000 - 31:
-#define cocatch_finalise()   case -12000 - 30:
+#define cocatch_initialise() _cofallthrough case -12000 - conut_activity_initialise:
+#define cocatch_finalise()   _cofallthrough case -12000 - conut_activity_finalise:
 
 /* Friendly aliases for a popular dialect.
  */
@@ -312,7 +788,7 @@ void conut_trigger (uint8_t conut, coconut_coro_t target);
  * To leave the handler early, use continue.  This will return control to the
  * event loop, just as is normally done when the end of the handler is reached.
  */
-#define copoll(e) if (0) while (1) if (1) goto _coeventloop; else case -12000-(e):
+#define copoll(e) while (0) while (1) if (1) goto _coeventloop; else if (1) case -12000-(e):
 
 /* Specify what conuts will be used in this coro.  The symbolic names will be
  * used to identify conuts in the utility functions, as well as to define the
@@ -321,13 +797,57 @@ void conut_trigger (uint8_t conut, coconut_coro_t target);
  *
  * copipenuts { MASTER, SLAVE1, SLAVE2, SLAVE3 };
  *
- * The earlier-mentioned pipe nuts take precedence over the later ones.
+ * The earlier-mentioned pipe nuts take precedence over the later ones.  The
+ * event loop yields before handling another event when the coro has run past
+ * its budget in a scheduler, as with coslice().
  *
  * This also declares the temporary variable for storage of conut_size() which
  * is therefore not retained across coro invocations.  TODO: Is it a good idea
  * to continue to be able to retrieve that outcome from the conut?
  */
-#define copipenuts size_t _coio = -EPIPE; while(0) { default: case -11999: _coeventloop: _co.coswitch = -12000 - _conut_active (&_co.activity); if (_co.coswitch == -11999) return 1; } goto _coloop; enum _copipenuts
+#define copipenuts ssize_t _coio = -EPIPE; while(0) { default: case -11999: _coeventloop: _counused_label if (coflags_any (&_co.activity) && _cosched_overrun ((coconut_coro_t) &_co)) { _co.coswitch = -11999; return 1; } _co.coswitch = -12000 - _conut_active (&_co.activity); if (_co.coswitch == -11999) return 1; goto _coloop; } enum _copipenuts
+
+/* The alternative copipenuts_fair declares conuts in the same way, but its
+ * event loop takes turns between the active conuts instead of favouring the
+ * earlier-mentioned ones.  This avoids starvation of the later conuts when
+ * the earlier ones are continually busy.  It keeps its turn apart from that
+ * of coalt(), so either can be used in the same coro without upsetting the
+ * other.
+ */
+#define copipenuts_fair ssize_t _coio = -EPIPE; while(0) { default: case -11999: _coeventloop: _counused_label if (coflags_any (&_co.activity) && _cosched_overrun ((coconut_coro_t) &_co)) { _co.coswitch = -11999; return 1; } _co.coswitch = -12000 - _conut_select (&_co.activity, _coflags_all, &_co.fairlast, 1); if (_co.coswitch == -11999) return 1; goto _coloop; } enum _copipenuts
+
+
+/* The coalt() construct waits for any of a set of conuts to be triggered, as
+ * in Occam's ALT.  The set is a coflags_t, formed by or-ing conut_bit() values
+ * when there is one word of flags, or filled with coflags_set() when there
+ * are more words.  A timeout in milliseconds can be given, or a negative value to wait
+ * forever.  Choose COALT_PRIORITY to favour the lowest-numbered conuts, or
+ * COALT_FAIR to take turns between them.  After coalt() the first triggered
+ * conut can be found in coalt_ready(), or it is -ETIMEDOUT.  The trigger is
+ * consumed by coalt(), and other triggers remain for later.
+ *
+ * The timeout is checked whenever the coro runs.  A scheduler parks a coro
+ * that waits in coalt(), and runs it again at its _co.altdeadline, which is
+ * reset to 0 when coalt() is done.
+ */
+#define COALT_PRIORITY 0
+#define COALT_FAIR     1
+
+#define conut_bit(P) _cobit (P)
+
+#define coalt(S,T,M) _co.altdeadline = ((T) < 0)? 0: cotime_now () + (uint64_t) (T) * 1000000; _cofallthrough case __LINE__: _coio = _coalt_select ((coconut_coro_t) selfp, (S), (M)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+#define coalt_ready() ((int) _coio)
+
+int _coalt_select (coconut_coro_t co, coflags_t set, bool fair);
+
+/* The current time in nanoseconds, from a monotonic clock.
+ */
+uint64_t cotime_now (void);
+
+/* Read the time in this thread from a virtual clock, or from the monotonic
+ * clock again when set to NULL.  This is used for simulation.
+ */
+void cotime_virtual (const uint64_t *clock);
 
 
 //TODO// Interface to welcome queued parties trying to connect; enqueue cur peer?
@@ -335,14 +855,607 @@ void conut_trigger (uint8_t conut, coconut_coro_t target);
 #define conut_next(P) _comovenext(P)
 #define conut_reconnect(P)
 
-void conut_error(P);
+/* Send an error to the peer of a conut, such as EIO when its data cannot be
+ * produced.  It is set at both ends, unless either has an error standing by,
+ * and the peer reports it once from its current or next sync.  EPIPE is for
+ * EOF and EAGAIN is reserved, so they are not accepted.
+ */
+void _conut_error (coconut_pipenut_t pnut, int err);
+#define conut_error(P,E) _conut_error (_conut_nut (P), (E))
 
 /* The copush() and copull() macros also expand to the longer macros, setting 0
  * for the maximum length and 1 for the minimum length; the only way that will
  * end is in an error, which usually is the EOF marker.
  */
-#define conut_push(P) cowrite_min ((P),NULL,1,0)
-#define conut_pull(P)  coread_min ((P),NULL,1,0)
+#define conut_push(P) conut_write_min ((P),NULL,1,0)
+#define conut_pull(P)  conut_read_min ((P),NULL,1,0)
+
+
+/* Fan-out and fan-in combinators extend pipe nuts to more than two parties.
+ * A multicast delivers each write from one writer to all its readers, in
+ * one pass over a shared buffer.  A merge interleaves the writes of many
+ * writers into one reader, without reconnecting at every EOF.  Ends of these
+ * combinators are setup by a coronet factory, just like conut_makepipe().
+ */
+typedef struct coconut_fanend {
+	coconut_coro_t coro;		// Coro holding this end of the combinator
+	uint16_t conut;			// Conut number to trigger in that coro
+	uint8_t state;			// COFAN_xxx state of this end
+	uint32_t round;			// Last multicast round picked up by a reader
+	uint8_t *buf;			// Merge: buffer posted by a writer
+	size_t ofs, len;		// Merge: offset taken and length posted
+	struct coconut_fanend *qnext;	// Merge: next writer queued for the reader
+} coconut_fanend_st, *coconut_fanend_t;
+
+#define COFAN_IDLE   0			// Nothing going on
+#define COFAN_POSTED 1			// Buffer posted, awaiting pickup
+#define COFAN_TAKEN  2			// Buffer picked up, completion to report
+#define COFAN_EOF    3			// Merge writer EOF taken, to report
+#define COFAN_CLOSED 4			// Merge writer closed after EOF
+#define COFAN_FAILED 5			// Dispatch write failed, to report
+
+typedef struct coconut_multicast {
+	uint8_t *buf;			// Shared buffer of the current round
+	size_t len;			// Length of the current round
+	uint32_t round;			// Round number, bumped on every write
+	uint16_t refcount;		// Readers still holding the current round
+	uint16_t numreaders;		// Number of readers below
+	bool eof;			// The writer sent EOF, which stays for all
+	coconut_fanend_st writer;	// The one writer
+	coconut_fanend_st readers [];	// All readers, each receiving all rounds
+} coconut_multicast_st, *coconut_multicast_t;
+
+typedef struct coconut_merge {
+	uint16_t numwriters;		// Number of writers below
+	uint16_t live;			// Writers that did not send EOF yet
+	coconut_fanend_t qhead, qtail;	// Writers with posted buffers, in order
+	coconut_fanend_st reader;	// The one reader
+	coconut_fanend_st writers [];	// All writers, interleaved in the reader
+} coconut_merge_st, *coconut_merge_t;
+
+coconut_multicast_t conut_multicast_new (uint16_t numreaders);
+void conut_multicast_writer (coconut_multicast_t mc, coconut_coro_t coro, uint16_t conut);
+void conut_multicast_reader (coconut_multicast_t mc, uint16_t idx, coconut_coro_t coro, uint16_t conut);
+#define conut_multicast_free(M) free (M)
+
+coconut_merge_t conut_merge_new (uint16_t numwriters);
+void conut_merge_reader (coconut_merge_t mg, coconut_coro_t coro, uint16_t conut);
+void conut_merge_writer (coconut_merge_t mg, uint16_t idx, coconut_coro_t coro, uint16_t conut);
+#define conut_merge_free(M) free (M)
+
+int _conut_multicast_write (coconut_multicast_t mc, uint8_t *buf, size_t len);
+int _conut_multicast_read (coconut_multicast_t mc, uint16_t idx, uint8_t *buf, size_t maxlen);
+int _conut_multicast_peek (coconut_multicast_t mc, uint16_t idx, const uint8_t **bufp);
+void _conut_multicast_release (coconut_multicast_t mc, uint16_t idx);
+int _conut_merge_write (coconut_merge_t mg, uint16_t idx, uint8_t *buf, size_t len);
+int _conut_merge_read (coconut_merge_t mg, uint8_t *buf, size_t maxlen);
+
+/* Use the combinators from within a coro.  These yield until done, and then
+ * leave the outcome in conut_size(), which is the length transferred, 0 for
+ * EOF or a negative errno value.  The writer to a multicast must not alter
+ * its buffer until the write completes.  A reader may use the shared buffer
+ * directly with conut_multicast_peek(), until it does conut_multicast_release().
+ */
+#define conut_multicast_write(M,B,L) _cofallthrough case __LINE__: _coio = _conut_multicast_write ((M), (uint8_t *) (B), (L)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+#define conut_multicast_read(M,I,B,L) _cofallthrough case __LINE__: _coio = _conut_multicast_read ((M), (I), (uint8_t *) (B), (L)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+#define conut_multicast_peek(M,I,BP) _cofallthrough case __LINE__: _coio = _conut_multicast_peek ((M), (I), (BP)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+#define conut_multicast_release(M,I) _conut_multicast_release ((M), (I))
+#define conut_merge_write(M,I,B,L) _cofallthrough case __LINE__: _coio = _conut_merge_write ((M), (I), (uint8_t *) (B), (L)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+#define conut_merge_read(M,B,L) _cofallthrough case __LINE__: _coio = _conut_merge_read ((M), (uint8_t *) (B), (L)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+
+
+/* A dispatcher distributes the writes of one writer over a pool of workers,
+ * always handing the next write to a worker that is waiting in read.  It
+ * is a load balancer for "one party submitting fragments of work".  Each
+ * worker coro provides a coconut_worker_st, with which it can join and leave
+ * the pool while it runs.  Like other combinators, the dispatcher can be
+ * allocated as a static or dynamic structure filled with zeroes.
+ */
+typedef struct coconut_worker {
+	struct coconut_worker *qnext;	// Next on the idle list of the dispatcher
+	struct coconut_worker *qprev;	// Previous on the idle list
+	coconut_coro_t coro;		// Worker coro to trigger when given work
+	uint16_t conut;			// Conut number to trigger in that coro
+	uint8_t state;			// CODISP_xxx state of the worker
+	uint8_t *buf;			// Buffer offered while idle
+	size_t max, got;		// Buffer size and length delivered
+} coconut_worker_st, *coconut_worker_t;
+
+#define CODISP_OUT       0		// Not a member of the pool
+#define CODISP_JOINED    1		// Member, but not waiting for work
+#define CODISP_IDLE      2		// Member, waiting on the idle list
+#define CODISP_DELIVERED 3		// Member, work delivered but not reported
+
+typedef struct coconut_dispatch {
+	coconut_worker_t idlehead, idletail;	// Idle workers, oldest first
+	coconut_fanend_st writer;	// The one writer, to trigger when pending
+	uint8_t state;			// COFAN_xxx state of the writer
+	uint8_t *buf;			// Pending write, when no worker was idle
+	size_t len;			// Length of the write
+} coconut_dispatch_st, *coconut_dispatch_t;
+
+void conut_dispatch_writer (coconut_dispatch_t d, coconut_coro_t coro, uint16_t conut);
+void conut_dispatch_join (coconut_dispatch_t d, coconut_worker_t w, coconut_coro_t coro, uint16_t conut);
+int conut_dispatch_leave (coconut_dispatch_t d, coconut_worker_t w);
+
+int _conut_dispatch_write (coconut_dispatch_t d, uint8_t *buf, size_t len);
+int _conut_dispatch_read (coconut_dispatch_t d, coconut_worker_t w, uint8_t *buf, size_t maxlen);
+
+#define conut_dispatch_write(D,B,L) _cofallthrough case __LINE__: _coio = _conut_dispatch_write ((D), (uint8_t *) (B), (L)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+#define conut_dispatch_read(D,W,B,L) _cofallthrough case __LINE__: _coio = _conut_dispatch_read ((D), (W), (uint8_t *) (B), (L)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+
+
+
+/* A shared memory pipe connects a writer and a reader in different processes,
+ * through a ring buffer in a memfd that both have mapped.  It is setup with
+ * conut_shm_pipe() before fork(), or in one process and passed to the other
+ * as file descriptors for conut_shm_attach().  Each side then takes its role
+ * with conut_shm_writer() or conut_shm_reader().
+ *
+ * Writes and reads behave as for other pipe nuts: a write completes once the
+ * reader has taken all of it, a zero-length write sends EOF, a read returns
+ * what it got or 0 for EOF, and writing to a closed reader fails with -EPIPE.
+ *
+ * Wakeups cross over through an eventfd per side, which is only written when
+ * the other side is waiting.  The event loop of each process polls the fd
+ * from conut_shm_fd() for input, and calls conut_shm_event() on it, which
+ * passes the wakeup on to conut_trigger().
+ */
+typedef struct coconut_shmring {
+	uint32_t size;			// Bytes in the data ring, a power of two
+	uint32_t head;			// Bytes written in total, by the writer
+	uint32_t tail;			// Bytes read in total, by the reader
+	uint32_t state;			// COSHM_EOF and COSHM_CLOSED flags
+	uint32_t waiting;		// COSHM_RWAIT and COSHM_WWAIT flags
+	uint8_t data [];		// The ring itself
+} coconut_shmring_st, *coconut_shmring_t;
+
+#define COSHM_EOF    0x0001		// The writer sent EOF
+#define COSHM_CLOSED 0x0002		// The reader closed
+#define COSHM_RWAIT  0x0001		// The reader waits for data
+#define COSHM_WWAIT  0x0002		// The writer waits for room or pickup
+
+typedef struct coconut_shmnut {
+	coconut_shmring_t ring;		// Shared ring, as mapped in this process
+	size_t mapsize;			// Size of the mapping
+	int memfd;			// Shared memory file descriptor
+	int evfd [2];			// Eventfds to wake the reader and the writer
+	bool writer;			// Set for the writer, cleared for the reader
+	bool busy;			// Writer: a write is in progress
+	size_t wofs;			// Writer: bytes of the write copied so far
+	uint32_t wend;			// Writer: ring position at end of the write
+	coconut_coro_t coro;		// Coro to trigger on wakeups
+	uint16_t conut;			// Conut number to trigger in that coro
+} coconut_shmnut_st, *coconut_shmnut_t;
+
+int conut_shm_pipe (coconut_shmnut_t n, size_t size);
+int conut_shm_attach (coconut_shmnut_t n, int memfd, int rfd, int wfd);
+void conut_shm_writer (coconut_shmnut_t n, coconut_coro_t coro, uint16_t conut);
+void conut_shm_reader (coconut_shmnut_t n, coconut_coro_t coro, uint16_t conut);
+void conut_shm_event (coconut_shmnut_t n);
+void conut_shm_close (coconut_shmnut_t n);
+void conut_shm_unmap (coconut_shmnut_t n);
+
+int _conut_shm_write (coconut_shmnut_t n, uint8_t *buf, size_t len);
+int _conut_shm_read (coconut_shmnut_t n, uint8_t *buf, size_t maxlen);
+
+#define conut_shm_fd(N) ((N)->evfd [(N)->writer? 1: 0])
+#define conut_shm_write(N,B,L) _cofallthrough case __LINE__: _coio = _conut_shm_write ((N), (uint8_t *) (B), (L)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+#define conut_shm_read(N,B,L) _cofallthrough case __LINE__: _coio = _conut_shm_read ((N), (uint8_t *) (B), (L)); if (_coio == -EAGAIN) { _co.coswitch = __LINE__; return 1; }
+
+
+/* Files can be passed through a coronet without copying their contents.  The
+ * cofile_reader coro maps a file and writes windows over its pipe nut, each
+ * pointing into the mapping; only the window structure is copied by the pipe.
+ * When a file cannot be mapped, such as a pipe or socket, it is read into a
+ * buffer instead, and its windows are not stable; two buffers alternate, so
+ * a window is only valid until the one after the next is read, which is after
+ * the sink has taken the next one.  Stable windows remain valid until EOF.
+ *
+ * The cofile_writer coro reads windows and writes them out with pwritev(),
+ * gathering up to batch bytes of stable windows into one system call.  With
+ * O_DIRECT it copies into an aligned buffer and writes whole blocks.  After
+ * EOF it writes what remains and closes the file, and when it ends, its err
+ * field holds 0 or the negative error of the read, write or close that failed.
+ *
+ * Both coros use the helpers below, which may also be used directly.
+ */
+#include <sys/uio.h>
+
+typedef struct coconut_window {
+	uint8_t *ptr;			// Start of the window, in the mapping
+	size_t len;			// Length of the window
+	uint64_t ofs;			// Offset of the window in the file
+	bool stable;			// Valid until EOF, not just the next window
+} coconut_window_st, *coconut_window_t;
+
+typedef struct coconut_filesrc {
+	int fd;				// The file being read
+	uint8_t *map;			// The mapped file, or NULL when streaming
+	size_t maplen;			// Length of the mapping
+	uint64_t pos;			// Offset of the next window
+	size_t window;			// Size of windows
+	uint8_t *buf;			// Two buffers for streaming, if not mapped
+	coconut_window_st win;		// The current window
+} coconut_filesrc_st, *coconut_filesrc_t;
+
+#define COFILE_IOVMAX 64
+#define COFILE_ALIGN  4096
+
+typedef struct coconut_filesink {
+	int fd;				// The file being written
+	uint64_t pos;			// Offset of the next write
+	size_t batch;			// Bytes to gather before writing
+	size_t pending;			// Bytes gathered but not yet written
+	int iovcnt;			// Windows gathered but not yet written
+	struct iovec iov [COFILE_IOVMAX]; // The gathered windows
+	uint8_t *dbuf;			// Aligned buffer for O_DIRECT, or NULL
+	coconut_window_st win;		// The window read by cofile_writer
+	int err;			// Error that ended cofile_writer, or 0
+} coconut_filesink_st, *coconut_filesink_t;
+
+int cofile_source_open (coconut_filesrc_t src, int fd, size_t window);
+ssize_t cofile_source_next (coconut_filesrc_t src);
+void cofile_source_close (coconut_filesrc_t src);
+
+int cofile_sink_open (coconut_filesink_t sink, int fd, size_t batch, bool direct);
+int cofile_sink_write (coconut_filesink_t sink, coconut_window_t win);
+int cofile_sink_flush (coconut_filesink_t sink);
+int cofile_sink_close (coconut_filesink_t sink);
+
+/* A scheduler runs coros that are ready, by calling cogo() on them.  Coros
+ * that yield are ready to run again.  Coros that are idle in their event loop,
+ * or that wait for a pipe nut or in coalt(), are parked until conut_trigger()
+ * wakes them up, or until the timeout of their coalt().  Coros that end are
+ * taken out of the scheduler.
+ *
+ * Every coro has a scheduling class, which is COSCHED_NORMAL when its fields
+ * are filled with zeroes, as done by coinit().  Latency-critical coros are
+ * always run first, so they get in at the first yield of any other coro.  Next
+ * come coros with a deadline, earliest deadline first, and then normal coros.
+ * Batch coros are run when nothing else is ready, and additionally once for
+ * every batchrate other coros, so they cannot starve completely.  Within a
+ * class, coros are run in order of becoming ready.
+ *
+ * Pipelines tend to hold many coros of only a few kinds.  When affinity is
+ * set, the scheduler runs up to that many coros with the same corofun in a row,
+ * picked from the first few in the queue of the same class, so their code stays
+ * in the caches.  Critical and deadline coros still go first.
+ *
+ * A coro that completes a rendezvous hands off to its peer with
+ * conut_handoff(), and the peer is then run next, unless a critical coro is
+ * ready.  Only one coro waits for this at a time; when another handoff comes
+ * in first, the older one goes to the queue for its class.  After handofflimit
+ * handoffs in a row, the queues are served first.
+ *
+ * A scheduler and its coros run in one thread.  Triggers from other threads
+ * are not yet safe while the coro is parked.
+ */
+#define COSCHED_NORMAL   0
+#define COSCHED_CRITICAL 1
+#define COSCHED_BATCH    2
+#define COSCHED_CLASSES  3
+
+#define COSCHED_OFF     0
+#define COSCHED_READY   1
+#define COSCHED_RUNNING 2
+#define COSCHED_PARKED  3
+
+typedef struct coconut_coroqueue {
+	coconut_coro_t head, tail;	// Coros linked through their next field
+} coconut_coroqueue_st, *coconut_coroqueue_t;
+
+typedef struct coconut_cotimer {
+	uint64_t when;			// The coalt() deadline of the coro
+	coconut_coro_t co;		// A parked coro, waiting in coalt()
+} coconut_cotimer_st, *coconut_cotimer_t;
+
+typedef struct coconut_scheduler {
+	coconut_coroqueue_st ready [COSCHED_CLASSES];	// Ready coros by class
+	coconut_coro_t *edf;		// Heap of ready coros with a deadline
+	unsigned edfcount, edfsize;	// Coros in the heap and room for them
+	coconut_cotimer_t timers;	// Heap of parked coros with a timeout
+	unsigned timercount, timersize;	// Timers in the heap and room for them
+	unsigned batchrate;		// Others run before a batch coro, 0 for any
+	unsigned batchwait;		// Others run since the last batch coro
+	unsigned parked;		// Number of parked coros
+	coconut_coro_t current;		// The coro being run, or NULL
+	coconut_coro_t owner;		// Coro to trigger on wakeups, or NULL
+	uint16_t ownernut;		// Conut to trigger in the owner
+	uint64_t slice;			// Time to run as a nested scheduler
+	uint64_t runtime;		// Total time spent as a nested scheduler
+	unsigned affinity;		// Same-corofun coros to run in a row, 0 for off
+	unsigned affinityrun;		// Same-corofun coros run in a row so far
+	bool (*lastfun) (void *);	// The corofun that was run last
+	uint8_t lastclass;		// The class of the coro that was run last
+	coconut_coro_t runnext;		// Coro handed off to, to run next, or NULL
+	unsigned handoffs;		// Handoffs run in a row so far
+	unsigned handofflimit;		// Handoffs to run in a row, 0 for none
+	bool accounting;		// Account the runtime of coros without budgets
+	uint64_t budget;		// Default time a coro may run, 0 for none
+	uint64_t runstart;		// When the current coro started, if accounted
+	uint64_t runend;		// When the current coro overruns, or 0
+	uint64_t reported;		// The runend of the last watchdog report
+	uint64_t overruns;		// Coro runs that took twice their budget
+	void (*watchdog) (coconut_coro_t co, uint64_t ran); // Reports overruns
+	struct coconut_simulator *sim;	// Simulation that runs the coros, or NULL
+} coconut_scheduler_st, *coconut_scheduler_t;
+
+/* A scheduler can itself be run as a coro, nested in another scheduler.  Each
+ * time it runs, it runs its own coros for a slice of time, or at least one of
+ * them, and then yields.  It parks when its own coros are all parked, and it
+ * ends when they have all ended.  Wakeups of its coros are passed up through
+ * conut_trigger() on the owner.  This isolates a coronet in a scheduler of its
+ * own, whose share of the outer scheduler is set by its class and slice, and
+ * whose use is accounted for in its runtime.
+ */
+typedef struct coconut_schedcoro {
+	coconut_coro_st coro;
+	coconut_scheduler_st sched;
+} coconut_schedcoro_st, *coconut_schedcoro_t;
+
+void cosched_init (coconut_scheduler_t s);
+void cosched_fini (coconut_scheduler_t s);
+int cosched_add (coconut_scheduler_t s, coconut_coro_t co);
+bool cosched_step (coconut_scheduler_t s);
+int cosched_run (coconut_scheduler_t s);
+void _cosched_wake (coconut_coro_t co);
+void _cosched_handoff (coconut_coro_t co);
+int _coschedule (coconut_coro_t co);
+void _cosched_purge (coconut_scheduler_t s);
+void cosched_nest (coconut_schedcoro_t sc, uint64_t slice);
+bool cosched_watchdog (coconut_scheduler_t s);
+void cosched_report (coconut_coro_t co, uint64_t ran);
+
+/* Set the scheduling class and deadline of a coro, before it is added to a
+ * scheduler.  The deadline is in cotime_now() units, or 0 for none.
+ */
+#ifndef COCONUT_COMPACT
+#define cosched_class(C,K,D) (((coconut_coro_t) (C))->schedclass = (K), ((coconut_coro_t) (C))->deadline = (D))
+#else
+#define cosched_class(C,K,D) (((coconut_coro_t) (C))->schedclass = (K), (void) (D))
+#endif
+
+/* Run a single coro, and whatever it creates, in a scheduler of its own.
+ */
+#define coschedule(C) _coschedule ((coconut_coro_t) (C))
+
+/* Yield if a latency-critical coro is waiting.  Long-running batch work can
+ * use this at convenient points, to let critical work preempt it.
+ */
+#define copreempt() if ((_co.sched != NULL) && (_co.sched->ready [COSCHED_CRITICAL].head != NULL)) coyield ()
+
+/* Test if a coro has run past its budget.  This only reads the clock when
+ * the scheduler has set a budget for the current run.
+ */
+static inline bool _cosched_overrun (coconut_coro_t co) {
+	return (co->sched != NULL) && (co->sched->runend != 0) && (cotime_now () >= co->sched->runend);
+}
+
+/* Yield if the coro has run past its budget.  Loops in a cobody that may run
+ * for long without blocking can use this in every round.  The event loop of
+ * copipenuts does the same before it handles the next event.
+ */
+#define coslice() if (_cosched_overrun ((coconut_coro_t) &_co)) coyield ()
+
+
+/* A simulator runs a coronet in virtual time, to study its performance and
+ * ordering without the hardware to run it on.  Coros are added to its sched
+ * with cosched_add(), as to any scheduler, and cosim_run() replaces
+ * cosched_run().  It runs single-threaded in a reproducible order, and while
+ * it runs, cotime_now() reads the virtual clock.
+ *
+ * Every coro is modelled as a stage with a processor of its own.  Each run of
+ * a coro takes runcost, plus whatever it charges with cosim_io().  A run that
+ * makes no progress only takes pollcost; it returns where it started, without
+ * charging time, counting items or waking another coro.  Coros that wait for
+ * a pipe nut are parked until woken, like those in their event loop.  A wakeup
+ * through a pipe arrives hopcost after the moment of the trigger, and a coro
+ * waiting in coalt() with a timeout is run at its deadline plus timercost.
+ * The virtual clock starts at 1, as cotime_now() values of 0 mean "not set".
+ * Coros that are ready at the same virtual time run in a random order, drawn
+ * from the seed, so different seeds try different interleavings.
+ *
+ * The report shows the throughput in items, as counted by coros with
+ * cosim_items(), per virtual second.  It lists the stages by busy time, and
+ * marks those that come close to the busiest as the critical path.  It also
+ * shows their queueing delay, which is the time that wakeups waited for the
+ * stage to finish its previous run, and the time that each conut was blocked
+ * on full or empty, which is the queueing delay per pipe.
+ */
+typedef struct coconut_simstage {
+	coconut_coro_t coro;		// The coro of this stage
+	uint64_t at;			// Virtual time of its next run
+	uint64_t key;			// Random order among runs at the same time
+	uint64_t free;			// Virtual time when its last run ended
+	uint64_t wokeat;		// When a wakeup arrived, or UINT64_MAX if none
+	uint64_t busy;			// Total virtual time running
+	uint64_t queued;		// Total virtual time wakeups waited
+	uint64_t runs;			// Number of runs
+	unsigned heapidx;		// Position in the heap, or UINT_MAX if not in it
+} coconut_simstage_st, *coconut_simstage_t;
+
+typedef struct coconut_simulator {
+	coconut_scheduler_st sched;	// Add coros here with cosched_add()
+	uint64_t now;			// The virtual clock
+	uint64_t runcost;		// Virtual time per run of a coro
+	uint64_t pollcost;		// Virtual time per run without progress
+	uint64_t hopcost;		// Virtual time for a wakeup to arrive
+	uint64_t timercost;		// Virtual time for a timeout to fire
+	uint64_t seed;			// State of the random order of ties
+	uint64_t items;			// Items counted with cosim_items()
+	uint64_t runs;			// Total number of runs
+	uint64_t wakes;			// Total number of wakeups sent
+	coconut_simstage_t stages;	// The stages, in the order they were added
+	unsigned count, size;		// Stages in use and room for them
+	unsigned *lookup;		// Hash from coro address to stage index + 1
+	unsigned lookupsize;		// Entries in the hash, a power of two
+	unsigned *heap;			// Stage indexes by virtual time of next run
+	unsigned heapcount;		// Stages in the heap
+	coconut_simstage_t current;	// The stage that is running, or NULL
+} coconut_simulator_st, *coconut_simulator_t;
+
+void cosim_init (coconut_simulator_t sim, uint64_t seed);
+void cosim_fini (coconut_simulator_t sim);
+int cosim_run (coconut_simulator_t sim, uint64_t until);
+void cosim_report (coconut_simulator_t sim, FILE *out);
+int _cosim_add (coconut_simulator_t sim, coconut_coro_t co);
+void _cosim_wake (coconut_coro_t co);
+void _cosim_charge (coconut_coro_t co, uint64_t cost, uint64_t items);
+
+/* Charge virtual time for I/O or other work that the simulation cannot see,
+ * and count items of throughput.  These do nothing outside a simulation.
+ */
+#define cosim_io(T)    _cosim_charge ((coconut_coro_t) &_co, (T), 0)
+#define cosim_items(N) _cosim_charge ((coconut_coro_t) &_co, 0, (N))
+
+/* Placement of a coronet over threads starts in its factory.  Each coro is
+ * added to a placement plan, and pipes made with coplace_makepipe() tie the
+ * coros at both ends into one group.  After that, coplace_assign() spreads the
+ * groups over CPUs, largest first to the least loaded CPU, so that tightly
+ * connected coros end up on the same core.  The factory then adds each coro
+ * to the scheduler of the thread for coplace_cpu().
+ *
+ * Threads pin themselves with coplace_pin().  Memory for coros and their pipe
+ * nuts can be taken from the NUMA node of a CPU with coplace_alloc(); this is
+ * done in whole pages, so it is best used for a group at a time.  Without
+ * NUMA support, the memory is still allocated but not bound to the node.
+ */
+typedef struct coconut_placement {
+	coconut_coro_t *coros;		// Coros in the plan, by index
+	uint16_t *group;		// Parent index in the group of each coro
+	int16_t *cpu;			// CPU assigned to each coro, or -1
+	unsigned count, size;		// Coros in the plan and room for them
+} coconut_placement_st, *coconut_placement_t;
+
+void coplace_init (coconut_placement_t p);
+void coplace_fini (coconut_placement_t p);
+int coplace_add (coconut_placement_t p, coconut_coro_t co);
+void coplace_link (coconut_placement_t p, unsigned a, unsigned b);
+void coplace_assign (coconut_placement_t p, const int *cpus, unsigned numcpus);
+int coplace_pin (int cpu);
+int coplace_node (int cpu);
+void *coplace_alloc (size_t size, int node);
+void coplace_free (void *mem, size_t size);
+
+/* Connect two conuts, of coros with the given plan indexes, and group them.
+ */
+#define coplace_makepipe(P,A,NA,B,NB) (conut_makepipe ((NA), (NB)), coplace_link ((P), (A), (B)))
+
+/* The CPU assigned to a coro by its plan index, or -1 if none.
+ */
+#define coplace_cpu(P,I) ((P)->cpu [(I)])
+
+
+/* A coronet can be saved to a snapshot file while it is quiescent, that is,
+ * while none of its coros is running, and then be restored on startup without
+ * reconstructing and priming it.  The coros must have their coclass set, as
+ * done by coinit_class(), because their code and size are found through it,
+ * and because the classes are identified by name in the snapshot.
+ *
+ * The snapshot is mapped back privately, and its coros are used right where
+ * they are in the mapping; do not free them individually.  Pointers between
+ * coros of the coronet, such as pipe nut peers, buffers inside coro data and
+ * the links of cocall(), are rebased to the mapping.  Pointers to anything
+ * outside the coronet cannot be saved, so they are refused by cocheckpoint()
+ * with -EXDEV.  This includes pointers in user data, which cocheckpoint()
+ * cannot see; these are left as they are.  A coro in a cocall() can only be
+ * saved along with its callers and the coros that it calls.  Restored coros
+ * are not in a scheduler, and they are not waiting or cancelled.  Deadlines,
+ * of coalt() and for scheduling, are saved as the time that was left, and
+ * they count from the restore; a deadline that had passed is due right away.
+ */
+typedef struct coconut_snapshot {
+	void *map;			// The mapped snapshot file
+	size_t maplen;			// Length of the mapping
+	unsigned count;			// Number of coros restored
+	coconut_coro_t *coros;		// The restored coros, in checkpoint order
+} coconut_snapshot_st, *coconut_snapshot_t;
+
+int cocheckpoint (const char *path, coconut_coro_t *coros, unsigned count);
+int corestore (coconut_snapshot_t snap, const char *path, const struct coclass *const *classes, unsigned numclasses);
+void corestore_free (coconut_snapshot_t snap);
+
+
+/* A coronet template describes a sub-network once, as a table of coros with
+ * their coclass and a table of edges between their conuts.  It is stamped out
+ * any number of times in one call, into one allocation that holds all copies.
+ * A ready-made image of one copy is built first, with every coro initialised
+ * as by coinit_class(), and that image is copied for each copy, after which
+ * only the pipe nut peers of the edges are linked.  This avoids setting up
+ * every coro and pipe nut field by field.
+ *
+ * Coros with an init function start with coswitch 0, and are then passed to
+ * init with their copy number and the arg from the template.  It is meant to
+ * set the args of a coroutine_args() coro, or to call the corofun once with
+ * the initialiser arguments that a coroutine() takes with coarg().  Coros
+ * without init start at their body, like after coinit().
+ *
+ * The memory is taken from a NUMA node with coplace_alloc(), or from any node
+ * when it is -1.  Conuts that are not connected by an edge are available for
+ * wiring between copies or to other coros, through cotemplate_conut().  The
+ * coros are not added to a scheduler; their schedclass is set from the
+ * template, so they can be added right away.  The copies are released together
+ * with cotemplate_free(), once their coros have all ended.
+ */
+typedef struct coconut_tmplcoro {
+	const struct coclass *coclass;	// Class of the coro, with its size
+	uint8_t schedclass;		// Scheduling class, as in cosched_class()
+	void (*init) (coconut_coro_t co, unsigned copy, void *arg); // or NULL
+	void *arg;			// Passed to init
+} coconut_tmplcoro_st, *coconut_tmplcoro_t;
+
+typedef struct coconut_tmpledge {
+	uint16_t a, anut;		// Coro index and conut at one end
+	uint16_t b, bnut;		// Coro index and conut at the other end
+} coconut_tmpledge_st, *coconut_tmpledge_t;
+
+typedef struct coconut_template {
+	const coconut_tmplcoro_st *coros;	// The coros in one copy
+	const coconut_tmpledge_st *edges;	// The pipes within one copy
+	uint16_t numcoros, numedges;
+} coconut_template_st, *coconut_template_t;
+
+typedef struct coconut_stamp {
+	const coconut_template_st *tmpl; // The template that was stamped out
+	uint8_t *mem;			// All copies, one after another
+	size_t memlen;			// Length of the allocation
+	size_t copysize;		// Distance between copies
+	size_t *offsets;		// Offset of each template coro in a copy
+	unsigned copies;		// Number of copies
+} coconut_stamp_st, *coconut_stamp_t;
+
+int cotemplate_stamp (coconut_stamp_t st, const coconut_template_st *tmpl, unsigned copies, int node);
+void cotemplate_free (coconut_stamp_t st);
+
+/* The coro at index I in copy N of a stamp, and its conut P.
+ */
+#define cotemplate_coro(S,N,I) ((coconut_coro_t) ((S)->mem + (size_t) (N) * (S)->copysize + (S)->offsets [(I)]))
+#define cotemplate_conut(S,N,I,P) (((coconut_pipenut_t) (cotemplate_coro ((S),(N),(I)) + 1)) + (P))
+
+
+/* A coronet is cancelled as a whole with cocancel().  Its coros are marked as
+ * cancelled and taken out of their schedulers, and all their conuts are reset
+ * with ECONNRESET, as are the conuts of their peers, so that pipe operations
+ * fail immediately instead of waiting for another coro.  Coros that wait in
+ * their event loop then get one more turn, with conut_activity_finalise set,
+ * for a cocatch_finalise() handler to run.  After that, the resources of every
+ * coro that has not ended are cleaned up as with codestroy().
+ *
+ * The turns and cleanups are done in batches by the calling thread and up to
+ * threads-1 helper threads, which only pays off for large coronets.  As the
+ * coros run concurrently then, their finalise handlers and cleanup actions
+ * must not share data beyond their own coro without synchronisation.  With
+ * threads set to 0 or 1, all is done by the calling thread.
+ *
+ * The coros need a coclass, to find their conuts, and none may be running.
+ * The scheduler must not run while this is done.  The coros are not freed.
+ */
+int cocancel (coconut_coro_t *coros, unsigned count, unsigned threads);
+
+/* Test if the coro is being cancelled, such as in a cleanup action.
+ */
+#define cocancelled() (_co.cancelled != 0)
 
 /* A naming convention: call with a coconut_coro_t or a struct that can be casted
  * to one (because its first field is that) and name it "selfp".  Then, in the
@@ -359,23 +1472,77 @@ void conut_error(P);
  * and it is also referenced from conew() and similar operations.  It is usually
  * declared as a constant global variable named coro_NAME_class.
  */
-typedef struct {
+typedef struct coclass {
 	char *coroname;
-	bool (*corofun) (void *, ...);
-	uint8_t conutcount;
+	bool (*corofun) (void *);
+	uint16_t conutcount;
 	size_t datasize;
 } coclass_st, *coclass_t;
 
+/* The memory footprint of a coclass, per instance, split into the parts that
+ * coconut adds and the user data.  A report over a number of classes, with
+ * the number of instances of each, shows where the memory of a program goes;
+ * with mostly idle coros, it tells whether COCONUT_COMPACT is worthwhile.
+ */
+typedef struct coconut_footprint {
+	size_t instance;		// Bytes per instance, the coclass datasize
+	size_t header;			// Bytes in the coconut_coro_st
+	size_t conuts;			// Bytes in pipe nuts
+	size_t user;			// Bytes in user data, including padding
+} coconut_footprint_st, *coconut_footprint_t;
+
+int cofootprint (const struct coclass *cls, coconut_footprint_t fp);
+void cofootprint_report (FILE *out, const struct coclass *const *classes, const unsigned long *counts, unsigned numclasses);
+
 #define coroutine(T,N) bool (N) ((T) *selfp, ...) { if (_co.coswitch != 0) goto _coloop; else
 #define coroutine_end }
 //--OR-- use 0 for the initialiser, and setup va_arg stuff for it
-#define coroutine(T,C,N) const coclass_st coro_ ## (N) ## _class = { # N ,  coro_ ## (N) ## _fun, (C), sizeof (coro_ ## (N)) }; bool coro_ ## (N) ## _fun ((T) *selfp, ...) { switch (_co.coswitch) { case 0: _co.coswitch = -99997; va_list coarg; va_start (coarg, selfp);
+#undef coroutine
+#undef coroutine_end
+#define coroutine(T,C,N) const coclass_st coro_ ## (N) ## _class = { # N ,  (bool (*) (void *)) coro_ ## (N) ## _fun, (C), sizeof (coro_ ## (N)) }; bool coro_ ## (N) ## _fun ((T) *selfp, ...) { switch (_co.coswitch) { case 0: _co.coswitch = -99997; va_list coarg; va_start (coarg, selfp);
 #define coroutine_end }
 
 //--ALT-DECL--
 #define coroutine_decl(T,C,N) bool (N) ((T) *selfp, ...); typedef coro_ ## (N) { coconut_coro_st coro; coconut_pipenut_st pipes [(C)]; user (T); }; extern coclass_st coro_ ## (N) ## _class;
+#undef self
+#undef _co
 #define self (selfp->user)
 #define _co (selfp->coro)
 
+/* Typed initialiser arguments replace the va_list of coarg().  The argument
+ * type is declared along with the coro, as coro_N_args, and coinit_args()
+ * copies the arguments into the coro, where the initialiser finds them in
+ * coargs.  The corofun then has a fixed signature, so cogo() calls it like
+ * any other function and compilers can inline it where it is called directly.
+ * The arguments stay in the coro, so keep them small.
+ *
+ * The coro is defined with coroutine_args() and its body starts with
+ * cobody_typed instead of cobody, as there is no va_list to end.
+ *
+ * coroutine_decl_args (struct filter, 2, sieve, struct { unsigned long prime; });
+ * coinit_args (*flt, sieve, .prime = 7);
+ */
+#define coroutine_decl_args(T,C,N,...) typedef __VA_ARGS__ coro_ ## N ## _args; typedef struct coro_ ## N { coconut_coro_st coro; coconut_pipenut_st pipes [C]; T user; coro_ ## N ## _args args; } coro_ ## N; bool N (coro_ ## N *selfp); extern const coclass_st coro_ ## N ## _class
+#define coroutine_args(T,C,N) const coclass_st coro_ ## N ## _class = { # N, (bool (*) (void *)) N, C, sizeof (coro_ ## N) }; bool N (coro_ ## N *selfp) { _coloop: _counused_label switch (_co.coswitch) { case 0: _co.coswitch = -99997;
+#define coroutine_args_end } return 0; }
+#define cobody_typed while (1) if (0) { case -99998: _codestroy ((coconut_coro_t)selfp); return 0; } else if (1) case -99997:
+#define coargs (selfp->args)
+#define coinit_args(C,N,...) coinit ((C), N); ((coconut_coro_t)(&(C)))->coswitch = 0; (C).args = (coro_ ## N ## _args) { __VA_ARGS__ }
+#define coinit_args_class(C,N,...) coinit_args ((C), N, __VA_ARGS__); ((coconut_coro_t)(&(C)))->coclass = &coro_ ## N ## _class
+
+
+/* The library coros for file sources and sinks.  The reader is initialised
+ * with a file descriptor and a window size, and writes coconut_window_st
+ * structures to its out conut, followed by EOF.  The writer is initialised
+ * with a file descriptor, a batch size and a flag for O_DIRECT, and reads
+ * the windows from its in conut until EOF.
+ */
+coroutine_decl_args (coconut_filesrc_st, 1, cofile_reader, struct { int fd; size_t window; });
+coroutine_decl_args (coconut_filesink_st, 1, cofile_writer, struct { int fd; size_t batch; bool direct; });
+
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* COCONUT_H */
@@ -0,0 +1,462 @@
+#ifndef COCONUT_HPP
+#define COCONUT_HPP
+
+/* C++20 interoperability for Coconut.
+ *
+ * A coconut::task is a C++20 coroutine that runs as a coconut coro.  It can be
+ * added to the same scheduler as coros written with coconut.h, it is woken up
+ * by conut_trigger() in the same way, and it exchanges data with them over
+ * typed channels and the combinators.  Operations that would block in a coro
+ * are awaited in a task, as in "co_await chan.read (value)".
+ *
+ * A task also holds COCONUT_TASK_CONUTS pipe nuts right after its coro, just
+ * like a coro declared with copipenuts.  They connect to the pipe nuts of other
+ * coros with conut_makepipe() on task.conut(i), and a coconut::conut names one
+ * inside the task, as in "co_await out.write (buf, len)".
+ *
+ * When an operation returns -EAGAIN, the task suspends and leaves the retry
+ * with its coro.  The next time the scheduler runs the coro, the operation is
+ * tried again, and the task is only resumed when it completes.  A coro with a
+ * pending operation parks in the scheduler, like a coro that waits in its
+ * event loop, so the operation must trigger the task when it makes progress.
+ * Channels and combinators do this when their owner is set to task.co().
+ *
+ * Awaitables live in the coroutine frame and are inlined, so they add nothing
+ * beyond the retry pointers.  The frame of a task itself does escape, since
+ * the scheduler holds on to it, so it is allocated once when the task starts.
+ */
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+#include <type_traits>
+
+#include "coconut.h"
+
+
+#ifndef COCONUT_TASK_CONUTS
+#define COCONUT_TASK_CONUTS 2
+#endif
+
+namespace coconut {
+
+
+namespace detail {
+
+/* The part of a resource that its task knows about, to clean it up when the
+ * coro of the task is destroyed.  Linked resources have a bit in resopen.
+ */
+struct resource_link {
+	resource_link *next = nullptr;
+	resource_link **prevp = nullptr;	// Where we are linked, if we are
+	coconut_coro_t co = nullptr;
+	uint16_t bit = 0;
+	void (*cleanfun) (resource_link *) = nullptr;
+
+	void link (resource_link **head) {
+		next = *head;
+		if (next != nullptr) {
+			next->prevp = &next;
+		}
+		prevp = head;
+		*head = this;
+		coflags_set (&co->resopen, bit);
+	}
+	void unlink () {
+		if (prevp != nullptr) {
+			*prevp = next;
+			if (next != nullptr) {
+				next->prevp = prevp;
+			}
+			prevp = nullptr;
+			next = nullptr;
+			coflags_clear (&co->resopen, bit);
+		}
+	}
+	/* Take over the place of another link, as when a resource is moved.
+	 */
+	void replace (resource_link &other) {
+		co = other.co;
+		bit = other.bit;
+		next = std::exchange (other.next, nullptr);
+		prevp = std::exchange (other.prevp, nullptr);
+		if (prevp != nullptr) {
+			*prevp = this;
+			if (next != nullptr) {
+				next->prevp = &next;
+			}
+		}
+	}
+};
+
+} /* namespace detail */
+
+
+/* A task is a move-only handle to a C++20 coroutine that runs as a coro.  It
+ * starts suspended; add task.co() to a scheduler to run it, or call cogo()
+ * on it.  The frame is destroyed along with the task handle.
+ *
+ * Destroying the coro with codestroy() or cocancel() cleans up the resources
+ * that the task linked to it, and leaves the task at its end without resuming
+ * it.  The frame itself stays until the task handle is destroyed.
+ */
+class task {
+public:
+	struct promise_type {
+		coconut_coro_st coro { };	// First, so the coro leads to us
+		coconut_pipenut_st pipes [COCONUT_TASK_CONUTS] { };	// Right after coro, as in copipenuts
+		int (*retry) (void *) = nullptr;	// Operation to retry, if any
+		void *retryctx = nullptr;	// Awaitable holding that operation
+		detail::resource_link *resources = nullptr;	// Linked to resopen
+		std::exception_ptr error;	// Exception escaping from the task
+
+		task get_return_object () {
+			coro.corofun = &task::run;
+			coro.coswitch = -99997;
+			return task (std::coroutine_handle<promise_type>::from_promise (*this));
+		}
+		std::suspend_always initial_suspend () noexcept { return { }; }
+		std::suspend_always final_suspend () noexcept { return { }; }
+		void return_void () { }
+		void unhandled_exception () { error = std::current_exception (); }
+	};
+
+	task (task &&other) noexcept : handle (std::exchange (other.handle, nullptr)) { }
+	task &operator= (task &&other) noexcept {
+		if (this != &other) {
+			destroy ();
+			handle = std::exchange (other.handle, nullptr);
+		}
+		return *this;
+	}
+	task (const task &) = delete;
+	task &operator= (const task &) = delete;
+	~task () { destroy (); }
+
+	/* The coro to add to a scheduler, or to own channels and combinators.
+	 */
+	coconut_coro_t co () { return &handle.promise ().coro; }
+
+	/* A pipe nut of the task, to connect with conut_makepipe().
+	 */
+	coconut_pipenut_t conut (uint16_t nr) { return &handle.promise ().pipes [nr]; }
+
+	bool done () const { return handle.done () || (handle.promise ().coro.coswitch == -99998); }
+
+	/* Rethrow an exception that ended the task, if any.
+	 */
+	void rethrow () {
+		if (handle.promise ().error) {
+			std::rethrow_exception (handle.promise ().error);
+		}
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle;
+
+	explicit task (std::coroutine_handle<promise_type> h) : handle (h) { }
+
+	void destroy () {
+		if (handle) {
+			handle.destroy ();
+			handle = nullptr;
+		}
+	}
+
+	/* Clean up the linked resources in the order of their bits, as in the
+	 * cleanup routine of coresources.  Bits without a resource are dropped.
+	 */
+	static void clean (promise_type &pr, bool lifo) {
+		while (coflags_any (&pr.coro.resopen)) {
+			int bit = lifo? coflags_highest (&pr.coro.resopen): coflags_lowest (&pr.coro.resopen);
+			detail::resource_link *res = pr.resources;
+			while ((res != nullptr) && (res->bit != bit)) {
+				res = res->next;
+			}
+			if (res != nullptr) {
+				res->cleanfun (res);
+			} else {
+				coflags_clear (&pr.coro.resopen, bit);
+			}
+		}
+	}
+
+	/* The corofun of a task.  It retries a pending operation, and resumes the
+	 * task only when that completes.  The coro looks idle in its event loop
+	 * while an operation is pending, so a scheduler parks it until triggered.
+	 * When entered for cleanup, it cleans the resources and stops the task.
+	 */
+	static bool run (void *co) {
+		static_assert (std::is_standard_layout_v<promise_type>);
+		static_assert (offsetof (promise_type, pipes) == sizeof (coconut_coro_st));
+		promise_type &pr = *reinterpret_cast<promise_type *> (co);
+		if ((pr.coro.coswitch == -99996) || (pr.coro.coswitch == -99995)) {
+			clean (pr, pr.coro.coswitch == -99995);
+			pr.coro.cleanpost = 0;
+			pr.retry = nullptr;
+			return 0;
+		}
+		if (pr.coro.coswitch == -99998) {
+			return 0;
+		}
+		coflags_zero (&pr.coro.activity);
+		if (pr.retry != nullptr) {
+			if (pr.retry (pr.retryctx) == -EAGAIN) {
+				pr.coro.coswitch = -11999;
+				return 1;
+			}
+			pr.retry = nullptr;
+		}
+		auto h = std::coroutine_handle<promise_type>::from_promise (pr);
+		h.resume ();
+		if (h.done ()) {
+			return 0;
+		}
+		pr.coro.coswitch = (pr.retry != nullptr)? -11999: -99997;
+		return 1;
+	}
+};
+
+static_assert (COCONUT_TASK_CONUTS > 0);
+
+
+/* An awaitable operation, that is tried until it stops returning -EAGAIN.
+ * The result of co_await is what the operation returned last.
+ */
+template <typename Op>
+class pending {
+public:
+	explicit pending (Op op) : op (std::move (op)) { }
+
+	bool await_ready () {
+		result = op ();
+		return result != -EAGAIN;
+	}
+	void await_suspend (std::coroutine_handle<task::promise_type> h) {
+		h.promise ().retry = &pending::retry;
+		h.promise ().retryctx = this;
+	}
+	int await_resume () { return result; }
+
+private:
+	Op op;
+	int result = -EAGAIN;
+
+	static int retry (void *ctx) {
+		pending *me = static_cast<pending *> (ctx);
+		return me->result = me->op ();
+	}
+};
+
+/* Give other coros a turn, like coyield() in a coro.
+ */
+inline std::suspend_always yield () { return { }; }
+
+/* The coro of the running task, as in "coconut_coro_t me = co_await
+ * coconut::this_coro ()".  The task does not actually suspend for this.
+ */
+class this_coro {
+public:
+	bool await_ready () { return false; }
+	bool await_suspend (std::coroutine_handle<task::promise_type> h) {
+		co = &h.promise ().coro;
+		return false;
+	}
+	coconut_coro_t await_resume () { return co; }
+
+private:
+	coconut_coro_t co = nullptr;
+};
+
+
+/* A transfer over a pipe nut of the task, as with conut_read() and
+ * conut_write() in a coro.  It finds the pipe nut when the task awaits it.
+ */
+class transfer {
+public:
+	transfer (uint16_t nr, bool wr, void *buf, size_t len, size_t min)
+		: nr (nr), wr (wr), buf ((uint8_t *) buf), len (len), min (min) { }
+
+	bool await_ready () { return false; }
+	bool await_suspend (std::coroutine_handle<task::promise_type> h) {
+		nut = &h.promise ().pipes [nr];
+		_conut_setupbuf (nut, nr, wr, buf, len);
+		if (retry (this) != -EAGAIN) {
+			return false;
+		}
+		h.promise ().retry = &transfer::retry;
+		h.promise ().retryctx = this;
+		return true;
+	}
+	int await_resume () { return result; }
+
+private:
+	coconut_pipenut_t nut = nullptr;
+	uint16_t nr;
+	bool wr;
+	uint8_t *buf;
+	size_t len, min;
+	int result = -EAGAIN;
+
+	static int retry (void *ctx) {
+		transfer *me = static_cast<transfer *> (ctx);
+		return me->result = _conut_sync (me->nut, me->min);
+	}
+};
+
+/* A pipe nut of the running task, by its conut number.  The result of reading
+ * or writing is what conut_size() would be in a coro; a read of 0 is EOF,
+ * which is sent with close().
+ */
+class conut {
+public:
+	explicit conut (uint16_t nr) : nr (nr) { }
+
+	transfer read (void *buf, size_t maxlen, size_t minlen = 1) { return transfer (nr, 0, buf, maxlen, minlen); }
+	transfer write (const void *buf, size_t len) { return transfer (nr, 1, const_cast<void *> (buf), len, 1); }
+	transfer close () { return transfer (nr, 1, nullptr, 0, 1); }
+
+private:
+	uint16_t nr;
+};
+
+
+/* A typed channel, compatible with cochannel(T) in coros.  It is connected
+ * with makepipe() to another channel<T> or to a cochannel(T) of a coro.
+ */
+template <typename T>
+class channel {
+public:
+	coconut_channel_st chan { };
+
+	static_assert (std::is_trivially_copyable_v<T>);
+
+	void owner (coconut_coro_t coro, uint16_t conut) {
+		chan.coro = coro;
+		chan.conut = conut;
+	}
+	auto read (T &value) {
+		return pending ([this, &value] { return _cochannel_sync (&chan, &value, sizeof (T), 0); });
+	}
+	auto write (const T &value) {
+		return pending ([this, &value] { return _cochannel_sync (&chan, const_cast<T *> (&value), sizeof (T), 1); });
+	}
+	void close () { _cochannel_close (&chan); }
+};
+
+template <typename T>
+inline void makepipe (channel<T> &a, channel<T> &b) {
+	conut_makepipe (&a.chan.nut, &b.chan.nut);
+}
+
+/* Connect to a cochannel(T) in a coro; its element type must be T.
+ */
+template <typename T, typename C>
+inline void makepipe (channel<T> &a, C &b) {
+	static_assert (std::is_same_v<decltype (b._cotype), T *>, "channel element types differ");
+	conut_makepipe (&a.chan.nut, &b.chan.nut);
+}
+
+
+/* The combinators, as awaitable operations.
+ */
+inline auto multicast_write (coconut_multicast_t mc, void *buf, size_t len) {
+	return pending ([=] { return _conut_multicast_write (mc, (uint8_t *) buf, len); });
+}
+inline auto multicast_read (coconut_multicast_t mc, uint16_t idx, void *buf, size_t maxlen) {
+	return pending ([=] { return _conut_multicast_read (mc, idx, (uint8_t *) buf, maxlen); });
+}
+inline auto merge_write (coconut_merge_t mg, uint16_t idx, void *buf, size_t len) {
+	return pending ([=] { return _conut_merge_write (mg, idx, (uint8_t *) buf, len); });
+}
+inline auto merge_read (coconut_merge_t mg, void *buf, size_t maxlen) {
+	return pending ([=] { return _conut_merge_read (mg, (uint8_t *) buf, maxlen); });
+}
+inline auto dispatch_write (coconut_dispatch_t d, void *buf, size_t len) {
+	return pending ([=] { return _conut_dispatch_write (d, (uint8_t *) buf, len); });
+}
+inline auto dispatch_read (coconut_dispatch_t d, coconut_worker_t w, void *buf, size_t maxlen) {
+	return pending ([=] { return _conut_dispatch_read (d, w, (uint8_t *) buf, maxlen); });
+}
+inline auto shm_write (coconut_shmnut_t n, void *buf, size_t len) {
+	return pending ([=] { return _conut_shm_write (n, (uint8_t *) buf, len); });
+}
+inline auto shm_read (coconut_shmnut_t n, void *buf, size_t maxlen) {
+	return pending ([=] { return _conut_shm_read (n, (uint8_t *) buf, maxlen); });
+}
+
+
+/* A resource that is cleaned up unless it was marked done, like one that is
+ * flagged with cocleantodo() in a coro and cleared with cocleandone().  The
+ * cleanup runs when the handle goes out of scope, which includes destruction
+ * of the task.  Handles can be moved but not copied.
+ *
+ * Given the coro of the task and a resource bit, the resource is flagged in
+ * resopen with cocleantodo() until done() or clean(), and codestroy() on the
+ * coro runs the cleanup, just like a cleanup action in a coro.
+ */
+template <typename T, typename Cleanup>
+class resource : private detail::resource_link {
+public:
+	resource (T value, Cleanup cleanup) : value (std::move (value)), cleanup (std::move (cleanup)), todo (true) { }
+	resource (coconut_coro_t co, uint16_t bit, T value, Cleanup cleanup)
+		: resource (std::move (value), std::move (cleanup)) {
+		this->co = co;
+		this->bit = bit;
+		this->cleanfun = &resource::cleaner;
+		link (&reinterpret_cast<task::promise_type *> (co)->resources);
+	}
+	resource (resource &&other) noexcept
+		: value (std::move (other.value)), cleanup (std::move (other.cleanup)), todo (std::exchange (other.todo, false)) {
+		this->cleanfun = &resource::cleaner;
+		replace (other);
+	}
+	resource &operator= (resource &&other) noexcept {
+		if (this != &other) {
+			clean ();
+			value = std::move (other.value);
+			cleanup = std::move (other.cleanup);
+			todo = std::exchange (other.todo, false);
+			replace (other);
+		}
+		return *this;
+	}
+	resource (const resource &) = delete;
+	resource &operator= (const resource &) = delete;
+	~resource () { clean (); }
+
+	/* Keep the resource, as with cocleandone().
+	 */
+	void done () {
+		todo = false;
+		unlink ();
+	}
+
+	/* Clean up now, instead of when going out of scope.
+	 */
+	void clean () {
+		unlink ();
+		if (todo) {
+			todo = false;
+			cleanup (value);
+		}
+	}
+
+	T &get () { return value; }
+	T *operator-> () { return &value; }
+
+private:
+	T value;
+	Cleanup cleanup;
+	bool todo;
+
+	static void cleaner (detail::resource_link *link) {
+		static_cast<resource *> (link)->clean ();
+	}
+};
+
+
+} /* namespace coconut */
+
+#endif /* COCONUT_HPP */
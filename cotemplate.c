@@ -0,0 +1,138 @@
+
+#include "coconut.h"
+
+#include <errno.h>
+#include <stdint.h>
+
+
+/* Each coro in a copy starts at a cache line boundary, so that coros of
+ * different copies, which may run on different threads, do not share lines.
+ */
+#define COTMPL_ALIGN 64
+
+#define cotmpl_conut(base,ofs,P) (((coconut_pipenut_t) ((coconut_coro_t) ((base) + (ofs)) + 1)) + (P))
+
+
+/* Stamp out copies of a template.  Returns 0 or a negative error; -EINVAL for
+ * a template with coros that lack a proper coclass, or with edges that do not
+ * fit the coros or use a conut twice, and -ENOMEM.
+ */
+int cotemplate_stamp (coconut_stamp_t st, const coconut_template_st *tmpl, unsigned copies, int node) {
+	uint8_t *image = NULL;
+	size_t ofs = 0;
+	unsigned i, n;
+	int retval = 0;
+	memset (st, 0, sizeof (*st));
+	st->tmpl = tmpl;
+	if ((tmpl->numcoros == 0) || (copies == 0)) {
+		return -EINVAL;
+	}
+	st->offsets = calloc (tmpl->numcoros, sizeof (size_t));
+	if (st->offsets == NULL) {
+		return -ENOMEM;
+	}
+	//
+	// Layout one copy, and check the coros and edges against their classes
+	for (i = 0; i < tmpl->numcoros; i++) {
+		const struct coclass *cls = tmpl->coros [i].coclass;
+		if ((cls == NULL) || (cls->datasize < sizeof (coconut_coro_st) + cls->conutcount * sizeof (coconut_pipenut_st))) {
+			retval = -EINVAL;
+			goto fail;
+		}
+		st->offsets [i] = ofs;
+		ofs += (cls->datasize + COTMPL_ALIGN - 1) & ~ (size_t) (COTMPL_ALIGN - 1);
+	}
+	st->copysize = ofs;
+	for (i = 0; i < tmpl->numedges; i++) {
+		const coconut_tmpledge_st *e = &tmpl->edges [i];
+		if ((e->a >= tmpl->numcoros) || (e->anut >= tmpl->coros [e->a].coclass->conutcount) ||
+		    (e->b >= tmpl->numcoros) || (e->bnut >= tmpl->coros [e->b].coclass->conutcount) ||
+		    ((e->a == e->b) && (e->anut == e->bnut))) {
+			retval = -EINVAL;
+			goto fail;
+		}
+	}
+	//
+	// Build the image of one copy; its peers only serve to find conuts used twice
+	image = calloc (1, st->copysize);
+	if (image == NULL) {
+		retval = -ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < tmpl->numcoros; i++) {
+		const coconut_tmplcoro_st *tc = &tmpl->coros [i];
+		coconut_coro_t co = (coconut_coro_t) (image + st->offsets [i]);
+		coinit_class (*co, tc->coclass);
+		co->schedclass = tc->schedclass;
+		if (tc->init != NULL) {
+			co->coswitch = 0;
+		}
+	}
+	for (i = 0; i < tmpl->numedges; i++) {
+		const coconut_tmpledge_st *e = &tmpl->edges [i];
+		coconut_pipenut_t pa = cotmpl_conut (image, st->offsets [e->a], e->anut);
+		coconut_pipenut_t pb = cotmpl_conut (image, st->offsets [e->b], e->bnut);
+		if ((pa->peer != NULL) || (pb->peer != NULL)) {
+			retval = -EINVAL;
+			goto fail;
+		}
+		pa->peer = pb;
+		pb->peer = pa;
+	}
+	for (i = 0; i < tmpl->numedges; i++) {
+		const coconut_tmpledge_st *e = &tmpl->edges [i];
+		cotmpl_conut (image, st->offsets [e->a], e->anut)->peer = NULL;
+		cotmpl_conut (image, st->offsets [e->b], e->bnut)->peer = NULL;
+	}
+	//
+	// Copy the image into place for each copy, and link the peers within it
+	if (copies > SIZE_MAX / st->copysize) {
+		retval = -ENOMEM;
+		goto fail;
+	}
+	st->memlen = copies * st->copysize;
+	st->mem = coplace_alloc (st->memlen, node);
+	if (st->mem == NULL) {
+		retval = -ENOMEM;
+		goto fail;
+	}
+	st->copies = copies;
+	for (n = 0; n < copies; n++) {
+		uint8_t *base = st->mem + (size_t) n * st->copysize;
+		memcpy (base, image, st->copysize);
+		for (i = 0; i < tmpl->numedges; i++) {
+			const coconut_tmpledge_st *e = &tmpl->edges [i];
+			coconut_pipenut_t pa = cotmpl_conut (base, st->offsets [e->a], e->anut);
+			coconut_pipenut_t pb = cotmpl_conut (base, st->offsets [e->b], e->bnut);
+			pa->peer = pb;
+			pb->peer = pa;
+		}
+	}
+	free (image);
+	//
+	// Run the initialisers, now that all copies are in place
+	for (n = 0; n < copies; n++) {
+		for (i = 0; i < tmpl->numcoros; i++) {
+			const coconut_tmplcoro_st *tc = &tmpl->coros [i];
+			if (tc->init != NULL) {
+				(*tc->init) (cotemplate_coro (st, n, i), n, tc->arg);
+			}
+		}
+	}
+	return 0;
+fail:
+	free (image);
+	cotemplate_free (st);
+	return retval;
+}
+
+
+/* Release all copies of a stamp at once.
+ */
+void cotemplate_free (coconut_stamp_t st) {
+	if (st->mem != NULL) {
+		coplace_free (st->mem, st->memlen);
+	}
+	free (st->offsets);
+	memset (st, 0, sizeof (*st));
+}
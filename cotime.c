@@ -0,0 +1,26 @@
+
+#include <time.h>
+
+#include "coconut.h"
+
+
+/* Coconut timing is based on a monotonic clock, in nanoseconds.  It is used
+ * for timeouts and accounting, not for the time of day.
+ */
+static __thread const uint64_t *cotime_clock;
+
+uint64_t cotime_now (void) {
+	if (cotime_clock != NULL) {
+		return *cotime_clock;
+	}
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+
+/* Simulations run on a virtual clock, which is only seen by their thread.
+ */
+void cotime_virtual (const uint64_t *clock) {
+	cotime_clock = clock;
+}
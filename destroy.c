@@ -1,18 +1,36 @@
-
 #include "coconut.h"
 
-void _codestroy (coconut_coro_t selfp) {
-	unsigned long flag = ~0;
-	int cleaner = -100000 + 1 - 8*(int)sizeof (flag);
-	flag = flag ^ (flag >> 1);
-	if (_co.resopen) {
+/* Cleanup of resources enters the coro once, at the cleanup routine that was
+ * installed by coresources.  That routine finds the open resources with a bit
+ * scan and runs their cleanup actions one after another, in the order that
+ * was set in cleanpost.  A cleanup action that yields will be resumed until
+ * the routine signals that it is done by clearing cleanpost.  Note that
+ * such an action cannot wait for another coro when the cleanup is run from
+ * inside the coro itself, as happens in coend().
+ *
+ * Afterwards, the coro is left at its end, so that it keeps returning 0.
+ * The coro is accessed directly here, as its user type is not known.
+ */
+static void _codestroy_order (coconut_coro_t co, int order) {
+	if (coflags_any (&co->resopen)) {
+		co->cleanpost = order;
+		co->coswitch = order;
 		do {
-			if (_co.resopen & flag) {
-				_co.coswitch = cleaner;
-				_co.cleanpost = -99999;
-				_co.corofun (&_co);
-			}
-		} while (cleaner++, flag >>= 1);
+			co->corofun (co);
+		} while (co->cleanpost == order);
 	}
+	co->coswitch = -99998;
+}
+
+/* Cleanup resources in the order in which they were declared.
+ */
+void _codestroy (coconut_coro_t co) {
+	_codestroy_order (co, -99996);
 }
 
+/* Cleanup resources in the opposite order of their declaration, so that
+ * later resources that may depend on earlier ones are cleaned first.
+ */
+void _codestroy_lifo (coconut_coro_t co) {
+	_codestroy_order (co, -99995);
+}
@@ -0,0 +1,184 @@
+
+#include "coconut.h"
+
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+
+/* A dispatcher hands out work from one writer to a pool of worker coros.
+ * Each write goes to a worker that is currently waiting in a read, so the
+ * work ends up with whoever is idle, rather than with whoever was first to
+ * connect, as is the case with the queue of a plain pipe nut.
+ *
+ * Workers waiting in read are kept on an idle list, oldest first, so handing
+ * out work and taking it are both O(1).  When no worker is idle, the write
+ * is left pending and the first worker to come in takes it.  Workers may
+ * join and leave at any time, including while they are idle.
+ *
+ * The worker structures are provided by the worker coros, usually as part of
+ * their data.  A zero-length write closes the dispatcher, and from then on
+ * all workers read EOF.  Workers must offer a buffer that is large enough for
+ * any write; when they do not, the write fails with -EPROTO.
+ *
+ * The writer and the workers consume their triggers when they are called,
+ * and mark their coro as waiting when they return -EAGAIN, so a scheduler
+ * parks idle workers and a writer with a pending write until they are given
+ * something to do.
+ *
+ * The same implementation assumptions apply as for pipe nuts, so no two
+ * threads should be operating on the same dispatcher at the same time.
+ */
+
+
+void conut_dispatch_writer (coconut_dispatch_t d, coconut_coro_t coro, uint16_t conut) {
+	assert (d->writer.coro == NULL);
+	d->writer.coro = coro;
+	d->writer.conut = conut;
+}
+
+
+/* Take a worker off the idle list, wherever it is on it.
+ */
+static void dispatch_unlink (coconut_dispatch_t d, coconut_worker_t w) {
+	if (w->qprev == NULL) {
+		d->idlehead = w->qnext;
+	} else {
+		w->qprev->qnext = w->qnext;
+	}
+	if (w->qnext == NULL) {
+		d->idletail = w->qprev;
+	} else {
+		w->qnext->qprev = w->qprev;
+	}
+	w->qnext = w->qprev = NULL;
+}
+
+
+/* Join a worker to the dispatcher.  It will be given work once it reads.
+ * The dispatcher is not touched until then, but it is passed for symmetry
+ * with conut_dispatch_leave().
+ */
+void conut_dispatch_join (coconut_dispatch_t d, coconut_worker_t w, coconut_coro_t coro, uint16_t conut) {
+	(void) d;
+	assert (w->state == CODISP_OUT);
+	w->coro = coro;
+	w->conut = conut;
+	w->qnext = w->qprev = NULL;
+	w->state = CODISP_JOINED;
+}
+
+/* Leave the dispatcher.  This is possible at any time, except when work has
+ * been delivered but not yet been reported by the read; in that case the
+ * worker should finish the read first, and -EBUSY is returned.
+ */
+int conut_dispatch_leave (coconut_dispatch_t d, coconut_worker_t w) {
+	if (w->state == CODISP_DELIVERED) {
+		return -EBUSY;
+	}
+	if (w->state == CODISP_IDLE) {
+		dispatch_unlink (d, w);
+	}
+	w->state = CODISP_OUT;
+	return 0;
+}
+
+
+/* Write to the first idle worker, or leave the write pending until a worker
+ * comes in to read.  Returns -EAGAIN until it is taken, and then the length
+ * that was written, or 0 for EOF.
+ */
+int _conut_dispatch_write (coconut_dispatch_t d, uint8_t *buf, size_t len) {
+	coconut_worker_t w;
+	_conut_consume (d->writer.coro, d->writer.conut);
+	switch (d->state) {
+	case COFAN_POSTED:
+		return _conut_block (d->writer.coro);
+	case COFAN_TAKEN:
+		d->state = COFAN_IDLE;
+		return d->len;
+	case COFAN_FAILED:
+		d->state = COFAN_IDLE;
+		return -EPROTO;
+	case COFAN_CLOSED:
+		return -EPIPE;
+	default:
+		break;
+	}
+	if (len == 0) {
+		// EOF; deliver it to all idle workers, and later to the others
+		d->state = COFAN_CLOSED;
+		while ((w = d->idlehead) != NULL) {
+			dispatch_unlink (d, w);
+			w->got = 0;
+			w->state = CODISP_DELIVERED;
+			conut_trigger (w->conut, w->coro);
+		}
+		return 0;
+	}
+	w = d->idlehead;
+	if (w == NULL) {
+		// Nobody is idle; whoever comes in first can take it
+		d->buf = buf;
+		d->len = len;
+		d->state = COFAN_POSTED;
+		return _conut_block (d->writer.coro);
+	}
+	if (len > w->max) {
+		return -EPROTO;
+	}
+	dispatch_unlink (d, w);
+	memcpy (w->buf, buf, len);
+	w->got = len;
+	w->state = CODISP_DELIVERED;
+	conut_trigger (w->conut, w->coro);
+	return len;
+}
+
+
+/* Read as a worker.  When a write is pending it is taken right away,
+ * otherwise the worker is put on the idle list and -EAGAIN is returned
+ * until work is delivered to it.  The return value is the length read,
+ * or 0 after the dispatcher was closed.
+ */
+int _conut_dispatch_read (coconut_dispatch_t d, coconut_worker_t w, uint8_t *buf, size_t maxlen) {
+	_conut_consume (w->coro, w->conut);
+	switch (w->state) {
+	case CODISP_IDLE:
+		return _conut_block (w->coro);
+	case CODISP_DELIVERED:
+		w->state = CODISP_JOINED;
+		return w->got;
+	case CODISP_OUT:
+		return -ENOTCONN;
+	default:
+		break;
+	}
+	if (d->state == COFAN_CLOSED) {
+		return 0;
+	}
+	if (d->state == COFAN_POSTED) {
+		// Take the pending write and report back to the writer
+		conut_trigger (d->writer.conut, d->writer.coro);
+		if (d->len > maxlen) {
+			d->state = COFAN_FAILED;
+		} else {
+			memcpy (buf, d->buf, d->len);
+			d->state = COFAN_TAKEN;
+			return d->len;
+		}
+	}
+	// Wait on the idle list, after all others that are already waiting
+	w->buf = buf;
+	w->max = maxlen;
+	w->qnext = NULL;
+	w->qprev = d->idletail;
+	if (d->idletail == NULL) {
+		d->idlehead = w;
+	} else {
+		d->idletail->qnext = w;
+	}
+	d->idletail = w;
+	w->state = CODISP_IDLE;
+	return _conut_block (w->coro);
+}
@@ -0,0 +1,273 @@
+
+#include "coconut.h"
+
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+
+/* Fan-out and fan-in combinators for pipe nuts.  Plain pipe nuts connect two
+ * coros, and any others that want to use the same pipe queue up until EOF.
+ * The combinators below permit more parties on a pipe at the same time:
+ *
+ * MULTICAST: One writer delivers each write to all N readers.  The buffer of
+ *	the writer is shared by the readers, and a reference count tracks how
+ *	many readers still need to pick up the current round.  When it drops
+ *	to zero, the writer is triggered and its write completes.  Readers may
+ *	copy the data out, or peek into the shared buffer without copying and
+ *	release it when done.  A zero-length write is an EOF to all readers,
+ *	which they keep seeing when they read again, as on a plain pipe nut.
+ *
+ * MERGE: N writers deliver into one reader.  Writers post their buffer and
+ *	are queued in order of arrival, which is fair because nobody can post
+ *	twice before being served.  The reader takes data from the head of
+ *	that queue.  A zero-length write closes only that writer; the reader
+ *	sees EOF when all writers have closed.  No reconnection is needed
+ *	between writers, as there would be on a plain pipe nut.
+ *
+ * Like pipe nuts, the combinators return -EAGAIN when the coro should yield
+ * and try again later, and the peers are triggered when progress is made.
+ * Each end consumes its trigger when it is called, and marks its coro as
+ * waiting when it returns -EAGAIN, so that a scheduler parks it.
+ * The same implementation assumptions apply as for pipe nuts, so no two
+ * threads should be operating on the same combinator at the same time.
+ */
+
+
+/* Create a multicast combinator for the given number of readers.  It is
+ * filled with zeroes, and the ends should be setup with the functions
+ * conut_multicast_writer() and conut_multicast_reader() before use.
+ * Returns NULL when out of memory.
+ */
+coconut_multicast_t conut_multicast_new (uint16_t numreaders) {
+	coconut_multicast_t mc = calloc (1, sizeof (coconut_multicast_st) +
+				numreaders * sizeof (coconut_fanend_st));
+	if (mc != NULL) {
+		mc->numreaders = numreaders;
+	}
+	return mc;
+}
+
+void conut_multicast_writer (coconut_multicast_t mc, coconut_coro_t coro, uint16_t conut) {
+	assert (mc->writer.coro == NULL);
+	mc->writer.coro = coro;
+	mc->writer.conut = conut;
+}
+
+void conut_multicast_reader (coconut_multicast_t mc, uint16_t idx, coconut_coro_t coro, uint16_t conut) {
+	assert (idx < mc->numreaders);
+	assert (mc->readers [idx].coro == NULL);
+	mc->readers [idx].coro = coro;
+	mc->readers [idx].conut = conut;
+}
+
+
+/* Write to all readers of a multicast.  The first call publishes the buffer
+ * as the next round and triggers all readers; later calls return -EAGAIN
+ * until the last reader has released the round.  The buffer must not be
+ * changed until then, as the readers may be looking into it.  The return
+ * value is the length written, which is 0 for EOF.  After EOF, further
+ * writes return -EPIPE.
+ */
+int _conut_multicast_write (coconut_multicast_t mc, uint8_t *buf, size_t len) {
+	uint16_t i;
+	_conut_consume (mc->writer.coro, mc->writer.conut);
+	if (mc->writer.state == COFAN_POSTED) {
+		if (mc->refcount > 0) {
+			// Some readers have not been served yet
+			return _conut_block (mc->writer.coro);
+		}
+		mc->writer.state = COFAN_IDLE;
+		return mc->len;
+	}
+	if (mc->eof) {
+		return -EPIPE;
+	}
+	// Publish a new round and wakeup all readers
+	mc->buf = buf;
+	mc->len = len;
+	mc->eof = (len == 0);
+	mc->round++;
+	mc->refcount = mc->numreaders;
+	if (mc->refcount == 0) {
+		return len;
+	}
+	mc->writer.state = COFAN_POSTED;
+	for (i = 0; i < mc->numreaders; i++) {
+		conut_trigger (mc->readers [i].conut, mc->readers [i].coro);
+	}
+	return _conut_block (mc->writer.coro);
+}
+
+
+/* Peek into the shared buffer of the current multicast round, without copying.
+ * The return value is the length available at *bufp, 0 for EOF or -EAGAIN
+ * when no new round has been published yet.  The reference on the buffer
+ * is held until _conut_multicast_release() is called; peeking again in the
+ * meantime returns the same round, which is useful after a coyield().  Once
+ * a reader has taken the EOF round, it gets EOF again without a reference,
+ * and releasing it is harmless.
+ */
+int _conut_multicast_peek (coconut_multicast_t mc, uint16_t idx, const uint8_t **bufp) {
+	coconut_fanend_t me = &mc->readers [idx];
+	_conut_consume (me->coro, me->conut);
+	if (me->state != COFAN_TAKEN) {
+		if (mc->eof && (me->round == mc->round)) {
+			*bufp = NULL;
+			return 0;
+		}
+		if ((mc->writer.state != COFAN_POSTED) || (me->round == mc->round)) {
+			return _conut_block (me->coro);
+		}
+		me->round = mc->round;
+		me->state = COFAN_TAKEN;
+	}
+	*bufp = mc->buf;
+	return mc->len;
+}
+
+/* Release the reference to the current multicast round.  The last reader to
+ * do this triggers the writer, whose write then completes.
+ */
+void _conut_multicast_release (coconut_multicast_t mc, uint16_t idx) {
+	coconut_fanend_t me = &mc->readers [idx];
+	if (mc->eof && (me->state != COFAN_TAKEN)) {
+		return;
+	}
+	assert (me->state == COFAN_TAKEN);
+	me->state = COFAN_IDLE;
+	if (--mc->refcount == 0) {
+		conut_trigger (mc->writer.conut, mc->writer.coro);
+	}
+}
+
+/* Read the current multicast round into a local buffer.  This is a peek with
+ * a copy and a release, and it returns the same values.  A reader buffer that
+ * is too small for the round returns -EPROTO, after having released it.
+ */
+int _conut_multicast_read (coconut_multicast_t mc, uint16_t idx, uint8_t *buf, size_t maxlen) {
+	const uint8_t *shared;
+	int len = _conut_multicast_peek (mc, idx, &shared);
+	if (len < 0) {
+		return len;
+	}
+	if ((size_t) len > maxlen) {
+		len = -EPROTO;
+	} else if (len > 0) {
+		memcpy (buf, shared, len);
+	}
+	_conut_multicast_release (mc, idx);
+	return len;
+}
+
+
+/* Create a merge combinator for the given number of writers.  It is filled
+ * with zeroes, and the ends should be setup with the functions
+ * conut_merge_reader() and conut_merge_writer() before use.
+ * Returns NULL when out of memory.
+ */
+coconut_merge_t conut_merge_new (uint16_t numwriters) {
+	coconut_merge_t mg = calloc (1, sizeof (coconut_merge_st) +
+				numwriters * sizeof (coconut_fanend_st));
+	if (mg != NULL) {
+		mg->numwriters = numwriters;
+		mg->live = numwriters;
+	}
+	return mg;
+}
+
+void conut_merge_reader (coconut_merge_t mg, coconut_coro_t coro, uint16_t conut) {
+	assert (mg->reader.coro == NULL);
+	mg->reader.coro = coro;
+	mg->reader.conut = conut;
+}
+
+void conut_merge_writer (coconut_merge_t mg, uint16_t idx, coconut_coro_t coro, uint16_t conut) {
+	assert (idx < mg->numwriters);
+	assert (mg->writers [idx].coro == NULL);
+	mg->writers [idx].coro = coro;
+	mg->writers [idx].conut = conut;
+}
+
+
+/* Write into a merge.  The first call posts the buffer in the queue towards
+ * the reader; later calls return -EAGAIN until the reader has taken all of
+ * it.  The return value is the length written, which is 0 for EOF.  After
+ * EOF, this writer is closed and further writes return -EPIPE.
+ */
+int _conut_merge_write (coconut_merge_t mg, uint16_t idx, uint8_t *buf, size_t len) {
+	coconut_fanend_t me = &mg->writers [idx];
+	_conut_consume (me->coro, me->conut);
+	switch (me->state) {
+	case COFAN_POSTED:
+		return _conut_block (me->coro);
+	case COFAN_TAKEN:
+		me->state = COFAN_IDLE;
+		return me->len;
+	case COFAN_EOF:
+		me->state = COFAN_CLOSED;
+		return 0;
+	case COFAN_CLOSED:
+		return -EPIPE;
+	default:
+		break;
+	}
+	// Post the buffer at the end of the reader's queue
+	me->buf = buf;
+	me->len = len;
+	me->ofs = 0;
+	me->qnext = NULL;
+	me->state = COFAN_POSTED;
+	if (mg->qtail == NULL) {
+		mg->qhead = me;
+	} else {
+		mg->qtail->qnext = me;
+	}
+	mg->qtail = me;
+	conut_trigger (mg->reader.conut, mg->reader.coro);
+	return _conut_block (me->coro);
+}
+
+
+/* Read from a merge.  Data is taken from the writer at the head of the queue,
+ * and a writer is only triggered when all its data has been taken, so one
+ * write is never interleaved with another.  Writers that send EOF are closed
+ * silently.  The return value is the length read, 0 when all writers have
+ * closed, or -EAGAIN when no writer has posted anything.  A maxlen of 0 could
+ * not be told apart from EOF, so it is refused with -EINVAL.
+ */
+int _conut_merge_read (coconut_merge_t mg, uint8_t *buf, size_t maxlen) {
+	coconut_fanend_t w;
+	size_t len;
+	if (maxlen == 0) {
+		return -EINVAL;
+	}
+	_conut_consume (mg->reader.coro, mg->reader.conut);
+	while ((w = mg->qhead) != NULL) {
+		if (w->len == 0) {
+			// EOF from this writer; close it and look further
+			mg->qhead = w->qnext;
+			w->state = COFAN_EOF;
+			mg->live--;
+			conut_trigger (w->conut, w->coro);
+			continue;
+		}
+		len = w->len - w->ofs;
+		if (len > maxlen) {
+			len = maxlen;
+		}
+		memcpy (buf, w->buf + w->ofs, len);
+		w->ofs += len;
+		if (w->ofs == w->len) {
+			mg->qhead = w->qnext;
+			w->state = COFAN_TAKEN;
+			conut_trigger (w->conut, w->coro);
+		}
+		if (mg->qhead == NULL) {
+			mg->qtail = NULL;
+		}
+		return len;
+	}
+	mg->qtail = NULL;
+	return (mg->live == 0)? 0: _conut_block (mg->reader.coro);
+}
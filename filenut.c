@@ -0,0 +1,353 @@
+
+#define _GNU_SOURCE
+
+#include "coconut.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* File sources pass windows into a mapping, so the data is not copied into a
+ * buffer by read() and then again by the pipe nut.  The kernel is told that
+ * the mapping is read sequentially, so it can drop pages behind it, and the
+ * window after the current one is requested ahead of time.  Windows are not
+ * dropped explicitly, as a sink may still be gathering them.
+ */
+
+
+/* Setup a file source for a file descriptor, which it will close.  Returns 0
+ * or a negative error, in which case the file has been closed already.
+ */
+int cofile_source_open (coconut_filesrc_t src, int fd, size_t window) {
+	struct stat st;
+	memset (src, 0, sizeof (*src));
+	src->fd = fd;
+	src->window = (window > 0)? window: 65536;
+	if ((fstat (fd, &st) == 0) && S_ISREG (st.st_mode) && (st.st_size > 0)) {
+		src->maplen = st.st_size;
+		src->map = mmap (NULL, src->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (src->map != MAP_FAILED) {
+			madvise (src->map, src->maplen, MADV_SEQUENTIAL);
+			return 0;
+		}
+		src->map = NULL;
+	}
+	// Not a mappable file, so stream it through a buffer
+	posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	src->buf = malloc (2 * src->window);
+	if (src->buf == NULL) {
+		close (fd);
+		src->fd = -1;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+
+/* Move to the next window, and return its length, or 0 at EOF, or a negative
+ * error.  The window is in src->win.
+ */
+ssize_t cofile_source_next (coconut_filesrc_t src) {
+	coconut_window_t win = &src->win;
+	if (src->map == NULL) {
+		// Alternate between two buffers, so the sink can still be writing one
+		uint8_t *buf = (win->ptr == src->buf)? src->buf + src->window: src->buf;
+		ssize_t got = read (src->fd, buf, src->window);
+		if (got < 0) {
+			return -errno;
+		}
+		win->ptr = buf;
+		win->len = got;
+		win->ofs = src->pos;
+		win->stable = 0;
+		src->pos += got;
+		return got;
+	}
+	size_t len = src->maplen - src->pos;
+	if (len > src->window) {
+		len = src->window;
+	}
+	win->ptr = src->map + src->pos;
+	win->len = len;
+	win->ofs = src->pos;
+	win->stable = 1;
+	src->pos += len;
+	if (src->pos < src->maplen) {
+		// Read ahead, so the next window is already in memory when needed
+		uint64_t ahead = src->pos & ~ (uint64_t) (COFILE_ALIGN - 1);
+		size_t aheadlen = src->window;
+		if (ahead + aheadlen > src->maplen) {
+			aheadlen = src->maplen - ahead;
+		}
+		madvise (src->map + ahead, aheadlen, MADV_WILLNEED);
+	}
+	return len;
+}
+
+
+/* Close the file source.  Its windows are no longer valid after this.
+ */
+void cofile_source_close (coconut_filesrc_t src) {
+	if (src->map != NULL) {
+		munmap (src->map, src->maplen);
+		src->map = NULL;
+	}
+	free (src->buf);
+	src->buf = NULL;
+	if (src->fd >= 0) {
+		close (src->fd);
+		src->fd = -1;
+	}
+}
+
+
+/* File sinks gather windows and write them with one pwritev() per batch.
+ * Windows that are not stable are written before their source can reuse
+ * their buffer, along with all that was gathered before them.
+ *
+ * With O_DIRECT, the data bypasses the page cache but needs aligned buffers,
+ * offsets and lengths, so windows are copied into an aligned buffer that is
+ * written in whole blocks.  The tail of the file is written without O_DIRECT.
+ */
+
+
+/* Setup a file sink for a file descriptor, which it will close.  The batch
+ * size is rounded up to whole blocks.  Returns 0 or a negative error, in
+ * which case the file has been closed already.
+ */
+int cofile_sink_open (coconut_filesink_t sink, int fd, size_t batch, bool direct) {
+	memset (sink, 0, sizeof (*sink));
+	sink->fd = fd;
+	if (batch == 0) {
+		batch = 1 << 20;
+	}
+	sink->batch = (batch + COFILE_ALIGN - 1) & ~ (size_t) (COFILE_ALIGN - 1);
+	if (direct) {
+		int retval = 0;
+		int flags = fcntl (fd, F_GETFL);
+		if ((flags < 0) || (fcntl (fd, F_SETFL, flags | O_DIRECT) != 0)) {
+			retval = -errno;
+		} else if (posix_memalign ((void **) &sink->dbuf, COFILE_ALIGN, sink->batch) != 0) {
+			sink->dbuf = NULL;
+			retval = -ENOMEM;
+		}
+		if (retval < 0) {
+			close (fd);
+			sink->fd = -1;
+			return retval;
+		}
+	}
+	return 0;
+}
+
+
+/* Write out what was gathered.  In O_DIRECT mode, only whole blocks are
+ * written, and the rest stays in the buffer.  Returns 0 or a negative error.
+ */
+int cofile_sink_flush (coconut_filesink_t sink) {
+	int iovofs = 0;
+	if (sink->dbuf != NULL) {
+		size_t whole = sink->pending & ~ (size_t) (COFILE_ALIGN - 1);
+		if (whole == 0) {
+			return 0;
+		}
+		ssize_t done = pwrite (sink->fd, sink->dbuf, whole, sink->pos);
+		if (done < 0) {
+			return -errno;
+		}
+		if ((size_t) done != whole) {
+			return -EIO;
+		}
+		memmove (sink->dbuf, sink->dbuf + whole, sink->pending - whole);
+		sink->pending -= whole;
+		sink->pos += whole;
+		return 0;
+	}
+	while (sink->pending > 0) {
+		ssize_t done = pwritev (sink->fd, sink->iov + iovofs, sink->iovcnt - iovofs, sink->pos);
+		if (done < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		sink->pos += done;
+		sink->pending -= done;
+		// Skip what was written, which may end in the middle of a window
+		while ((iovofs < sink->iovcnt) && ((size_t) done >= sink->iov [iovofs].iov_len)) {
+			done -= sink->iov [iovofs++].iov_len;
+		}
+		if (done > 0) {
+			sink->iov [iovofs].iov_base = (uint8_t *) sink->iov [iovofs].iov_base + done;
+			sink->iov [iovofs].iov_len -= done;
+		}
+	}
+	sink->iovcnt = 0;
+	return 0;
+}
+
+
+/* Add a window to the sink, and write out when a batch is complete, or when
+ * the window is not stable.  Returns 0 or a negative error.
+ */
+int cofile_sink_write (coconut_filesink_t sink, coconut_window_t win) {
+	int retval;
+	if (sink->dbuf != NULL) {
+		uint8_t *ptr = win->ptr;
+		size_t len = win->len;
+		while (len > 0) {
+			size_t todo = sink->batch - sink->pending;
+			if (todo > len) {
+				todo = len;
+			}
+			memcpy (sink->dbuf + sink->pending, ptr, todo);
+			sink->pending += todo;
+			ptr += todo;
+			len -= todo;
+			if (sink->pending == sink->batch) {
+				retval = cofile_sink_flush (sink);
+				if (retval < 0) {
+					return retval;
+				}
+			}
+		}
+		return 0;
+	}
+	if (win->len == 0) {
+		return 0;
+	}
+	if (sink->iovcnt == COFILE_IOVMAX) {
+		retval = cofile_sink_flush (sink);
+		if (retval < 0) {
+			return retval;
+		}
+	}
+	sink->iov [sink->iovcnt].iov_base = win->ptr;
+	sink->iov [sink->iovcnt].iov_len = win->len;
+	sink->iovcnt++;
+	sink->pending += win->len;
+	if ((sink->pending >= sink->batch) || !win->stable) {
+		return cofile_sink_flush (sink);
+	}
+	return 0;
+}
+
+
+/* Write out all that remains, and close the file.  Returns 0 or a negative
+ * error.
+ */
+int cofile_sink_close (coconut_filesink_t sink) {
+	int retval = cofile_sink_flush (sink);
+	if ((retval == 0) && (sink->dbuf != NULL) && (sink->pending > 0)) {
+		// The tail is not a whole block, so write it without O_DIRECT
+		int flags = fcntl (sink->fd, F_GETFL);
+		if ((flags < 0) || (fcntl (sink->fd, F_SETFL, flags & ~O_DIRECT) != 0)) {
+			retval = -errno;
+		} else if (pwrite (sink->fd, sink->dbuf, sink->pending, sink->pos) != (ssize_t) sink->pending) {
+			retval = -EIO;
+		} else {
+			sink->pos += sink->pending;
+			sink->pending = 0;
+		}
+	}
+	free (sink->dbuf);
+	sink->dbuf = NULL;
+	if (close (sink->fd) != 0 && retval == 0) {
+		retval = -errno;
+	}
+	sink->fd = -1;
+	return retval;
+}
+
+
+/* The library coros for file sources and sinks, which are declared in
+ * coconut.h along with their initialiser arguments.
+ *
+ * The reader sends EOF from its body, after the last window, and not from its
+ * cleanup action, because a cleanup action must not wait for another coro.
+ * When the file cannot be read, the writer gets the error instead of EOF, so
+ * it does not take a truncated file for a complete one.  Likewise, the reader
+ * gets an error when the writer cannot write, instead of waiting forever.
+ *
+ * The writer flushes its last batch and closes its file from its body, once
+ * it has read EOF, so that it can tell whether that failed.  The reader has
+ * gone by then, so the outcome is left in the err field of the writer; this
+ * is 0 when all data was written and the file was closed without error.
+ * The cleanup action only closes the file when the writer ends otherwise.
+ */
+
+coroutine_args (coconut_filesrc_st, 1, cofile_reader)
+
+	copipenuts { out };
+	coexceptions { READ_ERROR, WRITE_ERROR };
+	coresources { SOURCE };
+
+	/* Initialisation code: open the source */
+	coraise_neg (READ_ERROR, cofile_source_open (&self, coargs.fd, coargs.window));
+	cocleantodo (SOURCE);
+
+	cocatch_done (READ_ERROR) {
+		conut_error (out, EIO);
+	}
+	cocatch_done (WRITE_ERROR) { }
+
+	/* Unmap the file, or free its buffer, and close it */
+	cocleanaction (SOURCE) {
+		cofile_source_close (&self);
+	}
+
+	cobody_typed {
+		ssize_t len = cofile_source_next (&self);
+		coraise_neg (READ_ERROR, len);
+		if (len == 0) {
+			conut_push (out);
+			codone ();
+		}
+		conut_write (out, &self.win, sizeof (self.win));
+		coraise_neg (WRITE_ERROR, conut_size ());
+	}
+
+coroutine_args_end
+
+
+coroutine_args (coconut_filesink_st, 1, cofile_writer)
+
+	copipenuts { in };
+	coexceptions { READ_ERROR, WRITE_ERROR };
+	coresources { SINK };
+
+	/* Initialisation code: open the sink */
+	coraise_neg (WRITE_ERROR, cofile_sink_open (&self, coargs.fd, coargs.batch, coargs.direct));
+	cocleantodo (SINK);
+
+	cocatch_done (READ_ERROR) { }
+	cocatch_done (WRITE_ERROR) {
+		conut_error (in, EIO);
+	}
+
+	/* Close the file when ending without EOF, after an error */
+	cocleanaction (SINK) {
+		cofile_sink_close (&self);
+	}
+
+	cobody_typed {
+		conut_read (in, &self.win, sizeof (self.win));
+		if (conut_size () < 0) {
+			self.err = conut_size ();
+			coraise (READ_ERROR);
+		}
+		if (conut_size () == 0) {
+			// Write out the last batch and close, to see if that fails
+			cocleandone (SINK);
+			self.err = cofile_sink_close (&self);
+			coraise_neg (WRITE_ERROR, self.err);
+			codone ();
+		}
+		self.err = cofile_sink_write (&self, &self.win);
+		coraise_neg (WRITE_ERROR, self.err);
+	}
+
+coroutine_args_end
@@ -0,0 +1,52 @@
+
+#include "coconut.h"
+
+#include <stdio.h>
+#include <errno.h>
+
+
+/* Split the datasize of a coclass into its parts.  Returns 0, or -EINVAL when
+ * the datasize cannot hold the coro and its pipe nuts.
+ */
+int cofootprint (const struct coclass *cls, coconut_footprint_t fp) {
+	memset (fp, 0, sizeof (*fp));
+	fp->instance = cls->datasize;
+	fp->header = sizeof (coconut_coro_st);
+	fp->conuts = cls->conutcount * sizeof (coconut_pipenut_st);
+	if (fp->instance < fp->header + fp->conuts) {
+		return -EINVAL;
+	}
+	fp->user = fp->instance - fp->header - fp->conuts;
+	return 0;
+}
+
+
+/* Print a table with the footprint of each coclass, per instance and for the
+ * given number of instances, or only per instance when counts is NULL.  The
+ * overhead column is the share of coconut's own structures.
+ */
+void cofootprint_report (FILE *out, const struct coclass *const *classes, const unsigned long *counts, unsigned numclasses) {
+	coconut_footprint_st fp;
+	unsigned long long total = 0, overhead = 0;
+	unsigned i;
+	fprintf (out, "%-24s %8s %8s %8s %8s %10s %14s\n",
+		"coclass", "bytes", "header", "conuts", "user", "instances", "total");
+	for (i = 0; i < numclasses; i++) {
+		unsigned long n = (counts != NULL)? counts [i]: 1;
+		if (cofootprint (classes [i], &fp) != 0) {
+			fprintf (out, "%-24s %8zu  (too small for its conuts)\n",
+				classes [i]->coroname, classes [i]->datasize);
+			continue;
+		}
+		fprintf (out, "%-24s %8zu %8zu %8zu %8zu %10lu %14llu\n",
+			classes [i]->coroname, fp.instance, fp.header, fp.conuts, fp.user,
+			n, (unsigned long long) n * fp.instance);
+		total += (unsigned long long) n * fp.instance;
+		overhead += (unsigned long long) n * (fp.header + fp.conuts);
+	}
+	fprintf (out, "%-24s %8s %8s %8s %8s %10s %14llu\n",
+		"total", "", "", "", "", "", total);
+	if (total > 0) {
+		fprintf (out, "overhead %llu bytes, %.1f%%\n", overhead, 100.0 * overhead / total);
+	}
+}
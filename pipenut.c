@@ -1,6 +1,10 @@
 
 #include "coconut.h"
 
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
 
 /* Communication between pipe nuts goes through a number of phases.  The process
  * has been carefully designed to provide transactional certainties due to
@@ -11,7 +15,7 @@
  * INITIAL: No connection to another pipe nut has been made, the queue is empty.
  *	There is no buffer, and no errno value yet.
  *
- *      Test: buf == NULL, errno == ?, me->peer == NULL
+ *      Test: buf == NULL, err == ?, me->peer == NULL
  *	Actions: "get connected (TODO:HOW?)" --> CONNECTED
  *
  * CONNECTED: Another pipe nut is installed as the remote, and at some point
@@ -19,7 +23,7 @@
  *	When we disconnect, or connect to the next peer, we drop the conncetion.
  *	This is possible in the current state because we are not exchanging.
  *
- *	Test: buf == NULL, errno == 0, me->peer != NULL, max == 0
+ *	Test: buf == NULL, err == 0, me->peer != NULL, len == 0
  *	Actions: conet_setupbuf() --> READY
  *
  * READY: The buffer and its maximum size has been setup, as well as an offset
@@ -28,7 +32,7 @@
  *	that the other side has not connected to us.  But if it does then we
  *	won't hold back.  It's too late now to reconnect.  (TODO:BAILOUT?)
  *
- *	Test: buf != NULL, errno == 0, me->peer != NULL, 0 < max < min
+ *	Test: buf != NULL, err == 0, me->peer != NULL, 0 < len < todo
  *	Action: _conut_sync() with return == 0   --> EOF
  *	Action: _conut_sync() with return  < 0   --> ERROR
  *	Action: _conut_sync() with return  < max --> SYNCING
@@ -55,7 +59,7 @@
  *	is all very simple when you exchange fixed sizes and min==max,
  *	but things are not always that easy.
  *
- *	Test: buf != NULL, errno == 0, me->peer != NULL, min <= max
+ *	Test: buf != NULL, err == 0, me->peer != NULL, todo <= len
  *	Action: _conut_sync() with return == 0   --> EOF
  *	Action: _conut_sync() with return  < 0   --> ERROR
  *	Action: _conut_sync() with return  < max --> SYNCING
@@ -67,7 +71,7 @@
  *	and the buffer blocked because ofs==max; it is however possible to setup
  *	a new buffer or reset the current one for another pass.
  *
- *	Test: buf != NULL, errno == 0, min <= got <= max
+ *	Test: buf != NULL, err == 0, todo <= ofs <= len
  *	Action: conut_setupbuf() --> READY
  *	Action: conut_resetbuf() --> READY
  *
@@ -76,7 +80,7 @@
  *	which is a signal that EOF ought to be delivered locally.  To the
  *	reading end, this means receiving an explicit 0 length.
  *
- *	Test: buf != NULL, errno == EPIPE
+ *	Test: buf != NULL, err == EPIPE
  *	Action: conut_setupbuf() --> READY
  *	Action: conut_resetbuf() --> READY
  *
@@ -88,7 +92,7 @@
  *	be caused during buffer setup, namely when the sides both want to
  *	write, or both want to read.
  *
- *	Test: buf != NULL, errno != 0, errno != EPIPE
+ *	Test: buf != NULL, err != 0, err != EPIPE
  *	Action: conut_setupbuf() --> READY
  *	Action: conut_resetbuf() --> READY
  *
@@ -99,26 +103,104 @@
 
 
 
-/* The structure for a "pipe nut" is the endpoint of a pipe between twee coros.
- * A peer must be claimed by opening a connection to them, then transmission
- * takes place until EOF or an error condition is reported to both ends.
- *
- * Communication is one-way, except for the synchronous nature of data transfer.
- * Transfers may be set to a minimum (only overridden during EOF) and to a
- * maximum; partially done transmissions may be continued after a coyield().
- *
- * These structures are meant to be stored as an array in each coro; they can
- * be reset to all zeroes, and will be opened over a "meta" connection.
+/* The structure for a "pipe nut" is in coconut.h, where it is the endpoint of
+ * a pipe between two coros.  The fields map to the states above as follows:
+ *  - buf and len are the buffer and its maximum size, ofs is what has been
+ *    transferred so far and todo is the minimum for the current sync;
+ *  - writer and reader are the role of the current round, and both are false
+ *    when nothing is posted, that is, before setup and after completion;
+ *  - err is the error to report locally, EPIPE for EOF;
+ *  - nutnr is the conut number + 1 of the pipe nut in its coro, which its
+ *    peer needs to trigger it.  It is recorded by the conut_xxx() macros.
  */
-typedef struct coconut_pipenut {
-	struct coconut_coro_t coro;	// Current related peer's coro
-	struct coconut_pipenut_t rnut;  // Current related peer's pipenet
-	char *buf;			// Read/write buffer, or NULL if none
-	size_t ofs, min, max;		// Buffer offset and min/max desired transfer
-	unsigned short errno;		// Error to report locally (EPIPE for EOF)
-	coconut_coro_t queue;		// Others queueing up for service
-	bool writer, reader;		// Flags for our roles (both may be false)
-};
+
+
+/* Find the coro that holds a pipe nut, knowing that the pipe nuts follow the
+ * coro structure in an array.  The pipe nut must have been used.
+ */
+static inline coconut_coro_t conut_owner (coconut_pipenut_t pn) {
+	return ((coconut_coro_t) (pn - (pn->nutnr - 1))) - 1;
+}
+
+/* Trigger the coro that holds a pipe nut to run next.  Nothing can be done
+ * for a pipe nut that has not been used yet, but then it is not waiting either.
+ */
+static void conut_wake (coconut_pipenut_t pn) {
+	if (pn->nutnr == 0) {
+		return;
+	}
+	conut_handoff (pn->nutnr - 1, conut_owner (pn));
+}
+
+
+/* A pipe nut consumes the trigger of its conut before it looks at its peer,
+ * so a trigger that comes in after the look is kept.  When it must wait, it
+ * marks its coro as waiting, so a scheduler can park the coro instead of
+ * running it again and again until the peer is done.
+ */
+static inline void conut_consume (coconut_pipenut_t me) {
+	if (me->nutnr != 0) {
+		_conut_consume (conut_owner (me), me->nutnr - 1);
+	}
+}
+
+
+/* Backpressure is implied by the rendezvous, but it is invisible.  To make it
+ * visible, every pipe nut keeps track of the time that it waits for its peer
+ * in _conut_sync().  Waiting as a writer counts as blocking on a full pipe,
+ * waiting as a reader counts as blocking on an empty pipe.  A stage with a
+ * lot of time blocked on full is followed by a bottleneck, a stage with a
+ * lot of time blocked on empty is preceded by one.  The clock is only read
+ * when waiting starts and ends, so the fast path is unaffected.
+ */
+static inline int conut_block (coconut_pipenut_t me) {
+#ifndef COCONUT_COMPACT
+	if (me->blocksince == 0) {
+		me->blocksince = cotime_now ();
+	}
+#endif
+	return _conut_block ((me->nutnr != 0)? conut_owner (me): NULL);
+}
+
+static inline void conut_unblock (coconut_pipenut_t me) {
+#ifndef COCONUT_COMPACT
+	if (me->blocksince != 0) {
+		uint64_t waited = cotime_now () - me->blocksince;
+		if (me->writer) {
+			me->blockfull += waited;
+		} else {
+			me->blockempty += waited;
+		}
+		me->blocksince = 0;
+	}
+#else
+	(void) me;
+#endif
+}
+
+
+/* Credits make flow control explicit.  The reader grants a number of writes
+ * to the writer, which takes one before each write and yields when it has
+ * run out.  This is useful when the pipe is buffered or bridged, so that the
+ * rendezvous does not hold back the writer; the reader can then advertise
+ * the room that it has.  Credits are optional; they only take effect when the
+ * writer asks for them, and a pipe nut starts without any.
+ */
+void _conut_credit_grant (coconut_pipenut_t me, uint32_t credits) {
+	me->peer->credits += credits;
+	conut_wake (me->peer);
+}
+
+int _conut_credit_take (coconut_pipenut_t me, uint16_t conut) {
+	me->nutnr = conut + 1;
+	conut_consume (me);
+	if (me->credits == 0) {
+		me->writer = 1;
+		return conut_block (me);
+	}
+	conut_unblock (me);
+	return --me->credits;
+}
 
 
 /* Trigger an event with a conut in another coro.  This may even be run from
@@ -127,50 +209,91 @@ typedef struct coconut_pipenut {
  * "somewhat atomic", in the sense that another thread operating on it will
  * not be slower than setting the flag and reading back a value independently.
  */
-void conut_trigger (uint8_t conut, coconut_coro_t target) {
-	uint32_t flag = 1UL << conut;
-	if (flag == 0) {
+void conut_trigger (uint16_t conut, coconut_coro_t target) {
+	if (conut >= COCONUT_FLAG_BITS) {
 		return;
 	}
-	while (!(target->activated & flag)) {
-		target->activated |= flag;
+	while (!coflags_test (&target->activity, conut)) {
+		coflags_set (&target->activity, conut);
 	} 
+	if (target->sched != NULL) {
+		_cosched_wake (target);
+	}
+}
+
+
+/* Trigger an event with a conut in another coro, and have it run next.
+ */
+void conut_handoff (uint16_t conut, coconut_coro_t target) {
+	if (conut >= COCONUT_FLAG_BITS) {
+		return;
+	}
+	while (!coflags_test (&target->activity, conut)) {
+		coflags_set (&target->activity, conut);
+	} 
+	if (target->sched != NULL) {
+		_cosched_handoff (target);
+	}
 }
 
 
 /* Return the triggered event with the highest priority.  If none is active,
  * return -1 instead.
  *
- * I could not resist the temptation of making this a binary search which
- * is probably more efficient than searching linearly through the bits; the
- * complexity lies in the larger number of shifts, but that is quite easy
- * to implement in one computing cycle, as it basically constitutes
- * 2log(#bits) switches in a hardware implementation.
+ * This used to be a binary search over the bits, but bit scans do the same
+ * in one instruction on most processors.  With more than one word of flags,
+ * the summary word leads to the right word with one more scan.
  */
-int8_t _conut_active (uint32_t *activity) {
-	uint32_t act = *activity;
-	if (act == 0) {
-		return -1;
+int16_t _conut_active (coflags_t *activity) {
+	int bitnr = coflags_lowest (activity);
+	if (bitnr >= 0) {
+		coflags_clear (activity, bitnr);
 	}
-	register uint32_t mask = ~0UL;
-	register uint8_t shift = sizeof (*act) * 4;
-	register int8_t bitnr = 0;
-	do {
-		if (act & mask) {
-			// Choose the lower half
-			mask &= (mask >> shift); 
-		} else {
-			// Choose the upper half
-			mask &= (mask << shift); 
-			bitnr += shift;
-		}
-		shift >>= 1;
-	} while (shift);
-	*activity = act & ~mask;
 	return bitnr;
 }
 
 
+#if COCONUT_FLAG_WORDS > 1
+const coflags_t _coflags_all = {
+	.sum = ~ (coflag_t) 0,
+	.word = { [0 ... COCONUT_FLAG_WORDS - 1] = ~ (coflag_t) 0 }
+};
+#endif
+
+
+/* Return the triggered event within a set, either with the highest priority
+ * like _conut_active(), or fairly by starting just after the last one that
+ * was returned.
+ */
+int16_t _conut_select (coflags_t *activity, coflags_t set, int16_t *last, bool fair) {
+	unsigned start = fair ? (*last + 1) % COCONUT_FLAG_BITS : 0;
+	int bitnr = coflags_next (activity, &set, start);
+	if (bitnr >= 0) {
+		coflags_clear (activity, bitnr);
+		*last = bitnr;
+	}
+	return bitnr;
+}
+
+
+/* Select the conut that ends a coalt(), or report -ETIMEDOUT when its deadline
+ * has passed, or -EAGAIN to make it yield for another try.  Triggers have
+ * precedence over the timeout, so nothing that came in is lost.
+ */
+int _coalt_select (coconut_coro_t co, coflags_t set, bool fair) {
+	int16_t bitnr = _conut_select (&co->activity, set, &co->altlast, fair);
+	if (bitnr >= 0) {
+		co->altdeadline = 0;
+		return bitnr;
+	}
+	if ((co->altdeadline != 0) && (cotime_now () >= co->altdeadline)) {
+		co->altdeadline = 0;
+		return -ETIMEDOUT;
+	}
+	return _conut_block (co);
+}
+
+
 /* The most brutal and direct manner of connecting two conuts to form a pipe is
  * to skip all negotiation and self-control.  This should not be done with coros
  * that have been initialised, but when they have merely been allocated this is
@@ -192,6 +315,10 @@ void conut_makepipe (coconut_pipenut_t a, coconut_pipenut_t b) {
 /* The _conut_accept() accepts any remote peer's attempt to conut_connect().  To
  * that end, it takes the first entry off of the queue and installs it as its
  * current peer.  If no such entry is found, the routine returns for coyield().
+ *
+ * Pipe nuts in the queue are linked through their own queue field.  They have
+ * their peer set to the pipe nut that they wait for, so nobody queues up for
+ * them in the meantime.
  */
 bool _conut_accept (coconut_pipenut_t me) {
 	assert (me->peer == NULL);
@@ -199,10 +326,11 @@ bool _conut_accept (coconut_pipenut_t me) {
 	if (newpeer == NULL) {
 		return 1;
 	}
-	me->queue = newpeer->qnext;
-	newpeer->qnext = NULL;
+	me->queue = newpeer->queue;
+	newpeer->queue = NULL;
 	me->peer = newpeer;
-	conut_trigger (me, newpeer);
+	conut_wake (newpeer);
+	return 0;
 }
 
 
@@ -210,71 +338,93 @@ bool _conut_accept (coconut_pipenut_t me) {
  * mode.  It first finds if the sought remote peer is in the queue awaiting a
  * connection and if so, removes it and continues like conut_accept().  Otherwise,
  * it will enqueue in the remote conut's queue and use coyield() to await being
- * _conut_accept()ed.
+ * _conut_accept()ed.  A remote that is connecting elsewhere is tried again later.
  */
 bool _conut_connect (coconut_pipenut_t me, coconut_pipenut_t newpeer) {
+	if (me->peer == newpeer) {
+		// Already queued; we are connected when the remote accepted us
+		return (newpeer->peer != me);
+	}
 	assert (me->peer == NULL);
 	coconut_pipenut_t *qp = &me->queue;
-	while (*me) {
-		if (*me == newpeer) {
+	while (*qp != NULL) {
+		if (*qp == newpeer) {
 			// Already requested; act more or less like conut_accept()
-			*me = newpeer->qnext;
+			*qp = newpeer->queue;
+			newpeer->queue = NULL;
 			assert (newpeer->peer == me);
 			me->peer = newpeer;
 			// We are connected, and may continue.
 			// The other side will be triggered.
-			conut_trigger (me, newpeer);
+			conut_wake (newpeer);
 			return 0;
 		}
-		qp = & (*qp)->qnext;
+		qp = & (*qp)->queue;
+	}
+	if (newpeer->peer != NULL) {
+		// The peer is connected or connecting elsewhere; try again later
+		return 1;
 	}
 	// The peer is not in the queue, so we sign up with it
+	assert (me->queue == NULL);
 	qp = &newpeer->queue;
-	while (*qp) {
-		qp = & (*qp)->qnext;
+	while (*qp != NULL) {
+		qp = & (*qp)->queue;
 	}
-	newpeer->qnext = NULL;
-	*qp = newpeer;
-	conut_trigger (me, newpeer);
+	*qp = me;
+	me->peer = newpeer;
+	conut_wake (newpeer);
 	return 1;
 }
 
 
 /* Setup a pipenut buffer for communication, with a maximum length.  Also indicate
  * whether we will be reading or writing this round.  This can be modified later on.
- * It is assumed that a connection has been made to a remote.
+ * It is assumed that a connection has been made to a remote.  The conut number
+ * is recorded, so the remote can trigger us.
  */
-void conut_setupbuf (coconut_pipenut_t pnut, bool wr, uint8_t *buf, size_t maxlen) {
-	assert (pnut->buf == NULL);
-	assert (pnut->coro != NULL);
-	assert (pnut->rnut != NULL);
+void _conut_setupbuf (coconut_pipenut_t pnut, uint16_t conut, bool wr, uint8_t *buf, size_t maxlen) {
+	assert (pnut->peer != NULL);
+	pnut->nutnr = conut + 1;
 	pnut->buf = buf;
-	pnut->max = maxlen;
-	conut_resetbuf (pnet, wr);
+	pnut->len = maxlen;
+	_conut_resetbuf (pnut, wr);
 }
 
-/* Reset a pipenut buffer for communication, assuming that buf and max have already
- * been setup by conut_setupbuf() before.
- * TODO: could there be additional traffic that we missed?
+/* Reset a pipenut buffer for communication, assuming that buf and len have already
+ * been setup by conut_setupbuf() before.  This posts the buffer to the remote.
+ * Only the EOF of the previous round is cleared.  A reset connection stays
+ * reset, so that it keeps failing, and an error that the peer sent before we
+ * posted is kept, so the coming sync reports it.
  */
-void conut_resetbuf (coconut_pipenut_t pnet, bool wr) {
-	assert (pnut->buf != NULL);
-	assert (pnut->coro != NULL);
-	assert (pnut->rnut != NULL);
+void _conut_resetbuf (coconut_pipenut_t pnut, bool wr) {
 	pnut->writer = (wr != 0);
 	pnut->reader = (wr == 0);
-	pnut->min = pnut->max + 1;	// err on the safe side
 	pnut->ofs = 0;
-	pnut->errno = 0;
-	if ((pnut->writer && pnut->rnut->writer) ||
-	    (pnut->reader && pnut->rnut->reader)) {
-		pnut->rnut->errno = pnut->errno = EPROTO;
-	} else {
-		errno = 0;
+	pnut->todo = 0;
+	if (pnut->err == EPIPE) {
+		pnut->err = 0;
 	}
 }
 
 
+/* Send an error to the peer, unless either end has an error standing by.  It
+ * is set at both ends, so they agree on the state, and each end reports it
+ * once.  The peer is triggered, as it may be waiting for us.
+ */
+void _conut_error (coconut_pipenut_t me, int err) {
+	coconut_pipenut_t peer = me->peer;
+	if ((err <= 0) || (err == EPIPE) || (err == EAGAIN) || (peer == NULL)) {
+		return;
+	}
+	if ((me->err != 0) || (peer->err != 0)) {
+		return;
+	}
+	me->err = peer->err = err;
+	conut_wake (peer);
+}
+
+
 /* After buffers have been setup, or possibly reset, the communication can be
  * started.  Whether this is possible depends on the availability of the
  * buffer on the other side, but even if the other side acknowledges us as their
@@ -292,72 +442,77 @@ void conut_resetbuf (coconut_pipenut_t pnet, bool wr) {
  * -EPROTO, a protocol error.  Note that this error is also returned when
  * read/write coordination was not properly coordinated between the peers.
  * Finally, -EAGAIN is returned if the sync could not currently be achieved.
+ *
+ * Whichever side comes in second moves the data, and triggers the other side
+ * if anything changed for it.  A write of length 0 is EOF, and it is only
+ * passed to a reader that has not yet received its minimum, so it does not
+ * overtake data.  Each side completes in its own call; it then withdraws its
+ * buffer, so that nothing more is moved behind its back.
  */
 int _conut_sync (coconut_pipenut_t me, size_t minlen) {
-	assert (me->buf != NULL);
-	int retval = me->errno;
-	// First, in case of EOF or an error, return that status
+	coconut_pipenut_t peer = me->peer;
+	me->todo = minlen;
+	conut_consume (me);
+	// First, move what we can to or from a peer that has its buffer posted
+	if ((peer != NULL) && (me->err == 0) && (peer->err == 0) &&
+	    (peer->peer == me) && (peer->writer || peer->reader)) {
+		if (peer->writer == me->writer) {
+			// Both ends read, or both ends write
+			peer->err = me->err = EPROTO;
+			conut_wake (peer);
+		} else {
+			coconut_pipenut_t w = me->writer? me: peer;
+			coconut_pipenut_t r = me->writer? peer: me;
+			size_t len = w->len - w->ofs;
+			if (len > r->len - r->ofs) {
+				len = r->len - r->ofs;
+			}
+			if (len > 0) {
+				memcpy (r->buf + r->ofs, w->buf + w->ofs, len);
+				r->ofs += len;
+				w->ofs += len;
+				conut_wake (peer);
+			} else if ((w->len == 0) && (r->ofs < r->todo)) {
+				w->err = r->err = EPIPE;
+				conut_wake (peer);
+			}
+		}
+	}
+	// Second, in case of EOF or an error, return that status
+	int retval = me->err;
 	if (retval != 0) {
-		*minlen = 0;
+		conut_unblock (me);
+		me->writer = me->reader = 0;
 		if (retval != EPIPE) {
 			// If this is ECONNRESET, we must now disconnect
 			if (retval == ECONNRESET) {
 				me->peer = NULL;
+			} else {
+				// Any other error is delivered once
+				me->err = 0;
 			}
-			// Any non-EOF error will be reported immediately
 			return -retval;
 		} else if ((me->ofs > 0) && (me->ofs < minlen)) {
 			// EOF but we did receive data, just not enough
-			assert (me->peer->peer == me);
-			me->peer->errno = me->errno = retval = EPROTO;
-			return -retval;
+			me->err = 0;
+			return -EPROTO;
 		} else {
 			// EOF or we received enough data, so report me->ofs
 			return me->ofs;
 		}
 	}
-	// Second, we test if the peer is ready to transfer data with us
-	if (me->peer->peer != me) {
-		// The peer is not acknowledging us as its peer... yet
-		return -EAGAIN;
-	}
-	if (me->peer->errno != 0) {
-		// The peer is in a state of (t)error and may be reconsidering us
-		// (We should have processed the same error)
-		return -EAGAIN;
-	}
-	// Third, determine the roles of reader and writer
-	assert (me->reader != me->writer);
-	assert (me->writer || me->peer->writer);
-	assert (me->reader || me->peer->reader);
-	if (me->writer) {
-		w = me;
-		r = me->peer;
-	} else {
-		r = me;
-		w = me->peer;
-	}
-	//
-	// Fourth, move as much information as possible from writer to reader
-	len = w->max - w->ofs;
-	if (len > r->max - r->ofs) {
-		len = r->max - r->ofs;
-	}
-	if (len > 0) {
-		memcpy (r->buf + r->ofs, w->buf + w->ofs, len);
-		r->ofs += len;
-		w->ofs += len;
+	if (peer == NULL) {
+		me->writer = me->reader = 0;
+		return -ENOTCONN;
 	}
-	//
-	// Fifth, send a signal to our peer (which was apparently waiting for us)
-	conut_trigger (me->rnut, me->peer);
-	//
-	// Sixth, harvest our personal results
-	//TODO:STOPMYSIGNAL:AVOIDRACE// me->activity &= ~ (1UL << me->rnut);
-	if (me->act < minlen) {
+	// Third, harvest our personal results; a write of length 0 is EOF,
+	// which only completes when the peer took it
+	if ((me->ofs < minlen) || (me->writer && (me->len == 0))) {
 		// Not enough; please keep calling us, and/or we'll call you!
-		return -EAGAIN;
+		return conut_block (me);
 	}
-	return me->act;
+	conut_unblock (me);
+	me->writer = me->reader = 0;
+	return me->ofs;
 }
 
@@ -0,0 +1,206 @@
+
+#define _GNU_SOURCE
+
+#include "coconut.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+/* A placement plan groups coros that are connected by pipes, with a union-find
+ * over their plan indexes.  Groups are then assigned to CPUs as a whole, since
+ * pipe hops between cores, let alone between sockets, cost far more than hops
+ * within one core.
+ */
+
+
+void coplace_init (coconut_placement_t p) {
+	memset (p, 0, sizeof (*p));
+}
+
+void coplace_fini (coconut_placement_t p) {
+	free (p->coros);
+	free (p->group);
+	free (p->cpu);
+	memset (p, 0, sizeof (*p));
+}
+
+
+/* Add a coro to the plan, in a group of its own.  Returns its index in the
+ * plan, or -ENOMEM, or -E2BIG when the plan already holds 65536 coros, which
+ * is all that its 16-bit group indexes can reach.
+ */
+int coplace_add (coconut_placement_t p, coconut_coro_t co) {
+	if (p->count == p->size) {
+		unsigned newsize = (p->size == 0)? 64: 2 * p->size;
+		if (newsize > 65536) {
+			return -E2BIG;
+		}
+		coconut_coro_t *coros = realloc (p->coros, newsize * sizeof (coconut_coro_t));
+		if (coros != NULL) {
+			p->coros = coros;
+		}
+		uint16_t *group = realloc (p->group, newsize * sizeof (uint16_t));
+		if (group != NULL) {
+			p->group = group;
+		}
+		int16_t *cpu = realloc (p->cpu, newsize * sizeof (int16_t));
+		if (cpu != NULL) {
+			p->cpu = cpu;
+		}
+		if ((coros == NULL) || (group == NULL) || (cpu == NULL)) {
+			return -ENOMEM;
+		}
+		p->size = newsize;
+	}
+	p->coros [p->count] = co;
+	p->group [p->count] = p->count;
+	p->cpu   [p->count] = -1;
+	return p->count++;
+}
+
+
+/* Find the index representing the group of a coro, and shorten the path to it
+ * along the way.
+ */
+static unsigned place_root (coconut_placement_t p, unsigned i) {
+	while (p->group [i] != i) {
+		p->group [i] = p->group [p->group [i]];
+		i = p->group [i];
+	}
+	return i;
+}
+
+/* Put two coros in the same group, because they are connected.
+ */
+void coplace_link (coconut_placement_t p, unsigned a, unsigned b) {
+	assert (a < p->count);
+	assert (b < p->count);
+	a = place_root (p, a);
+	b = place_root (p, b);
+	if (a < b) {
+		p->group [b] = a;
+	} else if (b < a) {
+		p->group [a] = b;
+	}
+}
+
+
+/* Assign the groups in the plan to CPUs.  Groups are taken largest first, and
+ * each goes to the CPU with the fewest coros so far.  Groups are never split,
+ * so one large group may leave other CPUs underused; that is usually cheaper
+ * than its pipes crossing between CPUs.
+ *
+ * The groups are sorted by size once, with ties in the order of their lowest
+ * plan index, so the assignment does not depend on the sort.
+ */
+struct place_group {
+	unsigned size;			// Coros in the group
+	unsigned root;			// Plan index that represents the group
+};
+
+static int place_larger (const void *a, const void *b) {
+	const struct place_group *ga = a;
+	const struct place_group *gb = b;
+	if (ga->size != gb->size) {
+		return (ga->size > gb->size)? -1: 1;
+	}
+	return (ga->root < gb->root)? -1: (ga->root > gb->root)? 1: 0;
+}
+
+void coplace_assign (coconut_placement_t p, const int *cpus, unsigned numcpus) {
+	unsigned *size = calloc (p->count + numcpus, sizeof (unsigned));
+	unsigned *load = size + p->count;
+	struct place_group *groups = malloc ((p->count + 1) * sizeof (struct place_group));
+	unsigned i, j, numgroups = 0;
+	if ((size == NULL) || (groups == NULL) || (numcpus == 0)) {
+		free (size);
+		free (groups);
+		return;
+	}
+	for (i = 0; i < p->count; i++) {
+		size [place_root (p, i)]++;
+	}
+	for (i = 0; i < p->count; i++) {
+		if (size [i] > 0) {
+			groups [numgroups].size = size [i];
+			groups [numgroups].root = i;
+			numgroups++;
+		}
+	}
+	qsort (groups, numgroups, sizeof (struct place_group), place_larger);
+	for (j = 0; j < numgroups; j++) {
+		// Place the next largest group on the least loaded CPU
+		unsigned least = 0;
+		for (i = 1; i < numcpus; i++) {
+			if (load [i] < load [least]) {
+				least = i;
+			}
+		}
+		load [least] += groups [j].size;
+		p->cpu [groups [j].root] = cpus [least];
+	}
+	for (i = 0; i < p->count; i++) {
+		p->cpu [i] = p->cpu [place_root (p, i)];
+	}
+	free (groups);
+	free (size);
+}
+
+
+/* Pin the calling thread to a CPU.  Returns 0 or a negative error.
+ */
+int coplace_pin (int cpu) {
+	cpu_set_t set;
+	CPU_ZERO (&set);
+	CPU_SET (cpu, &set);
+	if (sched_setaffinity (0, sizeof (set), &set) != 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+
+/* Find the NUMA node of a CPU, or return -1 if it is unknown.
+ */
+int coplace_node (int cpu) {
+	char path [80];
+	int node;
+	for (node = 0; node < 64; node++) {
+		snprintf (path, sizeof (path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+		if (access (path, F_OK) == 0) {
+			return node;
+		}
+	}
+	return -1;
+}
+
+
+/* Allocate zeroed memory on a NUMA node, or anywhere if node is -1.  The
+ * memory is mapped in whole pages and bound to the node before it is first
+ * touched, so its pages are taken from that node.  Free with coplace_free().
+ */
+void *coplace_alloc (size_t size, int node) {
+	void *mem = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+#ifdef SYS_mbind
+	if ((node >= 0) && (node < 64)) {
+		// MPOL_PREFERRED, so allocation falls back when the node is full
+		unsigned long nodemask = 1UL << node;
+		syscall (SYS_mbind, mem, size, 1, &nodemask, 65, 0);
+	}
+#endif
+	return mem;
+}
+
+void coplace_free (void *mem, size_t size) {
+	munmap (mem, size);
+}
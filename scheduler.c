@@ -0,0 +1,627 @@
+
+#include "coconut.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+
+/* The scheduler holds a FIFO queue of ready coros for each scheduling class,
+ * plus a heap for ready coros with a deadline, ordered by earliest deadline.
+ * Parked coros are not held anywhere; they are found again when triggered,
+ * through the sched field in the coro.
+ *
+ * Coros are parked when they return from their event loop without anything to
+ * do, which shows in their coswitch being set to the event loop, or when they
+ * return waiting for a pipe nut, channel, combinator or shared memory pipe,
+ * or in coalt(), which shows in their waiting flag.  Either way, they are not
+ * parked when a trigger came in while they ran.  Other coros that yield are
+ * ready to run again, as they may be polling.
+ *
+ * Parked coros that wait in coalt() with a timeout are also held in a heap of
+ * timers, ordered by their deadline.  Timers that expire make their coros
+ * ready, and a wakeup takes the timer out, so the heap only holds parked coros.
+ */
+
+
+void cosched_init (coconut_scheduler_t s) {
+	memset (s, 0, sizeof (*s));
+	s->batchrate = 16;
+	s->handofflimit = 4;
+	s->watchdog = cosched_report;
+}
+
+void cosched_fini (coconut_scheduler_t s) {
+	free (s->edf);
+	s->edf = NULL;
+	s->edfcount = s->edfsize = 0;
+	free (s->timers);
+	s->timers = NULL;
+	s->timercount = s->timersize = 0;
+}
+
+
+/* The deadline heap is a binary heap in an array, growing as needed.
+ */
+static void edf_siftup (coconut_scheduler_t s, unsigned i) {
+	coconut_coro_t co = s->edf [i];
+	while (i > 0) {
+		unsigned parent = (i - 1) / 2;
+		if (codeadline (s->edf [parent]) <= codeadline (co)) {
+			break;
+		}
+		s->edf [i] = s->edf [parent];
+		i = parent;
+	}
+	s->edf [i] = co;
+}
+
+static void edf_siftdown (coconut_scheduler_t s, unsigned i) {
+	coconut_coro_t co = s->edf [i];
+	unsigned child;
+	while ((child = 2 * i + 1) < s->edfcount) {
+		if ((child + 1 < s->edfcount) &&
+		    (codeadline (s->edf [child + 1]) < codeadline (s->edf [child]))) {
+			child++;
+		}
+		if (codeadline (co) <= codeadline (s->edf [child])) {
+			break;
+		}
+		s->edf [i] = s->edf [child];
+		i = child;
+	}
+	s->edf [i] = co;
+}
+
+static int edf_push (coconut_scheduler_t s, coconut_coro_t co) {
+	if (s->edfcount == s->edfsize) {
+		unsigned newsize = (s->edfsize == 0)? 64: 2 * s->edfsize;
+		coconut_coro_t *newedf = realloc (s->edf, newsize * sizeof (coconut_coro_t));
+		if (newedf == NULL) {
+			return -ENOMEM;
+		}
+		s->edf = newedf;
+		s->edfsize = newsize;
+	}
+	s->edf [s->edfcount] = co;
+	edf_siftup (s, s->edfcount++);
+	return 0;
+}
+
+static coconut_coro_t edf_pop (coconut_scheduler_t s) {
+	coconut_coro_t co = s->edf [0];
+	if (--s->edfcount > 0) {
+		s->edf [0] = s->edf [s->edfcount];
+		edf_siftdown (s, 0);
+	}
+	return co;
+}
+
+
+/* The timer heap is like the deadline heap, but its entries hold their own
+ * time, as a coro may be taken out of the middle when it is woken up.
+ */
+static void timer_siftup (coconut_scheduler_t s, unsigned i) {
+	coconut_cotimer_st tm = s->timers [i];
+	while (i > 0) {
+		unsigned parent = (i - 1) / 2;
+		if (s->timers [parent].when <= tm.when) {
+			break;
+		}
+		s->timers [i] = s->timers [parent];
+		i = parent;
+	}
+	s->timers [i] = tm;
+}
+
+static void timer_siftdown (coconut_scheduler_t s, unsigned i) {
+	coconut_cotimer_st tm = s->timers [i];
+	unsigned child;
+	while ((child = 2 * i + 1) < s->timercount) {
+		if ((child + 1 < s->timercount) &&
+		    (s->timers [child + 1].when < s->timers [child].when)) {
+			child++;
+		}
+		if (tm.when <= s->timers [child].when) {
+			break;
+		}
+		s->timers [i] = s->timers [child];
+		i = child;
+	}
+	s->timers [i] = tm;
+}
+
+static int timer_push (coconut_scheduler_t s, coconut_coro_t co) {
+	if (s->timercount == s->timersize) {
+		unsigned newsize = (s->timersize == 0)? 64: 2 * s->timersize;
+		coconut_cotimer_t newtimers = realloc (s->timers, newsize * sizeof (coconut_cotimer_st));
+		if (newtimers == NULL) {
+			return -ENOMEM;
+		}
+		s->timers = newtimers;
+		s->timersize = newsize;
+	}
+	s->timers [s->timercount].when = co->altdeadline;
+	s->timers [s->timercount].co = co;
+	timer_siftup (s, s->timercount++);
+	return 0;
+}
+
+static void timer_remove (coconut_scheduler_t s, unsigned i) {
+	if (--s->timercount > i) {
+		s->timers [i] = s->timers [s->timercount];
+		timer_siftdown (s, i);
+		timer_siftup (s, i);
+	}
+}
+
+/* Take the timer of a parked coro out, if it has one.  Only coros that wait
+ * in coalt() with a timeout have one, so others need not look for it.
+ */
+static void timer_cancel (coconut_scheduler_t s, coconut_coro_t co) {
+	unsigned i;
+	if (co->altdeadline == 0) {
+		return;
+	}
+	for (i = 0; i < s->timercount; i++) {
+		if (s->timers [i].co == co) {
+			timer_remove (s, i);
+			return;
+		}
+	}
+}
+
+
+/* The class queues are singly linked through the next field of the coros.
+ */
+static void queue_put (coconut_coroqueue_t q, coconut_coro_t co) {
+	co->next = NULL;
+	if (q->tail == NULL) {
+		q->head = co;
+	} else {
+		q->tail->next = co;
+	}
+	q->tail = co;
+}
+
+static coconut_coro_t queue_get (coconut_coroqueue_t q) {
+	coconut_coro_t co = q->head;
+	if (co != NULL) {
+		q->head = co->next;
+		if (q->head == NULL) {
+			q->tail = NULL;
+		}
+		co->next = NULL;
+	}
+	return co;
+}
+
+/* Take the first coro with the given corofun from a queue, looking no further
+ * than the first few coros.  Returns NULL if none was found.
+ */
+#define COSCHED_AFFINITY_SCAN 16
+static coconut_coro_t queue_get_fun (coconut_coroqueue_t q, bool (*corofun) (void *)) {
+	coconut_coro_t prev = NULL;
+	coconut_coro_t co = q->head;
+	int scan = COSCHED_AFFINITY_SCAN;
+	while ((co != NULL) && (scan-- > 0)) {
+		if (co->corofun == corofun) {
+			if (prev == NULL) {
+				q->head = co->next;
+			} else {
+				prev->next = co->next;
+			}
+			if (q->tail == co) {
+				q->tail = prev;
+			}
+			co->next = NULL;
+			return co;
+		}
+		prev = co;
+		co = co->next;
+	}
+	return NULL;
+}
+
+
+/* Make a coro ready to run, in the heap or in the queue for its class.
+ */
+static int cosched_ready (coconut_scheduler_t s, coconut_coro_t co) {
+	co->schedstate = COSCHED_READY;
+	if ((codeadline (co) != 0) && (co->schedclass != COSCHED_CRITICAL)) {
+		return edf_push (s, co);
+	}
+	assert (co->schedclass < COSCHED_CLASSES);
+	queue_put (&s->ready [co->schedclass], co);
+	return 0;
+}
+
+
+/* Add a coro to a scheduler.  It should have been initialised, and it can
+ * not be in another scheduler.  Returns 0 on success or -ENOMEM.
+ */
+int cosched_add (coconut_scheduler_t s, coconut_coro_t co) {
+	assert (co->schedstate == COSCHED_OFF);
+	if (s->sim != NULL) {
+		return _cosim_add (s->sim, co);
+	}
+	co->sched = s;
+	return cosched_ready (s, co);
+}
+
+
+/* Wake up a parked coro, as called from conut_trigger().  Coros that are not
+ * parked are already going to run, and have nothing to wake up from.
+ */
+void _cosched_wake (coconut_coro_t co) {
+	if (co->sched->sim != NULL) {
+		_cosim_wake (co);
+		return;
+	}
+	if (co->schedstate == COSCHED_PARKED) {
+		co->sched->parked--;
+		timer_cancel (co->sched, co);
+		if (cosched_ready (co->sched, co) != 0) {
+			// Out of memory for the heap; fallback to the class queue
+			queue_put (&co->sched->ready [co->schedclass], co);
+		}
+		if (co->sched->owner != NULL) {
+			conut_trigger (co->sched->ownernut, co->sched->owner);
+		}
+	}
+}
+
+
+/* Hand off to a parked coro, as called from conut_handoff().  It takes the
+ * runnext slot, and a coro that was already there goes to its queue.  Without
+ * a coro running, or with handoffs switched off, this is just a wakeup.
+ */
+void _cosched_handoff (coconut_coro_t co) {
+	coconut_scheduler_t s = co->sched;
+	if (s->sim != NULL) {
+		_cosim_wake (co);
+		return;
+	}
+	if (co->schedstate != COSCHED_PARKED) {
+		return;
+	}
+	if ((s->current == NULL) || (s->handofflimit == 0)) {
+		_cosched_wake (co);
+		return;
+	}
+	s->parked--;
+	timer_cancel (s, co);
+	if (s->runnext != NULL) {
+		if (cosched_ready (s, s->runnext) != 0) {
+			queue_put (&s->ready [s->runnext->schedclass], s->runnext);
+		}
+	}
+	co->schedstate = COSCHED_READY;
+	s->runnext = co;
+	if (s->owner != NULL) {
+		conut_trigger (s->ownernut, s->owner);
+	}
+}
+
+
+/* Pick the next coro to run.  Batch coros are picked when nothing else is
+ * ready, or when others have been picked batchrate times in a row.
+ */
+static coconut_coro_t cosched_pick (coconut_scheduler_t s) {
+	coconut_coro_t co = queue_get (&s->ready [COSCHED_CRITICAL]);
+	if (co != NULL) {
+		s->handoffs = 0;
+		return co;
+	}
+	co = s->runnext;
+	if (co != NULL) {
+		s->runnext = NULL;
+		if (s->handoffs++ < s->handofflimit) {
+			return co;
+		}
+		// Too many handoffs in a row; take a turn in the queue, which
+		// may be the critical queue that was found empty above
+		if (cosched_ready (s, co) != 0) {
+			queue_put (&s->ready [co->schedclass], co);
+		}
+		co = queue_get (&s->ready [COSCHED_CRITICAL]);
+		if (co != NULL) {
+			s->handoffs = 0;
+			return co;
+		}
+	}
+	s->handoffs = 0;
+	if ((s->affinity != 0) && (s->affinityrun < s->affinity) &&
+	    (s->lastclass != COSCHED_CRITICAL) && (s->edfcount == 0)) {
+		// Run another coro with the same code, if one is ready
+		co = queue_get_fun (&s->ready [s->lastclass], s->lastfun);
+		if (co != NULL) {
+			if (s->lastclass == COSCHED_BATCH) {
+				s->batchwait = 0;
+			} else {
+				s->batchwait++;
+			}
+			return co;
+		}
+	}
+	if ((s->batchrate != 0) && (s->batchwait >= s->batchrate)) {
+		co = queue_get (&s->ready [COSCHED_BATCH]);
+		if (co != NULL) {
+			s->batchwait = 0;
+			return co;
+		}
+	}
+	if (s->edfcount > 0) {
+		co = edf_pop (s);
+	} else {
+		co = queue_get (&s->ready [COSCHED_NORMAL]);
+	}
+	if (co != NULL) {
+		s->batchwait++;
+		return co;
+	}
+	s->batchwait = 0;
+	return queue_get (&s->ready [COSCHED_BATCH]);
+}
+
+
+/* Take coros that are marked as cancelled out of the ready queues, the heap
+ * and the runnext slot, and take their timers out.  Parked coros are not
+ * otherwise held by the scheduler, so it is up to the caller to take them out
+ * of its parked count.
+ */
+static void queue_purge (coconut_coroqueue_t q) {
+	coconut_coro_t co = q->head;
+	q->head = q->tail = NULL;
+	while (co != NULL) {
+		coconut_coro_t next = co->next;
+		if (co->cancelled) {
+			co->next = NULL;
+			co->schedstate = COSCHED_OFF;
+			co->sched = NULL;
+		} else {
+			queue_put (q, co);
+		}
+		co = next;
+	}
+}
+
+void _cosched_purge (coconut_scheduler_t s) {
+	unsigned i, kept = 0;
+	for (i = 0; i < COSCHED_CLASSES; i++) {
+		queue_purge (&s->ready [i]);
+	}
+	for (i = 0; i < s->edfcount; i++) {
+		coconut_coro_t co = s->edf [i];
+		if (co->cancelled) {
+			co->schedstate = COSCHED_OFF;
+			co->sched = NULL;
+		} else {
+			s->edf [kept++] = co;
+		}
+	}
+	if (kept < s->edfcount) {
+		s->edfcount = kept;
+		for (i = kept / 2; i-- > 0; ) {
+			edf_siftdown (s, i);
+		}
+	}
+	if ((s->runnext != NULL) && s->runnext->cancelled) {
+		s->runnext->schedstate = COSCHED_OFF;
+		s->runnext->sched = NULL;
+		s->runnext = NULL;
+	}
+	for (i = s->timercount; i-- > 0; ) {
+		if (s->timers [i].co->cancelled) {
+			timer_remove (s, i);
+		}
+	}
+}
+
+
+/* Make the coros whose coalt() timed out ready to run.
+ */
+static void cosched_expire (coconut_scheduler_t s) {
+	uint64_t now = cotime_now ();
+	while ((s->timercount > 0) && (s->timers [0].when <= now)) {
+		coconut_coro_t co = s->timers [0].co;
+		timer_remove (s, 0);
+		s->parked--;
+		if (cosched_ready (s, co) != 0) {
+			queue_put (&s->ready [co->schedclass], co);
+		}
+	}
+}
+
+
+/* Run one ready coro, and then park it, take it out or make it ready again.
+ * Returns false when there was nothing to run.
+ */
+bool cosched_step (coconut_scheduler_t s) {
+	if (s->timercount > 0) {
+		cosched_expire (s);
+	}
+	coconut_coro_t co = cosched_pick (s);
+	if (co == NULL) {
+		return 0;
+	}
+	if ((co->corofun == s->lastfun) && (co->schedclass == s->lastclass)) {
+		s->affinityrun++;
+	} else {
+		s->affinityrun = 1;
+		s->lastfun = co->corofun;
+		s->lastclass = co->schedclass;
+	}
+	co->schedstate = COSCHED_RUNNING;
+	co->waiting = 0;
+#ifndef COCONUT_COMPACT
+	uint64_t budget = (co->budget != 0)? co->budget: s->budget;
+#else
+	uint64_t budget = s->budget;
+#endif
+	if ((budget != 0) || s->accounting) {
+		s->runstart = cotime_now ();
+		s->runend = (budget != 0)? s->runstart + budget: 0;
+	}
+	__atomic_store_n (&s->current, co, __ATOMIC_RELEASE);
+	bool more = cogo (*co);
+	__atomic_store_n (&s->current, NULL, __ATOMIC_RELEASE);
+	if (s->runstart != 0) {
+		uint64_t ran = cotime_now () - s->runstart;
+#ifndef COCONUT_COMPACT
+		co->runtime += ran;
+#endif
+		if ((s->runend != 0) && (ran > 2 * (s->runend - s->runstart))) {
+			s->overruns++;
+			if (__atomic_exchange_n (&s->reported, s->runend, __ATOMIC_RELAXED) != s->runend) {
+				s->watchdog (co, ran);
+			}
+		}
+		s->runstart = s->runend = 0;
+	}
+	if (!more) {
+		co->schedstate = COSCHED_OFF;
+		co->sched = NULL;
+	} else if (((co->coswitch == -11999) || co->waiting) && !coflags_any (&co->activity) &&
+		   ((co->altdeadline == 0) || (timer_push (s, co) == 0))) {
+		co->schedstate = COSCHED_PARKED;
+		s->parked++;
+	} else if (cosched_ready (s, co) != 0) {
+		queue_put (&s->ready [co->schedclass], co);
+	}
+	return 1;
+}
+
+
+/* Check if the current coro has run past twice its budget, and report it
+ * through the watchdog if so.  Coros that check with coslice() yield soon
+ * after their budget, so this leaves room for the work between checks.  This
+ * is meant to be called periodically from another thread, to catch coros that
+ * do not return to the scheduler at all; those that do return late are
+ * reported by cosched_step().  Each run is reported once.  The report is a
+ * diagnostic; it may come late, and the coswitch line is where the coro last
+ * yielded.  Returns true when a coro was reported.
+ */
+bool cosched_watchdog (coconut_scheduler_t s) {
+	coconut_coro_t co = __atomic_load_n (&s->current, __ATOMIC_ACQUIRE);
+	uint64_t runend = __atomic_load_n (&s->runend, __ATOMIC_RELAXED);
+	uint64_t runstart = __atomic_load_n (&s->runstart, __ATOMIC_RELAXED);
+	if ((co == NULL) || (runend == 0)) {
+		return 0;
+	}
+	uint64_t now = cotime_now ();
+	if (now - runstart <= 2 * (runend - runstart)) {
+		return 0;
+	}
+	if (__atomic_exchange_n (&s->reported, runend, __ATOMIC_RELAXED) == runend) {
+		return 0;
+	}
+	s->watchdog (co, now - runstart);
+	return 1;
+}
+
+
+/* The default watchdog, which names the coclass of the coro and the line
+ * where it last yielded on stderr.
+ */
+void cosched_report (coconut_coro_t co, uint64_t ran) {
+	const char *name = (co->coclass != NULL)? co->coclass->coroname: "coro";
+	if (co->coswitch > 0) {
+		fprintf (stderr, "%s %p overran its budget, running %llu ns after line %d\n",
+			name, (void *) co, (unsigned long long) ran, co->coswitch);
+	} else {
+		fprintf (stderr, "%s %p overran its budget, running %llu ns\n",
+			name, (void *) co, (unsigned long long) ran);
+	}
+}
+
+
+/* Run coros until none are ready, sleeping until the next coalt() timeout
+ * while others are parked.  Returns 0 when all coros have ended, or -EDEADLK
+ * when some are still parked, as nothing can wake them anymore.
+ */
+int cosched_run (coconut_scheduler_t s) {
+	for (;;) {
+		while (cosched_step (s)) {
+			;
+		}
+		if (s->timercount == 0) {
+			break;
+		}
+		uint64_t now = cotime_now ();
+		if (s->timers [0].when > now) {
+			uint64_t wait = s->timers [0].when - now;
+			struct timespec ts = { .tv_sec = wait / 1000000000, .tv_nsec = wait % 1000000000 };
+			nanosleep (&ts, NULL);
+		}
+	}
+	return (s->parked > 0)? -EDEADLK: 0;
+}
+
+
+/* Run a coro in a scheduler of its own, until it ends.  Coros that it creates
+ * can be run along with it by adding them to its _co.sched scheduler.
+ */
+int _coschedule (coconut_coro_t co) {
+	coconut_scheduler_st s;
+	int retval;
+	cosched_init (&s);
+	retval = cosched_add (&s, co);
+	if (retval == 0) {
+		retval = cosched_run (&s);
+	}
+	cosched_fini (&s);
+	return retval;
+}
+
+
+/* Run a nested scheduler for one slice.  Its own triggers only wake it up,
+ * so they are cleared before its coros run.
+ */
+static bool cosched_corofun (coconut_schedcoro_t sc) {
+	coconut_scheduler_t s = &sc->sched;
+	coflags_zero (&sc->coro.activity);
+	sc->coro.altdeadline = 0;
+	uint64_t start = cotime_now ();
+	uint64_t now = start;
+	while (cosched_step (s)) {
+		now = cotime_now ();
+		if (now - start >= s->slice) {
+			break;
+		}
+	}
+	s->runtime += now - start;
+	if ((s->ready [COSCHED_CRITICAL].head != NULL) ||
+	    (s->ready [COSCHED_NORMAL  ].head != NULL) ||
+	    (s->ready [COSCHED_BATCH   ].head != NULL) ||
+	    (s->edfcount > 0) || (s->runnext != NULL)) {
+		// More to do after this slice, so be ready to run again
+		sc->coro.coswitch = -99997;
+		return 1;
+	}
+	if (s->parked > 0) {
+		// Look idle to the outer scheduler, to be parked until triggered,
+		// or until the first timeout of the coros parked in here
+		sc->coro.coswitch = -11999;
+		sc->coro.altdeadline = (s->timercount > 0)? s->timers [0].when: 0;
+		return 1;
+	}
+	return 0;
+}
+
+
+/* Setup a scheduler to run as a coro with the given time slice, in
+ * cotime_now() units; with 0, it runs one coro at a time.  Add coros to
+ * sc->sched, and add &sc->coro to another scheduler to run them there.
+ * Call cosched_fini() on sc->sched after it has ended.
+ */
+void cosched_nest (coconut_schedcoro_t sc, uint64_t slice) {
+	memset (&sc->coro, 0, sizeof (sc->coro));
+	coinit (sc->coro, cosched_corofun);
+	cosched_init (&sc->sched);
+	sc->sched.owner = &sc->coro;
+	sc->sched.ownernut = 0;
+	sc->sched.slice = slice;
+}
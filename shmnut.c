@@ -0,0 +1,263 @@
+
+#define _GNU_SOURCE
+
+#include "coconut.h"
+
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+
+/* Shared memory pipes connect coros in different processes.  The ring holds
+ * free-running positions: the writer only moves head and the reader only moves
+ * tail, so neither needs a lock.  Data between tail and head is in the ring.
+ *
+ * Waiting is announced in the shared waiting flags before checking one last
+ * time whether the other side moved.  The other side moves first and then
+ * looks at the flags.  With both in sequentially consistent order, at least
+ * one of them sees the other, so no wakeup is lost.  When a side is not
+ * waiting, it is not sent a wakeup, and no system call is made.
+ */
+
+
+/* Create the shared memory and eventfds for a new pipe, with a ring of at
+ * least size bytes.  Returns 0 or a negative error.
+ */
+int conut_shm_pipe (coconut_shmnut_t n, size_t size) {
+	uint32_t ringsize = 4096;
+	int retval;
+	while ((ringsize < size) && (ringsize < 0x40000000)) {
+		ringsize <<= 1;
+	}
+	memset (n, 0, sizeof (*n));
+	n->evfd [0] = n->evfd [1] = -1;
+	n->memfd = memfd_create ("coconut-pipe", 0);
+	if (n->memfd < 0) {
+		return -errno;
+	}
+	n->mapsize = sizeof (coconut_shmring_st) + ringsize;
+	if (ftruncate (n->memfd, n->mapsize) != 0) {
+		goto fail;
+	}
+	n->evfd [0] = eventfd (0, EFD_NONBLOCK);
+	n->evfd [1] = eventfd (0, EFD_NONBLOCK);
+	if ((n->evfd [0] < 0) || (n->evfd [1] < 0)) {
+		goto fail;
+	}
+	n->ring = mmap (NULL, n->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, n->memfd, 0);
+	if (n->ring == MAP_FAILED) {
+		n->ring = NULL;
+		goto fail;
+	}
+	n->ring->size = ringsize;
+	return 0;
+fail:
+	retval = -errno;
+	conut_shm_unmap (n);
+	return retval;
+}
+
+
+/* Attach to a pipe that was created in another process, from its memfd and
+ * the eventfds that wake the reader and the writer.  These are usually passed
+ * over a UNIX domain socket.  Returns 0 or a negative error.  The pipe only
+ * takes over the file descriptors when it succeeds; after a failure, they are
+ * still open and up to the caller, and the pipe is left unmapped.
+ */
+int conut_shm_attach (coconut_shmnut_t n, int memfd, int rfd, int wfd) {
+	struct stat st;
+	coconut_shmring_t ring;
+	memset (n, 0, sizeof (*n));
+	n->memfd = n->evfd [0] = n->evfd [1] = -1;
+	if (fstat (memfd, &st) != 0) {
+		return -errno;
+	}
+	if (st.st_size < (off_t) sizeof (coconut_shmring_st)) {
+		return -EINVAL;
+	}
+	ring = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (ring == MAP_FAILED) {
+		return -errno;
+	}
+	if ((size_t) st.st_size != sizeof (coconut_shmring_st) + ring->size) {
+		munmap (ring, st.st_size);
+		return -EINVAL;
+	}
+	n->ring = ring;
+	n->mapsize = st.st_size;
+	n->memfd = memfd;
+	n->evfd [0] = rfd;
+	n->evfd [1] = wfd;
+	return 0;
+}
+
+
+void conut_shm_writer (coconut_shmnut_t n, coconut_coro_t coro, uint16_t conut) {
+	n->writer = 1;
+	n->busy = 0;
+	n->coro = coro;
+	n->conut = conut;
+}
+
+void conut_shm_reader (coconut_shmnut_t n, coconut_coro_t coro, uint16_t conut) {
+	n->writer = 0;
+	n->coro = coro;
+	n->conut = conut;
+}
+
+
+/* Handle input on conut_shm_fd(), by passing it on as a trigger.
+ */
+void conut_shm_event (coconut_shmnut_t n) {
+	uint64_t count;
+	if (read (n->evfd [n->writer? 1: 0], &count, sizeof (count)) < 0) {
+		;	// Nothing to read; this was a spurious wakeup
+	}
+	conut_trigger (n->conut, n->coro);
+}
+
+
+/* Wake up the other side, if it is waiting for the given flag.
+ */
+static void shm_wake (coconut_shmnut_t n, uint32_t flag) {
+	if (__atomic_load_n (&n->ring->waiting, __ATOMIC_SEQ_CST) & flag) {
+		uint64_t one = 1;
+		__atomic_fetch_and (&n->ring->waiting, ~flag, __ATOMIC_SEQ_CST);
+		if (write (n->evfd [(flag == COSHM_RWAIT)? 0: 1], &one, sizeof (one)) < 0) {
+			;	// The counter is full, so a wakeup is pending anyway
+		}
+	}
+}
+
+
+/* Close this side of the pipe.  For a writer this sends EOF, for a reader it
+ * makes further writes fail with -EPIPE.
+ */
+void conut_shm_close (coconut_shmnut_t n) {
+	if (n->writer) {
+		__atomic_fetch_or (&n->ring->state, COSHM_EOF, __ATOMIC_SEQ_CST);
+		shm_wake (n, COSHM_RWAIT);
+	} else {
+		__atomic_fetch_or (&n->ring->state, COSHM_CLOSED, __ATOMIC_SEQ_CST);
+		shm_wake (n, COSHM_WWAIT);
+	}
+}
+
+
+/* Unmap the pipe and close its file descriptors, in this process only.
+ */
+void conut_shm_unmap (coconut_shmnut_t n) {
+	if (n->ring != NULL) {
+		munmap (n->ring, n->mapsize);
+		n->ring = NULL;
+	}
+	if (n->memfd >= 0) {
+		close (n->memfd);
+	}
+	if (n->evfd [0] >= 0) {
+		close (n->evfd [0]);
+	}
+	if (n->evfd [1] >= 0) {
+		close (n->evfd [1]);
+	}
+	n->memfd = n->evfd [0] = n->evfd [1] = -1;
+}
+
+
+/* Write to the reader in the other process.  As much as fits is copied into
+ * the ring right away, the rest as the reader makes room.  Returns -EAGAIN
+ * until the reader has taken all of it, and then the length written.  A
+ * zero length sends EOF and returns 0 immediately.
+ */
+int _conut_shm_write (coconut_shmnut_t n, uint8_t *buf, size_t len) {
+	coconut_shmring_t ring = n->ring;
+	uint32_t mask = ring->size - 1;
+	assert (n->writer);
+	assert (len < 0x80000000);
+	_conut_consume (n->coro, n->conut);
+	if (!n->busy) {
+		if (len == 0) {
+			conut_shm_close (n);
+			return 0;
+		}
+		n->busy = 1;
+		n->wofs = 0;
+		n->wend = ring->head + len;
+	}
+	while (1) {
+		if (__atomic_load_n (&ring->state, __ATOMIC_SEQ_CST) & COSHM_CLOSED) {
+			n->busy = 0;
+			return -EPIPE;
+		}
+		uint32_t head = ring->head;
+		uint32_t tail = __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST);
+		size_t todo = ring->size - (head - tail);
+		if (todo > len - n->wofs) {
+			todo = len - n->wofs;
+		}
+		if (todo > 0) {
+			// Copy into the ring, in two parts when it wraps around
+			uint32_t ofs = head & mask;
+			size_t first = (todo < ring->size - ofs)? todo: ring->size - ofs;
+			memcpy (ring->data + ofs, buf + n->wofs, first);
+			memcpy (ring->data, buf + n->wofs + first, todo - first);
+			n->wofs += todo;
+			__atomic_store_n (&ring->head, head + todo, __ATOMIC_SEQ_CST);
+			shm_wake (n, COSHM_RWAIT);
+		}
+		if ((n->wofs == len) && ((int32_t) (tail - n->wend) >= 0)) {
+			n->busy = 0;
+			return len;
+		}
+		// Announce that we wait, then see if the reader moved meanwhile
+		__atomic_fetch_or (&ring->waiting, COSHM_WWAIT, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST) == tail) {
+			if (!(__atomic_load_n (&ring->state, __ATOMIC_SEQ_CST) & COSHM_CLOSED)) {
+				return _conut_block (n->coro);
+			}
+		}
+	}
+}
+
+
+/* Read from the writer in the other process.  Returns what is in the ring,
+ * up to maxlen, or -EAGAIN if it is empty.  After EOF, 0 is returned.
+ */
+int _conut_shm_read (coconut_shmnut_t n, uint8_t *buf, size_t maxlen) {
+	coconut_shmring_t ring = n->ring;
+	uint32_t mask = ring->size - 1;
+	assert (!n->writer);
+	assert (maxlen > 0);
+	_conut_consume (n->coro, n->conut);
+	while (1) {
+		uint32_t tail = ring->tail;
+		uint32_t head = __atomic_load_n (&ring->head, __ATOMIC_SEQ_CST);
+		size_t todo = head - tail;
+		if (todo > 0) {
+			// Copy out of the ring, in two parts when it wraps around
+			if (todo > maxlen) {
+				todo = maxlen;
+			}
+			uint32_t ofs = tail & mask;
+			size_t first = (todo < ring->size - ofs)? todo: ring->size - ofs;
+			memcpy (buf, ring->data + ofs, first);
+			memcpy (buf + first, ring->data, todo - first);
+			__atomic_store_n (&ring->tail, tail + todo, __ATOMIC_SEQ_CST);
+			shm_wake (n, COSHM_WWAIT);
+			return todo;
+		}
+		if (__atomic_load_n (&ring->state, __ATOMIC_SEQ_CST) & COSHM_EOF) {
+			return 0;
+		}
+		// Announce that we wait, then see if the writer moved meanwhile
+		__atomic_fetch_or (&ring->waiting, COSHM_RWAIT, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) == head) {
+			if (!(__atomic_load_n (&ring->state, __ATOMIC_SEQ_CST) & COSHM_EOF)) {
+				return _conut_block (n->coro);
+			}
+		}
+	}
+}
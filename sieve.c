@@ -33,8 +33,8 @@ struct filter {
 /* Declare the type "coro_sieve" and "coro_candidate_generator" coroutines
  * that will be implemented below
  */
-coroutine_decl (struct filter, 2, sieve);
-coroutine_decl (struct filter, 1, candidate_generator);
+coroutine_decl_args (struct filter, 2, sieve, struct { unsigned long prime; });
+coroutine_decl_args (struct filter, 1, candidate_generator, struct { unsigned long stop; });
 
 
 /* Construct a new prime filter coroutine.  This is split out into a "normal"
@@ -46,7 +46,7 @@ coroutine_decl (struct filter, 1, candidate_generator);
  */
 coro_sieve *mkfilter (unsigned long p) {
 	coro_sieve *retval = conew (coro_sieve);
-	coinit (retval, p);	/* TODO: FORM MAY CHANGE? */
+	coinit_args (*retval, sieve, .prime = p);
 	return retval;
 }
 
@@ -54,14 +54,14 @@ coro_sieve *mkfilter (unsigned long p) {
 /* A coroutine named "sieve", whose data is stored in a "struct filter" that can
  * be addressed as "self".  It allocates 2 pipenuts.
  */
-coroutine (struct filter, 2, sieve)
+coroutine_args (struct filter, 2, sieve)
 
 	copipenuts { prev, next };
 	coexceptions { INPUT_ERROR };
 	coresources { NEXT_STAGE };
 
 	/* Initialisation code */
-	self.prime = coarg (unsigned long);
+	self.prime = coargs.prime;
 	printf ("New prime number: %ld\n", self.prime);
 	self.filternum = self.prime;
 
@@ -112,7 +112,7 @@ coroutine (struct filter, 2, sieve)
 	}
 
 	/* Begin the main control for this coprocess */
-	cobody {
+	cobody_typed {
 
 		/* Invoke the event handler loop; all I/O is triggered by events */
 		coprocess ();
@@ -124,10 +124,10 @@ coroutine (struct filter, 2, sieve)
 	printf ("No longer filtering for %ld\n", self.prime);
 	cosuicide ();
 
-coroutine_end
+coroutine_args_end
 
 
-coroutine (struct filter, 1, candidate_generator)
+coroutine_args (struct filter, 1, candidate_generator)
 
 	copipenuts { firstflt };
 	coexceptions { OUTPUTFAILURE };
@@ -137,7 +137,7 @@ coroutine (struct filter, 1, candidate_generator)
 	self.prime = 2;
 	coro_sieve *firstflt = mkfilter (self.prime);
 	cocleanuptodo (FIRST_STAGE);
-	self.filternum = coarg (unsigned long);  // where the generator stops
+	self.filternum = coargs.stop;  // where the generator stops
 	printf ("TODO: Connect to first filter\n");
 
 	/* Exception handler */
@@ -153,7 +153,7 @@ coroutine (struct filter, 1, candidate_generator)
 
 	/* This is simply a routine that pumps the values 2, ... into filters
 	 */
-	cobody {
+	cobody_typed {
 
 		/* Run until wrap-around occurs */
 		while (self.prime != self.filternum) {
@@ -167,13 +167,13 @@ coroutine (struct filter, 1, candidate_generator)
 	/* Finalisation code -- runs after wrap-around */
 	fprintf (stderr, "Candidate generator is ending\n");
 
-coroutine_end
+coroutine_args_end
 
 
 int main (int argc, char *argv []) {
 	/* Create and initialise an instance of the generator */
 	coro_candidate_generater *sieve = conew (candidate_generator);
-	coinit (sieve, 100);	// The argument indicates where the generator stops
+	coinit_args (*sieve, candidate_generator, .stop = 100);
 	/* Run the scheduler on the sieve, with a growing number of coroutines */
 	coschedule (sieve);
 	printf ("Coroutine scheduler exited properly\n");
@@ -0,0 +1,356 @@
+
+#include "coconut.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+
+
+/* The simulator keeps a stage for each coro, found through a hash on the coro
+ * address, and a heap of the stages that are ready, ordered by the virtual
+ * time of their next run and then by a random key.  Stages that are parked
+ * are not in the heap; a wakeup puts them back in, or moves them forward when
+ * they wait for a timeout.
+ */
+
+
+void cosim_init (coconut_simulator_t sim, uint64_t seed) {
+	memset (sim, 0, sizeof (*sim));
+	cosched_init (&sim->sched);
+	sim->sched.sim = sim;
+	sim->runcost = 100;
+	sim->pollcost = 10;
+	sim->hopcost = 50;
+	sim->timercost = 1000;
+	sim->seed = seed;
+	sim->now = 1;
+}
+
+void cosim_fini (coconut_simulator_t sim) {
+	free (sim->stages);
+	free (sim->lookup);
+	free (sim->heap);
+	cosched_fini (&sim->sched);
+	memset (sim, 0, sizeof (*sim));
+}
+
+
+/* The random keys come from splitmix64, which is small and reproducible.
+ */
+static uint64_t sim_random (coconut_simulator_t sim) {
+	uint64_t z = (sim->seed += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+
+/* The hash holds stage index + 1, so 0 marks a free entry.
+ */
+static unsigned sim_hash (coconut_simulator_t sim, coconut_coro_t co) {
+	return (unsigned) ((((uintptr_t) co) >> 4) * 0x9e3779b97f4a7c15ULL >> 32) & (sim->lookupsize - 1);
+}
+
+static coconut_simstage_t sim_find (coconut_simulator_t sim, coconut_coro_t co) {
+	unsigned h;
+	if (sim->lookupsize == 0) {
+		return NULL;
+	}
+	for (h = sim_hash (sim, co); sim->lookup [h] != 0; h = (h + 1) & (sim->lookupsize - 1)) {
+		coconut_simstage_t st = &sim->stages [sim->lookup [h] - 1];
+		if (st->coro == co) {
+			return st;
+		}
+	}
+	return NULL;
+}
+
+static int sim_rehash (coconut_simulator_t sim, unsigned newsize) {
+	unsigned *newlookup = calloc (newsize, sizeof (unsigned));
+	unsigned i, h;
+	if (newlookup == NULL) {
+		return -ENOMEM;
+	}
+	free (sim->lookup);
+	sim->lookup = newlookup;
+	sim->lookupsize = newsize;
+	for (i = 0; i < sim->count; i++) {
+		for (h = sim_hash (sim, sim->stages [i].coro); sim->lookup [h] != 0; h = (h + 1) & (newsize - 1)) {
+			;
+		}
+		sim->lookup [h] = i + 1;
+	}
+	return 0;
+}
+
+
+/* The heap of ready stages, which keep track of their own position in it.
+ */
+static bool sim_before (coconut_simulator_t sim, unsigned a, unsigned b) {
+	coconut_simstage_t sa = &sim->stages [a];
+	coconut_simstage_t sb = &sim->stages [b];
+	return (sa->at < sb->at) || ((sa->at == sb->at) && (sa->key < sb->key));
+}
+
+static void sim_place (coconut_simulator_t sim, unsigned i, unsigned idx) {
+	sim->heap [i] = idx;
+	sim->stages [idx].heapidx = i;
+}
+
+static void sim_siftup (coconut_simulator_t sim, unsigned i) {
+	unsigned idx = sim->heap [i];
+	while (i > 0) {
+		unsigned parent = (i - 1) / 2;
+		if (!sim_before (sim, idx, sim->heap [parent])) {
+			break;
+		}
+		sim_place (sim, i, sim->heap [parent]);
+		i = parent;
+	}
+	sim_place (sim, i, idx);
+}
+
+static void sim_siftdown (coconut_simulator_t sim, unsigned i) {
+	unsigned idx = sim->heap [i];
+	unsigned child;
+	while ((child = 2 * i + 1) < sim->heapcount) {
+		if ((child + 1 < sim->heapcount) && sim_before (sim, sim->heap [child + 1], sim->heap [child])) {
+			child++;
+		}
+		if (!sim_before (sim, sim->heap [child], idx)) {
+			break;
+		}
+		sim_place (sim, i, sim->heap [child]);
+		i = child;
+	}
+	sim_place (sim, i, idx);
+}
+
+/* The heap has room for all stages, so pushing cannot fail.
+ */
+static void sim_push (coconut_simulator_t sim, coconut_simstage_t st, uint64_t at) {
+	st->at = at;
+	st->key = sim_random (sim);
+	st->coro->schedstate = COSCHED_READY;
+	sim->heap [sim->heapcount] = st - sim->stages;
+	sim_siftup (sim, sim->heapcount++);
+}
+
+static coconut_simstage_t sim_pop (coconut_simulator_t sim) {
+	coconut_simstage_t st = &sim->stages [sim->heap [0]];
+	st->heapidx = UINT_MAX;
+	if (--sim->heapcount > 0) {
+		sim_place (sim, 0, sim->heap [sim->heapcount]);
+		sim_siftdown (sim, 0);
+	}
+	return st;
+}
+
+
+/* Add a coro as a new stage, ready to run now, as called from cosched_add().
+ * Returns 0 or -ENOMEM.
+ */
+int _cosim_add (coconut_simulator_t sim, coconut_coro_t co) {
+	coconut_simstage_t st;
+	if (sim->count == sim->size) {
+		unsigned newsize = (sim->size == 0)? 64: 2 * sim->size;
+		unsigned current = (sim->current != NULL)? sim->current - sim->stages: 0;
+		coconut_simstage_t newstages = realloc (sim->stages, newsize * sizeof (coconut_simstage_st));
+		if (newstages == NULL) {
+			return -ENOMEM;
+		}
+		if (sim->current != NULL) {
+			sim->current = &newstages [current];
+		}
+		sim->stages = newstages;
+		unsigned *newheap = realloc (sim->heap, newsize * sizeof (unsigned));
+		if (newheap == NULL) {
+			return -ENOMEM;
+		}
+		sim->heap = newheap;
+		sim->size = newsize;
+	}
+	if (2 * (sim->count + 1) > sim->lookupsize) {
+		if (sim_rehash (sim, (sim->lookupsize == 0)? 128: 2 * sim->lookupsize) != 0) {
+			return -ENOMEM;
+		}
+	}
+	st = &sim->stages [sim->count];
+	memset (st, 0, sizeof (*st));
+	st->coro = co;
+	st->wokeat = UINT64_MAX;
+	st->heapidx = UINT_MAX;
+	unsigned h;
+	for (h = sim_hash (sim, co); sim->lookup [h] != 0; h = (h + 1) & (sim->lookupsize - 1)) {
+		;
+	}
+	sim->lookup [h] = ++sim->count;
+	co->sched = &sim->sched;
+	sim_push (sim, st, sim->now);
+	return 0;
+}
+
+
+/* Wake up a stage, as called from conut_trigger() and conut_handoff().  The
+ * wakeup arrives after a hop, and the stage runs when it has also finished
+ * its previous run.
+ */
+void _cosim_wake (coconut_coro_t co) {
+	coconut_simulator_t sim = co->sched->sim;
+	coconut_simstage_t st = sim_find (sim, co);
+	sim->wakes++;
+	if ((st == NULL) || (st == sim->current)) {
+		return;
+	}
+	uint64_t arrive = sim->now + ((sim->current != NULL)? sim->hopcost: 0);
+	uint64_t at = (arrive > st->free)? arrive: st->free;
+	if (arrive < st->wokeat) {
+		st->wokeat = arrive;
+	}
+	if (co->schedstate == COSCHED_PARKED) {
+		sim->sched.parked--;
+		sim_push (sim, st, at);
+	} else if ((st->heapidx != UINT_MAX) && (st->at > at)) {
+		// Waiting for a timeout; the wakeup comes first
+		st->at = at;
+		sim_siftup (sim, st->heapidx);
+	}
+}
+
+
+/* Charge virtual time and count items for the running stage.
+ */
+void _cosim_charge (coconut_coro_t co, uint64_t cost, uint64_t items) {
+	if ((co->sched == NULL) || (co->sched->sim == NULL)) {
+		return;
+	}
+	co->sched->sim->now += cost;
+	co->sched->sim->items += items;
+}
+
+
+/* Run the simulation until no stage is ready, or until the virtual time has
+ * passed until, if that is not 0.  Returns 0 when all coros have ended,
+ * -EDEADLK when some are parked and nothing can wake them, or -ETIMEDOUT when
+ * stages were still ready at the time limit, which may show coros that keep
+ * retrying without progress.  A simulation may be continued with a later
+ * time limit.
+ */
+int cosim_run (coconut_simulator_t sim, uint64_t until) {
+	int retval = 0;
+	cotime_virtual (&sim->now);
+	while (sim->heapcount > 0) {
+		if ((until != 0) && (sim->stages [sim->heap [0]].at > until)) {
+			retval = -ETIMEDOUT;
+			break;
+		}
+		coconut_simstage_t st = sim_pop (sim);
+		coconut_coro_t co = st->coro;
+		unsigned idx = st - sim->stages;
+		uint64_t start = st->at;
+		sim->now = start;
+		if (st->wokeat != UINT64_MAX) {
+			st->queued += start - st->wokeat;
+			st->wokeat = UINT64_MAX;
+		}
+		int coswitch = co->coswitch;
+		uint64_t wakes = sim->wakes;
+		uint64_t items = sim->items;
+		co->schedstate = COSCHED_RUNNING;
+		co->waiting = 0;
+		sim->current = st;
+		sim->sched.current = co;
+		bool more = cogo (*co);
+		sim->sched.current = NULL;
+		sim->current = NULL;
+		// Coros may have been added, which may move the stages
+		st = &sim->stages [idx];
+		bool progress = !more || (co->coswitch != coswitch) || (sim->now != start) ||
+				(sim->wakes != wakes) || (sim->items != items);
+		uint64_t end = sim->now + (progress? sim->runcost: sim->pollcost);
+		st->busy += end - start;
+		st->free = end;
+		st->runs++;
+		sim->runs++;
+		sim->now = start;
+		if (!more) {
+			co->schedstate = COSCHED_OFF;
+			co->sched = NULL;
+		} else if (coflags_any (&co->activity)) {
+			sim_push (sim, st, end);
+		} else if ((co->coswitch == -11999) || (co->waiting && (co->altdeadline == 0))) {
+			co->schedstate = COSCHED_PARKED;
+			sim->sched.parked++;
+		} else if (co->altdeadline > end) {
+			sim_push (sim, st, co->altdeadline + sim->timercost);
+		} else {
+			sim_push (sim, st, end);
+		}
+	}
+	cotime_virtual (NULL);
+	if ((retval == 0) && (sim->sched.parked > 0)) {
+		retval = -EDEADLK;
+	}
+	return retval;
+}
+
+
+/* Print the results of a simulation.  Stages are listed by busy time, and
+ * those within 10% of the busiest are marked as the critical path.  They are
+ * numbered in the order they were added, so reports can be compared.
+ */
+static coconut_simulator_t sim_sorting;
+
+static int sim_busier (const void *a, const void *b) {
+	uint64_t ba = sim_sorting->stages [* (const unsigned *) a].busy;
+	uint64_t bb = sim_sorting->stages [* (const unsigned *) b].busy;
+	return (ba > bb)? -1: (ba < bb)? 1: 0;
+}
+
+void cosim_report (coconut_simulator_t sim, FILE *out) {
+	uint64_t span = 0;
+	unsigned *order = calloc (sim->count + 1, sizeof (unsigned));
+	unsigned i, j;
+	for (i = 0; i < sim->count; i++) {
+		if (sim->stages [i].free > span) {
+			span = sim->stages [i].free;
+		}
+	}
+	fprintf (out, "virtual time %llu ns, %llu runs, %llu items",
+		(unsigned long long) span, (unsigned long long) sim->runs, (unsigned long long) sim->items);
+	if ((span > 0) && (sim->items > 0)) {
+		fprintf (out, ", %.1f items/s", 1e9 * sim->items / span);
+	}
+	fprintf (out, "\n");
+	if (order == NULL) {
+		return;
+	}
+	for (i = 0; i < sim->count; i++) {
+		order [i] = i;
+	}
+	sim_sorting = sim;
+	qsort (order, sim->count, sizeof (unsigned), sim_busier);
+	fprintf (out, "  %-24s %8s %12s %6s %12s\n", "stage", "runs", "busy ns", "busy%", "queued ns");
+	for (i = 0; i < sim->count; i++) {
+		coconut_simstage_t st = &sim->stages [order [i]];
+		coconut_coro_t co = st->coro;
+		bool critical = (st->busy > 0) && (10 * st->busy >= 9 * sim->stages [order [0]].busy);
+		fprintf (out, "%c %-16s #%-6u %8llu %12llu %5.1f%% %12llu\n",
+			critical? '*': ' ', (co->coclass != NULL)? co->coclass->coroname: "coro", order [i],
+			(unsigned long long) st->runs, (unsigned long long) st->busy,
+			(span > 0)? 100.0 * st->busy / span: 0.0, (unsigned long long) st->queued);
+		if (co->coclass == NULL) {
+			continue;
+		}
+		coconut_pipenut_t pn = (coconut_pipenut_t) (co + 1);
+		for (j = 0; j < co->coclass->conutcount; j++) {
+			if ((conut_blocked_full (&pn [j]) != 0) || (conut_blocked_empty (&pn [j]) != 0)) {
+				fprintf (out, "      conut %u blocked on full %llu ns, on empty %llu ns\n", j,
+					(unsigned long long) conut_blocked_full (&pn [j]),
+					(unsigned long long) conut_blocked_empty (&pn [j]));
+			}
+		}
+	}
+	free (order);
+}
@@ -0,0 +1,169 @@
+/* Check that cocancel() tears down a coronet that waits in different ways.
+ * Every coro is taken out of its scheduler, along with its timer, coros in
+ * their event loop get their finalise turn, and every resource is cleaned up
+ * once, also when helper threads share the work.
+ *
+ * cc -std=gnu11 -I.. -o test_cancel test_cancel.c ../cancel.c ../pipenut.c \
+ *	../destroy.c ../cocall.c ../cotime.c ../scheduler.c ../simulate.c -lpthread
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "coconut.h"
+
+
+#define MANY 300
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+struct cancel_data {
+	int v;
+	int cleaned;
+	int finalised;
+};
+
+
+/* Read from a pipe nut that is never written.
+ */
+coroutine_decl_args (struct cancel_data, 1, blocker, struct { int unused; });
+
+coroutine_args (struct cancel_data, 1, blocker)
+	copipenuts { in };
+	coresources { RES };
+	cocleantodo (RES);
+	cocleanaction (RES) {
+		self.cleaned++;
+	}
+	cobody_typed {
+		conut_read (in, &self.v, sizeof (self.v));
+		codone ();
+	}
+coroutine_args_end
+
+
+/* Wait in coalt() for a long time.
+ */
+coroutine_decl_args (struct cancel_data, 1, idler, struct { int unused; });
+
+coroutine_args (struct cancel_data, 1, idler)
+	copipenuts { out };
+	coresources { RES };
+	cocleantodo (RES);
+	cocleanaction (RES) {
+		self.cleaned++;
+	}
+	cobody_typed {
+		coalt (conut_bit (out), 10000, COALT_PRIORITY);
+		codone ();
+	}
+coroutine_args_end
+
+
+/* Wait in the event loop, and end on the finalise event.
+ */
+coroutine_decl_args (struct cancel_data, 1, watcher, struct { int unused; });
+
+coroutine_args (struct cancel_data, 1, watcher)
+	copipenuts { ctl };
+	coresources { RES };
+	cocleantodo (RES);
+	cocleanaction (RES) {
+		self.cleaned++;
+	}
+	if (0) {
+	cocatch_finalise ()
+		self.finalised++;
+		codone ();
+	}
+	cobody_typed {
+		conut_process ();
+	}
+coroutine_args_end
+
+
+int main (void) {
+	coconut_scheduler_st s;
+	coro_blocker *b = calloc (1, sizeof (*b));
+	coro_idler *i = calloc (1, sizeof (*i));
+	coro_watcher *w = calloc (MANY, sizeof (*w));
+	coconut_coro_t coros [MANY];
+	int n;
+	coinit_args_class (*b, blocker, .unused = 0);
+	coinit_args_class (*i, idler, .unused = 0);
+	coinit_args_class (w [0], watcher, .unused = 0);
+	conut_makepipe (&b->pipes [0], &i->pipes [0]);
+	coros [0] = &b->coro;
+	coros [1] = &i->coro;
+	coros [2] = &w [0].coro;
+	//
+	// Park all three, each in its own way
+	cosched_init (&s);
+	for (n = 0; n < 3; n++) {
+		check (cosched_add (&s, coros [n]) == 0);
+	}
+	for (n = 0; n < 3; n++) {
+		check (cosched_step (&s));
+	}
+	check ((s.parked == 3) && (s.timercount == 1));
+	//
+	// Refuse a running coro or one without a coclass, and cancel nothing
+	w [0].coro.schedstate = COSCHED_RUNNING;
+	check (cocancel (coros, 3, 1) == -EBUSY);
+	w [0].coro.schedstate = COSCHED_PARKED;
+	w [0].coro.coclass = NULL;
+	check (cocancel (coros, 3, 1) == -EINVAL);
+	w [0].coro.coclass = &coro_watcher_class;
+	check (!b->coro.cancelled && (s.parked == 3));
+	//
+	// Cancel them, which empties the scheduler
+	check (cocancel (coros, 3, 1) == 0);
+	check ((s.parked == 0) && (s.timercount == 0));
+	for (n = 0; n < 3; n++) {
+		check (coros [n]->cancelled);
+		check ((coros [n]->sched == NULL) && (coros [n]->schedstate == COSCHED_OFF));
+		check (!cogo (*coros [n]));
+	}
+	check ((b->user.cleaned == 1) && (i->user.cleaned == 1) && (w [0].user.cleaned == 1));
+	check ((b->user.finalised == 0) && (i->user.finalised == 0) && (w [0].user.finalised == 1));
+	check ((b->pipes [0].err == ECONNRESET) && (i->pipes [0].err == ECONNRESET));
+	check (!cosched_step (&s));
+	check (cosched_run (&s) == 0);
+	cosched_fini (&s);
+	//
+	// Many coros are cancelled in batches over helper threads
+	cosched_init (&s);
+	for (n = 0; n < MANY; n++) {
+		coinit_args_class (w [n], watcher, .unused = 0);
+		w [n].user.cleaned = w [n].user.finalised = 0;
+		coros [n] = &w [n].coro;
+		check (cosched_add (&s, coros [n]) == 0);
+	}
+	while (cosched_step (&s)) {
+		;
+	}
+	check (s.parked == MANY);
+	check (cocancel (coros, MANY, 4) == 0);
+	check (s.parked == 0);
+	for (n = 0; n < MANY; n++) {
+		check ((w [n].user.cleaned == 1) && (w [n].user.finalised == 1));
+	}
+	cosched_fini (&s);
+	free (b);
+	free (i);
+	free (w);
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All cancel checks passed\n");
+	return 0;
+}
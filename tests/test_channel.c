@@ -0,0 +1,150 @@
+/* Check typed channels.  Elements arrive in order and unchanged, EOF arrives
+ * as 0 after the last element, and writing at both ends is reported as
+ * -EPROTO at both ends.
+ *
+ * cc -std=gnu11 -I.. -o test_channel test_channel.c ../pipenut.c \
+ *	../destroy.c ../cocall.c ../cotime.c ../scheduler.c ../simulate.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "coconut.h"
+
+
+#define COUNT   1000
+#define MAXRUNS 10000
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+struct producer {
+	coconut_coro_st coro;
+	cochannel (unsigned long) out;
+	unsigned long n;
+	int res;
+};
+
+struct consumer {
+	coconut_coro_st coro;
+	cochannel (unsigned long) in;
+	unsigned long v;
+	unsigned long count;
+	unsigned long sum;
+	bool ordered;
+	int res;
+};
+
+
+/* Write the numbers 1 to COUNT, and close.
+ */
+bool producer (struct producer *selfp) {
+	ssize_t _coio;
+cobegin ();
+	for (selfp->n = 1; selfp->n <= COUNT; selfp->n++) {
+		cochannel_write (selfp->out, selfp->n);
+		if (conut_size () != sizeof (unsigned long)) {
+			selfp->res = conut_size ();
+			break;
+		}
+	}
+	cochannel_close (selfp->out);
+coend ();
+}
+
+/* Read numbers until EOF, and check that they come in order.
+ */
+bool consumer (struct consumer *selfp) {
+	ssize_t _coio;
+cobegin ();
+	selfp->ordered = 1;
+	do {
+		cochannel_read (selfp->in, selfp->v);
+		if (conut_size () > 0) {
+			selfp->count++;
+			selfp->sum += selfp->v;
+			if (selfp->v != selfp->count) {
+				selfp->ordered = 0;
+			}
+		}
+	} while (conut_size () > 0);
+	selfp->res = conut_size ();
+coend ();
+}
+
+/* Write one number, and note the outcome.
+ */
+bool clasher (struct producer *selfp) {
+	ssize_t _coio;
+cobegin ();
+	cochannel_write (selfp->out, selfp->n);
+	selfp->res = conut_size ();
+coend ();
+}
+
+
+/* Run two coros until both have ended, or return false.
+ */
+static bool runboth (coconut_coro_t a, coconut_coro_t b) {
+	bool busy = 1;
+	int runs;
+	for (runs = 0; busy && (runs < MAXRUNS); runs++) {
+		bool abusy = cogo (*a);
+		bool bbusy = cogo (*b);
+		busy = abusy || bbusy;
+	}
+	return !busy;
+}
+
+
+int main (void) {
+	struct producer p, q;
+	struct consumer c;
+	//
+	// Elements come through in order, followed by EOF
+	memset (&p, 0, sizeof (p));
+	memset (&c, 0, sizeof (c));
+	coinit (p.coro, producer);
+	coinit (c.coro, consumer);
+	cochannel_owner (p.out, &p.coro, 0);
+	cochannel_owner (c.in, &c.coro, 0);
+	cochannel_makepipe (p.out, c.in);
+	check (runboth (&p.coro, &c.coro));
+	check (p.res == 0);
+	check (c.count == COUNT);
+	check (c.sum == (unsigned long) COUNT * (COUNT + 1) / 2);
+	check (c.ordered);
+	check (c.res == 0);
+	//
+	// The consumer may also run first, and without owners, by polling
+	memset (&p, 0, sizeof (p));
+	memset (&c, 0, sizeof (c));
+	coinit (p.coro, producer);
+	coinit (c.coro, consumer);
+	cochannel_makepipe (p.out, c.in);
+	check (runboth (&c.coro, &p.coro));
+	check ((c.count == COUNT) && c.ordered && (c.res == 0));
+	//
+	// Writing at both ends fails at both ends
+	memset (&p, 0, sizeof (p));
+	memset (&q, 0, sizeof (q));
+	coinit (p.coro, clasher);
+	coinit (q.coro, clasher);
+	cochannel_owner (p.out, &p.coro, 0);
+	cochannel_owner (q.out, &q.coro, 0);
+	cochannel_makepipe (p.out, q.out);
+	check (runboth (&p.coro, &q.coro));
+	check ((p.res == -EPROTO) && (q.res == -EPROTO));
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All channel checks passed\n");
+	return 0;
+}
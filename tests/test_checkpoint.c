@@ -0,0 +1,174 @@
+/* Check that a coronet survives a checkpoint and restore halfway through its
+ * work, with its pipe nuts and cocall() links rebased to the snapshot, and
+ * that pointers out of the coronet are refused.  Restored coros are neither
+ * waiting nor cancelled, and their deadlines count from the restore.
+ *
+ * cc -std=gnu11 -I.. -o test_checkpoint test_checkpoint.c ../checkpoint.c \
+ *	../pipenut.c ../destroy.c ../cocall.c ../cotime.c ../scheduler.c ../simulate.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "coconut.h"
+
+
+#define UPTO    10
+#define MAXRUNS 1000
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+/* Write the numbers 1 to upto, and then EOF.
+ */
+coroutine_decl_args (int, 1, counter, struct { int upto; });
+
+coroutine_args (int, 1, counter)
+	copipenuts { out };
+	cobody_typed {
+		self++;
+		if (self > coargs.upto) {
+			conut_push (out);
+			codone ();
+		}
+		conut_write (out, &self, sizeof (self));
+	}
+coroutine_args_end
+
+
+/* Add up numbers until EOF.
+ */
+struct summer_data {
+	int v;
+	int count;
+	int sum;
+};
+
+coroutine_decl_args (struct summer_data, 1, summer, struct { int unused; });
+
+coroutine_args (struct summer_data, 1, summer)
+	copipenuts { in };
+	cobody_typed {
+		conut_read (in, &self.v, sizeof (self.v));
+		if (conut_size () <= 0) {
+			codone ();
+		}
+		self.count++;
+		self.sum += self.v;
+	}
+coroutine_args_end
+
+
+static const struct coclass *classes [2] = { &coro_counter_class, &coro_summer_class };
+
+
+/* Run two coros until both end, or until the summer has counted stop.
+ */
+static bool runboth (coconut_coro_t a, coconut_coro_t b, struct summer_data *sd, int stop) {
+	bool busy = 1;
+	int runs;
+	for (runs = 0; busy && (runs < MAXRUNS) && (sd->count < stop); runs++) {
+		bool abusy = cogo (*a);
+		bool bbusy = cogo (*b);
+		busy = abusy || bbusy;
+	}
+	return !busy || (sd->count >= stop);
+}
+
+
+int main (void) {
+	char path [] = "/tmp/test_checkpoint_XXXXXX";
+	coro_counter *c = calloc (1, sizeof (*c));
+	coro_summer *s = calloc (1, sizeof (*s));
+	coconut_coro_t coros [2] = { &c->coro, &s->coro };
+	coconut_snapshot_st snap;
+	int fd = mkstemp (path);
+	check (fd >= 0);
+	close (fd);
+	coinit_args_class (*c, counter, .upto = UPTO);
+	coinit_args_class (*s, summer, .unused = 0);
+	conut_makepipe (&c->pipes [0], &s->pipes [0]);
+	//
+	// Stop halfway, and save the coronet
+	check (runboth (&c->coro, &s->coro, &s->user, 4));
+	check ((s->user.count >= 4) && (s->user.count < UPTO));
+	check (s->user.sum == s->user.count * (s->user.count + 1) / 2);
+	check (cocheckpoint (path, coros, 2) == 0);
+	//
+	// Only the snapshot continues, which must not touch the originals
+	memset (c, 0, sizeof (*c));
+	memset (s, 0, sizeof (*s));
+	check (corestore (&snap, path, classes, 2) == 0);
+	check (snap.count == 2);
+	if (snap.count == 2) {
+		coro_counter *rc = (coro_counter *) snap.coros [0];
+		coro_summer *rs = (coro_summer *) snap.coros [1];
+		check ((rc->coro.coclass == &coro_counter_class) && (rs->coro.coclass == &coro_summer_class));
+		check ((rc->pipes [0].peer == &rs->pipes [0]) && (rs->pipes [0].peer == &rc->pipes [0]));
+		check (runboth (&rc->coro, &rs->coro, &rs->user, UPTO + 1));
+		check (rs->user.count == UPTO);
+		check (rs->user.sum == UPTO * (UPTO + 1) / 2);
+		corestore_free (&snap);
+	}
+	//
+	// The cocall() links are rebased along with the coros
+	coinit_args_class (*c, counter, .upto = UPTO);
+	coinit_args_class (*s, summer, .unused = 0);
+	s->coro.subleaf = &c->coro;
+	c->coro.subparent = &s->coro;
+	check (cocheckpoint (path, coros, 2) == 0);
+	check (corestore (&snap, path, classes, 2) == 0);
+	if (snap.count == 2) {
+		check (snap.coros [1]->subleaf == snap.coros [0]);
+		check (snap.coros [0]->subparent == snap.coros [1]);
+		corestore_free (&snap);
+	}
+	//
+	// Pointers out of the coronet are refused
+	check (cocheckpoint (path, coros, 1) == -EXDEV);
+	s->coro.subleaf = c->coro.subparent = NULL;
+	conut_makepipe (&c->pipes [0], &s->pipes [0]);
+	check (cocheckpoint (path, coros + 1, 1) == -EXDEV);
+	//
+	// Deadlines keep the time that was left, and the rest is cleared
+	coinit_args_class (*c, counter, .upto = UPTO);
+	coinit_args_class (*s, summer, .unused = 0);
+	uint64_t before = cotime_now ();
+	uint64_t deadline = before + 5000000000ULL;
+	c->coro.altdeadline = deadline;
+	c->coro.deadline = 1;
+	s->coro.waiting = 1;
+	s->coro.cancelled = 1;
+	check (cocheckpoint (path, coros, 2) == 0);
+	uint64_t saved = cotime_now ();
+	usleep (20000);
+	uint64_t restoring = cotime_now ();
+	check (corestore (&snap, path, classes, 2) == 0);
+	uint64_t after = cotime_now ();
+	if (snap.count == 2) {
+		check ((snap.coros [0]->altdeadline >= deadline + (restoring - saved)) &&
+		       (snap.coros [0]->altdeadline <= deadline + (after - before)));
+		check ((snap.coros [0]->deadline != 0) && (snap.coros [0]->deadline <= after + 1));
+		check (snap.coros [1]->altdeadline == 0);
+		check (snap.coros [1]->deadline == 0);
+		check (!snap.coros [1]->waiting && !snap.coros [1]->cancelled);
+		corestore_free (&snap);
+	}
+	unlink (path);
+	free (c);
+	free (s);
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All checkpoint checks passed\n");
+	return 0;
+}
@@ -0,0 +1,133 @@
+/* Check coalt() with priority and with fair turns, on conuts that are spread
+ * over all words of the activity flags.  Triggers outside of the set are left
+ * alone, and a timeout of 0 ends the wait at once.  Build it with one word of
+ * flags and with more, as the code differs:
+ *
+ * cc -std=gnu11 -I.. -o test_coalt test_coalt.c ../pipenut.c \
+ *	../destroy.c ../cocall.c ../cotime.c ../scheduler.c ../simulate.c
+ * cc -std=gnu11 -I.. -DCOCONUT_FLAG_WORDS=4 -o test_coalt4 test_coalt.c \
+ *	../pipenut.c ../destroy.c ../cocall.c ../cotime.c ../scheduler.c ../simulate.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "coconut.h"
+
+
+#define TURNS 8
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+/* Conuts at the start, the middle and the end of the usable flags.
+ */
+static const int picks [4] = {
+	1,
+	COCONUT_FLAG_BITS / 4 + 1,
+	COCONUT_FLAG_BITS / 2 + 1,
+	COCONUT_FLAG_BITS - 3
+};
+#define OUTSIDE (COCONUT_FLAG_BITS / 2)
+
+struct alt {
+	coconut_coro_st coro;
+	coflags_t set;
+	int timeout;
+	bool mode;
+	int n;
+	int got [TURNS];
+};
+
+
+/* Wait for one conut in the set per run.
+ */
+bool alter (struct alt *selfp) {
+	ssize_t _coio;
+cobegin ();
+	while (selfp->n < TURNS) {
+		coalt (selfp->set, selfp->timeout, selfp->mode);
+		selfp->got [selfp->n++] = coalt_ready ();
+		coyield ();
+	}
+coend ();
+}
+
+
+/* Trigger all picks, and then run turns that each take one, triggering the
+ * one that was taken again, so it competes with the others.
+ */
+static void turns (struct alt *a, bool mode) {
+	int i;
+	memset (a, 0, sizeof (*a));
+	coinit (a->coro, alter);
+	coflags_zero (&a->set);
+	for (i = 0; i < 4; i++) {
+		coflags_set (&a->set, picks [i]);
+		conut_trigger (picks [i], &a->coro);
+	}
+	a->timeout = -1;
+	a->mode = mode;
+	for (i = 0; i < TURNS; i++) {
+		check (cogo (a->coro));
+		if (a->n == i + 1) {
+			conut_trigger (a->got [i], &a->coro);
+		}
+	}
+}
+
+
+int main (void) {
+	struct alt a;
+	int i;
+	//
+	// Priority always takes the lowest conut
+	turns (&a, COALT_PRIORITY);
+	check (a.n == TURNS);
+	for (i = 0; i < TURNS; i++) {
+		check (a.got [i] == picks [0]);
+	}
+	//
+	// Fair turns go round all conuts, across words of flags
+	turns (&a, COALT_FAIR);
+	check (a.n == TURNS);
+	for (i = 0; i < TURNS; i++) {
+		check (a.got [i] == picks [i % 4]);
+	}
+	check (a.coro.fairlast == 0);
+	//
+	// Without a trigger in the set, a timeout of 0 ends at once, and a
+	// trigger outside of the set stays
+	memset (&a, 0, sizeof (a));
+	coinit (a.coro, alter);
+	coflags_zero (&a.set);
+	coflags_set (&a.set, picks [2]);
+	conut_trigger (OUTSIDE, &a.coro);
+	a.timeout = 0;
+	check (cogo (a.coro));
+	check ((a.n == 1) && (a.got [0] == -ETIMEDOUT));
+	check (coflags_test (&a.coro.activity, OUTSIDE));
+	check (a.coro.altdeadline == 0);
+	//
+	// Without a timeout, it waits until a trigger in the set
+	a.timeout = -1;
+	check (cogo (a.coro));
+	check (a.n == 1);
+	check (cogo (a.coro));
+	check (a.n == 1);
+	conut_trigger (picks [2], &a.coro);
+	check (cogo (a.coro));
+	check ((a.n == 2) && (a.got [1] == picks [2]));
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All coalt checks passed with %d flag words\n", COCONUT_FLAG_WORDS);
+	return 0;
+}
@@ -0,0 +1,142 @@
+/* Check coronet templates.  Every copy of a stamp has its edges linked within
+ * itself, and the copies run independently, each with the arguments that its
+ * initialiser set for its copy number.  Coros without an initialiser start
+ * at their body, conuts without an edge stay open, and templates with edges
+ * that do not fit their coros are refused.
+ *
+ * cc -std=gnu11 -I.. -o test_cotemplate test_cotemplate.c ../cotemplate.c \
+ *	../placement.c ../pipenut.c ../destroy.c ../cocall.c ../cotime.c \
+ *	../scheduler.c ../simulate.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "coconut.h"
+
+
+#define COPIES 5
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+/* Write the numbers 1 to upto, and then EOF.
+ */
+coroutine_decl_args (int, 1, counter, struct { int upto; });
+
+coroutine_args (int, 1, counter)
+	copipenuts { out };
+	cobody_typed {
+		self++;
+		if (self > coargs.upto) {
+			conut_push (out);
+			codone ();
+		}
+		conut_write (out, &self, sizeof (self));
+	}
+coroutine_args_end
+
+
+/* Add up numbers until EOF.
+ */
+struct summer_data {
+	int v;
+	int sum;
+};
+
+coroutine_decl_args (struct summer_data, 1, summer, struct { int unused; });
+
+coroutine_args (struct summer_data, 1, summer)
+	copipenuts { in };
+	cobody_typed {
+		conut_read (in, &self.v, sizeof (self.v));
+		if (conut_size () <= 0) {
+			codone ();
+		}
+		self.sum += self.v;
+	}
+coroutine_args_end
+
+
+/* Count up to the copy number plus the template argument.
+ */
+static void setup_counter (coconut_coro_t co, unsigned copy, void *arg) {
+	((coro_counter *) co)->args.upto = copy + *(int *) arg;
+}
+
+static void setup_summer (coconut_coro_t co, unsigned copy, void *arg) {
+	(void) co;
+	(void) copy;
+	(void) arg;
+}
+
+
+int main (void) {
+	static int base = 10;
+	const coconut_tmplcoro_st coros [3] = {
+		{ &coro_counter_class, COSCHED_NORMAL, setup_counter, &base },
+		{ &coro_summer_class, COSCHED_BATCH, setup_summer, NULL },
+		{ &coro_counter_class, COSCHED_NORMAL, NULL, NULL },
+	};
+	const coconut_tmpledge_st edges [1] = { { 0, 0, 1, 0 } };
+	const coconut_template_st tmpl = { coros, edges, 3, 1 };
+	coconut_stamp_st st;
+	coconut_scheduler_st s;
+	unsigned n, m;
+	//
+	// Each copy is linked within itself, and the open conut stays open
+	check (cotemplate_stamp (&st, &tmpl, COPIES, -1) == 0);
+	check (st.copies == COPIES);
+	for (n = 0; n < st.copies; n++) {
+		check (cotemplate_conut (&st, n, 0, 0)->peer == cotemplate_conut (&st, n, 1, 0));
+		check (cotemplate_conut (&st, n, 1, 0)->peer == cotemplate_conut (&st, n, 0, 0));
+		check (cotemplate_conut (&st, n, 2, 0)->peer == NULL);
+		check (cotemplate_coro (&st, n, 0)->coclass == &coro_counter_class);
+		check (cotemplate_coro (&st, n, 1)->schedclass == COSCHED_BATCH);
+		check (cotemplate_coro (&st, n, 2)->coswitch == -99997);
+		check (((coro_counter *) cotemplate_coro (&st, n, 0))->args.upto == (int) n + base);
+		for (m = 0; m < n; m++) {
+			check (cotemplate_coro (&st, n, 0) != cotemplate_coro (&st, m, 0));
+		}
+	}
+	//
+	// The copies run on their own, each to its own sum
+	cosched_init (&s);
+	for (n = 0; n < st.copies; n++) {
+		check (cosched_add (&s, cotemplate_coro (&st, n, 0)) == 0);
+		check (cosched_add (&s, cotemplate_coro (&st, n, 1)) == 0);
+	}
+	check (cosched_run (&s) == 0);
+	cosched_fini (&s);
+	for (n = 0; n < st.copies; n++) {
+		int upto = n + base;
+		coro_summer *sm = (coro_summer *) cotemplate_coro (&st, n, 1);
+		check (sm->user.sum == upto * (upto + 1) / 2);
+	}
+	cotemplate_free (&st);
+	check ((st.mem == NULL) && (st.offsets == NULL));
+	//
+	// Edges that use a conut twice, or that do not fit, are refused
+	const coconut_tmpledge_st twice [2] = { { 0, 0, 1, 0 }, { 2, 0, 1, 0 } };
+	const coconut_template_st bad1 = { coros, twice, 3, 2 };
+	check (cotemplate_stamp (&st, &bad1, 1, -1) == -EINVAL);
+	const coconut_tmpledge_st outside [1] = { { 0, 1, 1, 0 } };
+	const coconut_template_st bad2 = { coros, outside, 3, 1 };
+	check (cotemplate_stamp (&st, &bad2, 1, -1) == -EINVAL);
+	const coconut_tmpledge_st itself [1] = { { 0, 0, 0, 0 } };
+	const coconut_template_st bad3 = { coros, itself, 3, 1 };
+	check (cotemplate_stamp (&st, &bad3, 1, -1) == -EINVAL);
+	check (cotemplate_stamp (&st, &tmpl, 0, -1) == -EINVAL);
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All template checks passed\n");
+	return 0;
+}
@@ -0,0 +1,116 @@
+/* Check the cleanup of coro resources by coend(), codestroy() and
+ * codestroy_lifo().  Cleanup actions must run once each, in declaration order
+ * or in reverse, and a coro must keep returning 0 once it has ended.
+ *
+ * cc -std=gnu11 -I.. -o test_destroy test_destroy.c ../destroy.c ../cocall.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "coconut.h"
+
+
+struct holder {
+	coconut_coro_st coro;
+	char log [16];
+	int len;
+	int yields;
+};
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+/* Open three resources, yield a number of times and end.
+ */
+bool holder (struct holder *selfp) {
+cobegin ();
+	coresources { RES_A, RES_B, RES_C };
+	cocleantodoaction (RES_A) {
+		selfp->log [selfp->len++] = 'A';
+	}
+	cocleantodoaction (RES_B) {
+		selfp->log [selfp->len++] = 'B';
+	}
+	cocleantodoaction (RES_C) {
+		selfp->log [selfp->len++] = 'C';
+	}
+	while (selfp->yields-- > 0) {
+		coyield ();
+	}
+coend ();
+}
+
+/* Yield a number of times and end, without opening any resources.
+ */
+bool bare (struct holder *selfp) {
+cobegin ();
+	while (selfp->yields-- > 0) {
+		coyield ();
+	}
+coend ();
+}
+
+
+static void setup (struct holder *h, bool (*fun) (struct holder *), int yields) {
+	memset (h, 0, sizeof (*h));
+	coinit (h->coro, fun);
+	h->yields = yields;
+}
+
+
+int main (void) {
+	struct holder h;
+	//
+	// Running into coend() cleans up in declaration order, once
+	setup (&h, holder, 2);
+	check (cogo (h.coro) == 1);
+	check (cogo (h.coro) == 1);
+	check (cogo (h.coro) == 0);
+	check ((h.len == 3) && (memcmp (h.log, "ABC", 3) == 0));
+	check (cogo (h.coro) == 0);
+	check (cogo (h.coro) == 0);
+	check (h.len == 3);
+	//
+	// Destroying halfway cleans up in declaration order, and ends the coro
+	setup (&h, holder, 5);
+	check (cogo (h.coro) == 1);
+	codestroy (h.coro);
+	check ((h.len == 3) && (memcmp (h.log, "ABC", 3) == 0));
+	check (cogo (h.coro) == 0);
+	check (h.len == 3);
+	//
+	// Destroying halfway in LIFO order cleans up in reverse
+	setup (&h, holder, 5);
+	check (cogo (h.coro) == 1);
+	codestroy_lifo (h.coro);
+	check ((h.len == 3) && (memcmp (h.log, "CBA", 3) == 0));
+	check (cogo (h.coro) == 0);
+	check (cogo (h.coro) == 0);
+	check (h.len == 3);
+	//
+	// A coro without resources ends as usual
+	setup (&h, bare, 1);
+	check (cogo (h.coro) == 1);
+	check (cogo (h.coro) == 0);
+	check (cogo (h.coro) == 0);
+	check (h.len == 0);
+	//
+	// Destroying halfway ends a coro without resources too
+	setup (&h, bare, 5);
+	check (cogo (h.coro) == 1);
+	codestroy (h.coro);
+	check (cogo (h.coro) == 0);
+	check (h.len == 0);
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All destroy checks passed\n");
+	return 0;
+}
@@ -0,0 +1,165 @@
+/* Check the dispatcher.  Every write goes to exactly one worker, workers that
+ * wait for work are parked by a scheduler instead of run over and over, and
+ * all workers read EOF after the writer sends it.  A worker cannot leave while
+ * work delivered to it is not yet read, and a write that does not fit in the
+ * buffer of the idle worker fails with -EPROTO.
+ *
+ * cc -std=gnu11 -I.. -o test_dispatch test_dispatch.c ../dispatch.c \
+ *	../pipenut.c ../destroy.c ../cocall.c ../cotime.c ../scheduler.c ../simulate.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "coconut.h"
+
+
+#define JOBS    20
+#define WORKERS 3
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+struct submitter {
+	coconut_coro_st coro;
+	coconut_dispatch_t d;
+	int jobs [JOBS];
+	int n;
+	int bad;
+	int eof;
+	int runs;
+};
+
+struct worker {
+	coconut_coro_st coro;
+	coconut_dispatch_t d;
+	coconut_worker_st w;
+	int job;
+	int jobs;
+	int sum;
+	int last;
+	int runs;
+};
+
+
+/* Submit the jobs, and then EOF.
+ */
+bool submitter (struct submitter *selfp) {
+	ssize_t _coio;
+	selfp->runs++;
+cobegin ();
+	while (selfp->n < JOBS) {
+		selfp->jobs [selfp->n] = selfp->n + 1;
+		conut_dispatch_write (selfp->d, &selfp->jobs [selfp->n], sizeof (int));
+		if (conut_size () != sizeof (int)) {
+			selfp->bad++;
+		}
+		selfp->n++;
+	}
+	conut_dispatch_write (selfp->d, NULL, 0);
+	selfp->eof = conut_size ();
+coend ();
+}
+
+/* Take jobs until EOF, and yield after each, so others get their turn.
+ */
+bool worker (struct worker *selfp) {
+	ssize_t _coio;
+	selfp->runs++;
+cobegin ();
+	conut_dispatch_join (selfp->d, &selfp->w, &selfp->coro, 0);
+	do {
+		conut_dispatch_read (selfp->d, &selfp->w, &selfp->job, sizeof (selfp->job));
+		selfp->last = conut_size ();
+		if (selfp->last > 0) {
+			selfp->sum += selfp->job;
+			selfp->jobs++;
+			coyield ();
+		}
+	} while (selfp->last > 0);
+	conut_dispatch_leave (selfp->d, &selfp->w);
+coend ();
+}
+
+
+int main (void) {
+	coconut_dispatch_st d;
+	coconut_scheduler_st s;
+	struct submitter sub;
+	struct worker wk [WORKERS];
+	int i, sum = 0;
+	//
+	// An idle worker is parked, and nothing wakes it up
+	memset (&d, 0, sizeof (d));
+	memset (wk, 0, sizeof (wk));
+	cosched_init (&s);
+	coinit (wk [0].coro, worker);
+	wk [0].d = &d;
+	check (cosched_add (&s, &wk [0].coro) == 0);
+	check (cosched_step (&s));
+	check (wk [0].coro.schedstate == COSCHED_PARKED);
+	check (wk [0].w.state == CODISP_IDLE);
+	check (cosched_run (&s) == -EDEADLK);
+	check (wk [0].runs == 1);
+	//
+	// The writer hands out all jobs over the workers, and then EOF
+	for (i = 1; i < WORKERS; i++) {
+		coinit (wk [i].coro, worker);
+		wk [i].d = &d;
+		check (cosched_add (&s, &wk [i].coro) == 0);
+	}
+	memset (&sub, 0, sizeof (sub));
+	coinit (sub.coro, submitter);
+	sub.d = &d;
+	conut_dispatch_writer (&d, &sub.coro, 0);
+	check (cosched_add (&s, &sub.coro) == 0);
+	check (cosched_run (&s) == 0);
+	check ((sub.n == JOBS) && (sub.bad == 0) && (sub.eof == 0));
+	check (sub.runs <= JOBS + 2);
+	for (i = 0; i < WORKERS; i++) {
+		check (wk [i].jobs > 0);
+		check (wk [i].last == 0);
+		check (wk [i].w.state == CODISP_OUT);
+		check (wk [i].runs <= 2 * wk [i].jobs + 3);
+		sum += wk [i].sum;
+	}
+	check (sum == JOBS * (JOBS + 1) / 2);
+	check ((d.idlehead == NULL) && (d.idletail == NULL));
+	cosched_fini (&s);
+	//
+	// Work that is delivered must be read before leaving
+	int job = 7, got = 0;
+	char small;
+	memset (&d, 0, sizeof (d));
+	memset (wk, 0, sizeof (wk));
+	coinit (wk [0].coro, worker);
+	conut_dispatch_join (&d, &wk [0].w, &wk [0].coro, 0);
+	check (_conut_dispatch_read (&d, &wk [0].w, (uint8_t *) &got, sizeof (got)) == -EAGAIN);
+	check (wk [0].coro.waiting);
+	check (_conut_dispatch_write (&d, (uint8_t *) &job, sizeof (job)) == sizeof (job));
+	check (coflags_test (&wk [0].coro.activity, 0));
+	check (conut_dispatch_leave (&d, &wk [0].w) == -EBUSY);
+	check (_conut_dispatch_read (&d, &wk [0].w, (uint8_t *) &got, sizeof (got)) == sizeof (job));
+	check (got == 7);
+	check (!coflags_test (&wk [0].coro.activity, 0));
+	check (conut_dispatch_leave (&d, &wk [0].w) == 0);
+	//
+	// Work that does not fit in the buffer of the idle worker fails
+	conut_dispatch_join (&d, &wk [0].w, &wk [0].coro, 0);
+	check (_conut_dispatch_read (&d, &wk [0].w, (uint8_t *) &small, sizeof (small)) == -EAGAIN);
+	check (_conut_dispatch_write (&d, (uint8_t *) &job, sizeof (job)) == -EPROTO);
+	check (conut_dispatch_leave (&d, &wk [0].w) == 0);
+	check (d.idlehead == NULL);
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All dispatch checks passed\n");
+	return 0;
+}
@@ -0,0 +1,242 @@
+/* Check the multicast and merge combinators.  Every reader gets every round,
+ * and EOF stays with each reader, so reading again after EOF returns EOF
+ * instead of waiting forever.  Writing after EOF fails with -EPIPE.  A merge
+ * reads the writes of all writers, and ends when they all sent EOF; it does
+ * not take a maxlen of 0.  Under a scheduler, coros that wait for either
+ * combinator are parked, so they are not run over and over.
+ *
+ * cc -std=gnu11 -I.. -o test_fanout test_fanout.c ../fanout.c ../pipenut.c \
+ *	../destroy.c ../cocall.c ../cotime.c ../scheduler.c ../simulate.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "coconut.h"
+
+
+#define READERS 3
+#define MAXRUNS 1000
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+static const char *msgs [3] = { "one", "two", "three" };
+
+struct mcwriter {
+	coconut_coro_st coro;
+	coconut_multicast_t mc;
+	int n;
+	int res [5];
+};
+
+struct mcreader {
+	coconut_coro_st coro;
+	coconut_multicast_t mc;
+	uint16_t idx;
+	char buf [32];
+	int len;
+	int rounds;
+	int again [2];
+};
+
+struct mgwriter {
+	coconut_coro_st coro;
+	coconut_merge_t mg;
+	uint16_t idx;
+	int runs;
+};
+
+struct mgreader {
+	coconut_coro_st coro;
+	coconut_merge_t mg;
+	char buf [32];
+	int len;
+	int zero;
+	int runs;
+};
+
+
+/* Write three rounds, then EOF, and then one round too many.
+ */
+bool mcwriter (struct mcwriter *selfp) {
+	ssize_t _coio;
+cobegin ();
+	while (selfp->n < 3) {
+		conut_multicast_write (selfp->mc, msgs [selfp->n], strlen (msgs [selfp->n]));
+		selfp->res [selfp->n++] = conut_size ();
+	}
+	conut_multicast_write (selfp->mc, NULL, 0);
+	selfp->res [3] = conut_size ();
+	conut_multicast_write (selfp->mc, "late", 4);
+	selfp->res [4] = conut_size ();
+coend ();
+}
+
+/* Read rounds until EOF, and then read and peek once more.
+ */
+bool mcreader (struct mcreader *selfp) {
+	ssize_t _coio;
+	const uint8_t *shared;
+cobegin ();
+	do {
+		conut_multicast_read (selfp->mc, selfp->idx, selfp->buf + selfp->len, sizeof (selfp->buf) - selfp->len);
+		if (conut_size () > 0) {
+			selfp->len += conut_size ();
+		}
+		selfp->rounds++;
+	} while (conut_size () > 0);
+	conut_multicast_read (selfp->mc, selfp->idx, selfp->buf, sizeof (selfp->buf));
+	selfp->again [0] = conut_size ();
+	conut_multicast_peek (selfp->mc, selfp->idx, &shared);
+	selfp->again [1] = conut_size ();
+	conut_multicast_release (selfp->mc, selfp->idx);
+coend ();
+}
+
+
+/* Write the message of this writer in two parts, then EOF.
+ */
+bool mgwriter (struct mgwriter *selfp) {
+	ssize_t _coio;
+	selfp->runs++;
+cobegin ();
+	conut_merge_write (selfp->mg, selfp->idx, msgs [selfp->idx], 2);
+	conut_merge_write (selfp->mg, selfp->idx, msgs [selfp->idx] + 2, strlen (msgs [selfp->idx]) - 2);
+	conut_merge_write (selfp->mg, selfp->idx, NULL, 0);
+coend ();
+}
+
+/* Try to read nothing, and then read one byte at a time until EOF.
+ */
+bool mgreader (struct mgreader *selfp) {
+	ssize_t _coio;
+	selfp->runs++;
+cobegin ();
+	conut_merge_read (selfp->mg, selfp->buf, 0);
+	selfp->zero = conut_size ();
+	do {
+		conut_merge_read (selfp->mg, selfp->buf + selfp->len, 1);
+		if (conut_size () > 0) {
+			selfp->len += conut_size ();
+		}
+	} while (conut_size () > 0);
+coend ();
+}
+
+
+int main (void) {
+	struct mcwriter w;
+	struct mcreader r [READERS];
+	coconut_multicast_t mc = conut_multicast_new (READERS);
+	bool busy = 1;
+	int i, runs;
+	check (mc != NULL);
+	memset (&w, 0, sizeof (w));
+	coinit (w.coro, mcwriter);
+	w.mc = mc;
+	conut_multicast_writer (mc, &w.coro, 0);
+	memset (r, 0, sizeof (r));
+	for (i = 0; i < READERS; i++) {
+		coinit (r [i].coro, mcreader);
+		r [i].mc = mc;
+		r [i].idx = i;
+		conut_multicast_reader (mc, i, &r [i].coro, 0);
+	}
+	for (runs = 0; busy && (runs < MAXRUNS); runs++) {
+		// Readers run in turns before and after the writer
+		busy = 0;
+		for (i = 0; i < READERS; i++) {
+			if (i == runs % READERS) {
+				busy |= cogo (w.coro);
+			}
+			busy |= cogo (r [i].coro);
+		}
+	}
+	check (!busy);
+	check ((w.res [0] == 3) && (w.res [1] == 3) && (w.res [2] == 5));
+	check (w.res [3] == 0);
+	check (w.res [4] == -EPIPE);
+	for (i = 0; i < READERS; i++) {
+		check ((r [i].len == 11) && (memcmp (r [i].buf, "onetwothree", 11) == 0));
+		check (r [i].rounds == 4);
+		check ((r [i].again [0] == 0) && (r [i].again [1] == 0));
+	}
+	conut_multicast_free (mc);
+	//
+	// Under a scheduler, waiting readers and writers are parked
+	coconut_scheduler_st s;
+	mc = conut_multicast_new (READERS);
+	memset (&w, 0, sizeof (w));
+	coinit (w.coro, mcwriter);
+	w.mc = mc;
+	conut_multicast_writer (mc, &w.coro, 0);
+	memset (r, 0, sizeof (r));
+	cosched_init (&s);
+	for (i = 0; i < READERS; i++) {
+		coinit (r [i].coro, mcreader);
+		r [i].mc = mc;
+		r [i].idx = i;
+		conut_multicast_reader (mc, i, &r [i].coro, 0);
+		check (cosched_add (&s, &r [i].coro) == 0);
+	}
+	for (i = 0; i < READERS; i++) {
+		check (cosched_step (&s));
+		check (r [i].coro.schedstate == COSCHED_PARKED);
+	}
+	check (cosched_run (&s) == -EDEADLK);
+	check (cosched_add (&s, &w.coro) == 0);
+	check (cosched_run (&s) == 0);
+	check ((w.res [3] == 0) && (w.res [4] == -EPIPE));
+	for (i = 0; i < READERS; i++) {
+		check ((r [i].len == 11) && (memcmp (r [i].buf, "onetwothree", 11) == 0));
+	}
+	cosched_fini (&s);
+	conut_multicast_free (mc);
+	//
+	// A merge reads all writes, and its coros are parked while they wait
+	struct mgwriter mw [3];
+	struct mgreader mr;
+	coconut_merge_t mg = conut_merge_new (3);
+	check (mg != NULL);
+	memset (&mr, 0, sizeof (mr));
+	coinit (mr.coro, mgreader);
+	mr.mg = mg;
+	conut_merge_reader (mg, &mr.coro, 0);
+	memset (mw, 0, sizeof (mw));
+	cosched_init (&s);
+	check (cosched_add (&s, &mr.coro) == 0);
+	check (cosched_step (&s));
+	check (mr.zero == -EINVAL);
+	check (mr.coro.schedstate == COSCHED_PARKED);
+	for (i = 0; i < 3; i++) {
+		coinit (mw [i].coro, mgwriter);
+		mw [i].mg = mg;
+		mw [i].idx = i;
+		conut_merge_writer (mg, i, &mw [i].coro, 0);
+		check (cosched_add (&s, &mw [i].coro) == 0);
+	}
+	check (cosched_run (&s) == 0);
+	check (mr.len == 11);
+	for (i = 0; i < 3; i++) {
+		check (memmem (mr.buf, mr.len, msgs [i] + 2, strlen (msgs [i]) - 2) != NULL);
+		check (mw [i].runs <= 6);
+	}
+	check (mr.runs <= 2 * 11 + 8);
+	cosched_fini (&s);
+	conut_merge_free (mg);
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All fanout checks passed\n");
+	return 0;
+}
@@ -0,0 +1,121 @@
+/* Check the file source and sink coros, by copying files through a pipe nut
+ * from a cofile_reader to a cofile_writer.  A regular file is mapped, a pipe
+ * is streamed through a buffer, and a read error reaches the writer instead
+ * of EOF, so neither coro waits forever.  When the last batch cannot be
+ * written, as on /dev/full, the writer reports it in its err field.
+ *
+ * cc -std=gnu11 -I.. -o test_filenut test_filenut.c ../filenut.c ../pipenut.c \
+ *	../destroy.c ../cocall.c ../cotime.c ../scheduler.c ../simulate.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "coconut.h"
+
+
+#define FILESIZE (1000000 + 123)
+#define PIPESIZE 30000
+#define MAXRUNS  1000000
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+/* Run a reader and a writer connected by a pipe until both have ended.
+ * Returns the err field of the writer, or 1 when they do not end.
+ */
+static int copy (int in, int out, size_t window, size_t batch) {
+	coro_cofile_reader *r = calloc (1, sizeof (*r));
+	coro_cofile_writer *w = calloc (1, sizeof (*w));
+	bool busy = 1;
+	unsigned runs;
+	int err;
+	coinit_args (*r, cofile_reader, .fd = in, .window = window);
+	coinit_args (*w, cofile_writer, .fd = out, .batch = batch, .direct = 0);
+	conut_makepipe (&r->pipes [0], &w->pipes [0]);
+	for (runs = 0; busy && (runs < MAXRUNS); runs++) {
+		bool rbusy = cogo (r->coro);
+		bool wbusy = cogo (w->coro);
+		busy = rbusy || wbusy;
+	}
+	err = busy? 1: w->user.err;
+	free (r);
+	free (w);
+	return err;
+}
+
+/* Read all of a file into a buffer, and return its length.
+ */
+static size_t slurp (const char *path, uint8_t *buf, size_t max) {
+	FILE *f = fopen (path, "rb");
+	size_t len;
+	if (f == NULL) {
+		return 0;
+	}
+	len = fread (buf, 1, max, f);
+	fclose (f);
+	return len;
+}
+
+
+int main (void) {
+	char srcpath [] = "/tmp/test_filenut_src_XXXXXX";
+	char dstpath [] = "/tmp/test_filenut_dst_XXXXXX";
+	uint8_t *data = malloc (FILESIZE);
+	uint8_t *back = malloc (FILESIZE + 1);
+	int src, dst, fds [2];
+	size_t i;
+	for (i = 0; i < FILESIZE; i++) {
+		data [i] = (uint8_t) (i * 7 + i / 251);
+	}
+	//
+	// A regular file is mapped and passed in windows
+	src = mkstemp (srcpath);
+	dst = mkstemp (dstpath);
+	check ((src >= 0) && (dst >= 0));
+	check (write (src, data, FILESIZE) == FILESIZE);
+	check (lseek (src, 0, SEEK_SET) == 0);
+	check (copy (src, dst, 65536, 1 << 18) == 0);
+	check (slurp (dstpath, back, FILESIZE + 1) == FILESIZE);
+	check (memcmp (data, back, FILESIZE) == 0);
+	//
+	// The last batch is written after EOF, and its failure is reported
+	src = open (srcpath, O_RDONLY);
+	dst = open ("/dev/full", O_WRONLY);
+	check ((src >= 0) && (dst >= 0));
+	check (copy (src, dst, 65536, 1 << 24) == -ENOSPC);
+	unlink (srcpath);
+	//
+	// A pipe cannot be mapped, so it is streamed through a buffer
+	dst = open (dstpath, O_WRONLY | O_TRUNC);
+	check ((dst >= 0) && (pipe (fds) == 0));
+	check (write (fds [1], data, PIPESIZE) == PIPESIZE);
+	close (fds [1]);
+	check (copy (fds [0], dst, 4096, 16384) == 0);
+	check (slurp (dstpath, back, FILESIZE + 1) == PIPESIZE);
+	check (memcmp (data, back, PIPESIZE) == 0);
+	//
+	// A source that cannot be read ends both coros
+	dst = open (dstpath, O_WRONLY | O_TRUNC);
+	check (dst >= 0);
+	check (copy (-1, dst, 4096, 16384) == -EIO);
+	check (slurp (dstpath, back, FILESIZE + 1) == 0);
+	unlink (dstpath);
+	free (data);
+	free (back);
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All file nut checks passed\n");
+	return 0;
+}
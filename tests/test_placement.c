@@ -0,0 +1,123 @@
+/* Check placement plans.  Coros that are connected with coplace_makepipe(),
+ * directly or through others, share a CPU, and groups go largest first to the
+ * least loaded CPU.  A plan takes up to 65536 coros, and refuses more with
+ * -E2BIG.  Memory from coplace_alloc() is zeroed.
+ *
+ * cc -std=gnu11 -I.. -o test_placement test_placement.c ../placement.c \
+ *	../pipenut.c ../destroy.c ../cocall.c ../cotime.c ../scheduler.c ../simulate.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "coconut.h"
+
+
+#define STAGES 11
+#define MAXPLAN 65536
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+/* A stage of a pipeline, with an input and an output pipe nut.
+ */
+struct stage {
+	coconut_coro_st coro;
+	coconut_pipenut_st pipes [2];
+};
+
+static struct stage stages [STAGES];
+
+
+/* Connect the output of stage a to the input of stage b.
+ */
+static void join (coconut_placement_t p, int *idx, int a, int b) {
+	coplace_makepipe (p, idx [a], &stages [a].pipes [1], idx [b], &stages [b].pipes [0]);
+}
+
+
+int main (void) {
+	coconut_placement_st plan;
+	int idx [STAGES];
+	int cpus [2] = { 2, 5 };
+	int i;
+	//
+	// Pipelines of 4, 3, 2 and 2 stages, connected in a mixed order
+	coplace_init (&plan);
+	for (i = 0; i < STAGES; i++) {
+		idx [i] = coplace_add (&plan, &stages [i].coro);
+		check (idx [i] == i);
+		check (coplace_cpu (&plan, idx [i]) == -1);
+	}
+	join (&plan, idx, 0, 3);
+	join (&plan, idx, 4, 1);
+	join (&plan, idx, 3, 7);
+	join (&plan, idx, 2, 5);
+	join (&plan, idx, 1, 9);
+	join (&plan, idx, 7, 8);
+	join (&plan, idx, 6, 10);
+	check (stages [0].pipes [1].peer == &stages [3].pipes [0]);
+	check (stages [3].pipes [0].peer == &stages [0].pipes [1]);
+	//
+	// Without CPUs nothing is assigned
+	coplace_assign (&plan, cpus, 0);
+	for (i = 0; i < STAGES; i++) {
+		check (coplace_cpu (&plan, idx [i]) == -1);
+	}
+	//
+	// Each pipeline is on one CPU, the largest on the first CPU, the next
+	// two on the second, and the last one on the first CPU again
+	coplace_assign (&plan, cpus, 2);
+	check (coplace_cpu (&plan, idx [0]) == 2);
+	check (coplace_cpu (&plan, idx [3]) == 2);
+	check (coplace_cpu (&plan, idx [7]) == 2);
+	check (coplace_cpu (&plan, idx [8]) == 2);
+	check (coplace_cpu (&plan, idx [4]) == 5);
+	check (coplace_cpu (&plan, idx [1]) == 5);
+	check (coplace_cpu (&plan, idx [9]) == 5);
+	check (coplace_cpu (&plan, idx [2]) == 5);
+	check (coplace_cpu (&plan, idx [5]) == 5);
+	check (coplace_cpu (&plan, idx [6]) == 2);
+	check (coplace_cpu (&plan, idx [10]) == 2);
+	coplace_fini (&plan);
+	check ((plan.count == 0) && (plan.coros == NULL));
+	//
+	// The plan is full at 65536 coros, linked across its whole range
+	coplace_init (&plan);
+	for (i = 0; i < MAXPLAN; i++) {
+		if (coplace_add (&plan, &stages [0].coro) != i) {
+			break;
+		}
+	}
+	check (i == MAXPLAN);
+	check (coplace_add (&plan, &stages [0].coro) == -E2BIG);
+	check (plan.count == MAXPLAN);
+	coplace_link (&plan, 0, MAXPLAN - 1);
+	coplace_link (&plan, MAXPLAN / 2, MAXPLAN - 1);
+	coplace_assign (&plan, cpus, 2);
+	check (coplace_cpu (&plan, 0) == 2);
+	check (coplace_cpu (&plan, MAXPLAN / 2) == 2);
+	check (coplace_cpu (&plan, MAXPLAN - 1) == 2);
+	check (coplace_cpu (&plan, 1) == 5);
+	coplace_fini (&plan);
+	//
+	// Memory for a group is zeroed, whether or not its node is known
+	uint8_t *mem = coplace_alloc (8192, coplace_node (0));
+	check (mem != NULL);
+	if (mem != NULL) {
+		check ((mem [0] == 0) && (mem [8191] == 0));
+		coplace_free (mem, 8192);
+	}
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All placement checks passed\n");
+	return 0;
+}
@@ -0,0 +1,289 @@
+/* Check the scheduler.  Coros run by class, with the earliest deadline first
+ * among those that have one, and coros that were only setup with coinit() are
+ * normal.  Coros that wait for a pipe nut, a typed channel or in coalt() are
+ * parked instead of run over and over, and coalt() times out while its coro
+ * is parked.  A ping-pong of many more round trips than handofflimit runs to
+ * its end in any class.  A coro that is initialised again starts out cleared.
+ *
+ * cc -std=gnu11 -I.. -o test_scheduler test_scheduler.c ../scheduler.c \
+ *	../pipenut.c ../destroy.c ../cocall.c ../cotime.c ../simulate.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "coconut.h"
+
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+/* Note the order in which coros run, and end.
+ */
+struct mark {
+	coconut_coro_st coro;
+	int id;
+};
+
+static int order [8];
+static int ran = 0;
+
+bool marker (struct mark *selfp) {
+cobegin ();
+	order [ran++] = selfp->id;
+coend ();
+}
+
+
+/* Read a number from a pipe nut, and end.
+ */
+coroutine_decl_args (int, 1, waiter, struct { int unused; });
+
+coroutine_args (int, 1, waiter)
+	copipenuts { in };
+	cobody_typed {
+		conut_read (in, &self, sizeof (self));
+		codone ();
+	}
+coroutine_args_end
+
+
+/* Write a number to a pipe nut, and end.
+ */
+coroutine_decl_args (int, 1, sender, struct { int value; });
+
+coroutine_args (int, 1, sender)
+	copipenuts { out };
+	cobody_typed {
+		self = coargs.value;
+		conut_write (out, &self, sizeof (self));
+		codone ();
+	}
+coroutine_args_end
+
+
+/* Send numbers to a peer that echoes them back over a second pipe, and count
+ * the echoes.  Every round trip is two handoffs, so runs go well beyond the
+ * handofflimit.
+ */
+struct pingpong {
+	int n;
+	int value;
+	int echoed;
+};
+
+coroutine_decl_args (struct pingpong, 2, pinger, struct { int rounds; });
+
+coroutine_args (struct pingpong, 2, pinger)
+	copipenuts { out, in };
+	cobody_typed {
+		while (self.n < coargs.rounds) {
+			self.value = self.n;
+			conut_write (out, &self.value, sizeof (self.value));
+			conut_read (in, &self.value, sizeof (self.value));
+			if (self.value == self.n) {
+				self.echoed++;
+			}
+			self.n++;
+		}
+		conut_write (out, NULL, 0);
+		codone ();
+	}
+coroutine_args_end
+
+coroutine_decl_args (struct pingpong, 2, ponger, struct { int unused; });
+
+coroutine_args (struct pingpong, 2, ponger)
+	copipenuts { in, out };
+	cobody_typed {
+		do {
+			conut_read (in, &self.value, sizeof (self.value));
+			if (conut_size () <= 0) {
+				break;
+			}
+			conut_write (out, &self.value, sizeof (self.value));
+			self.n++;
+		} while (1);
+		codone ();
+	}
+coroutine_args_end
+
+
+/* Read a number from a typed channel, and end.
+ */
+struct chanreader {
+	coconut_coro_st coro;
+	cochannel (int) in;
+	int got;
+};
+
+bool chanreader (struct chanreader *selfp) {
+	ssize_t _coio;
+cobegin ();
+	cochannel_read (selfp->in, selfp->got);
+	codone ();
+coend ();
+}
+
+
+/* Wait in coalt() for a trigger that does not come, and note the outcome.
+ */
+coroutine_decl_args (int, 1, alter, struct { int timeout; });
+
+coroutine_args (int, 1, alter)
+	copipenuts { trig };
+	cobody_typed {
+		coalt (conut_bit (trig), coargs.timeout, COALT_PRIORITY);
+		self = coalt_ready ();
+		codone ();
+	}
+coroutine_args_end
+
+
+int main (void) {
+	coconut_scheduler_st s;
+	struct mark m [5];
+	int i;
+	//
+	// Critical first, then by deadline, then normal and batch
+	static const int classes [5] = { COSCHED_BATCH, COSCHED_NORMAL, COSCHED_NORMAL, COSCHED_NORMAL, COSCHED_CRITICAL };
+	static const uint64_t deadlines [5] = { 0, 0, 300, 100, 200 };
+	cosched_init (&s);
+	memset (m, 0, sizeof (m));
+	for (i = 0; i < 5; i++) {
+		coinit (m [i].coro, marker);
+		cosched_class (&m [i], classes [i], deadlines [i]);
+		m [i].id = i;
+		check (cosched_add (&s, &m [i].coro) == 0);
+	}
+	check (cosched_run (&s) == 0);
+	check (ran == 5);
+	check ((order [0] == 4) && (order [1] == 3) && (order [2] == 2) && (order [3] == 1) && (order [4] == 0));
+	cosched_fini (&s);
+	//
+	// Without a class, a coro is normal, and it does not preempt others
+	memset (m, 0, sizeof (m));
+	coinit (m [0].coro, marker);
+	check (m [0].coro.schedclass == COSCHED_NORMAL);
+	cosched_init (&s);
+	check (cosched_add (&s, &m [0].coro) == 0);
+	check ((s.ready [COSCHED_CRITICAL].head == NULL) && (s.ready [COSCHED_NORMAL].head == &m [0].coro));
+	check (cosched_run (&s) == 0);
+	cosched_fini (&s);
+	//
+	// Handoffs beyond the limit take a turn in the queue of their class,
+	// which must also work when that is the critical class
+	for (i = 0; i < 2; i++) {
+		coro_pinger *pi = calloc (1, sizeof (*pi));
+		coro_ponger *po = calloc (1, sizeof (*po));
+		coinit_args (*pi, pinger, .rounds = 100);
+		coinit_args (*po, ponger, .unused = 0);
+		if (i == 1) {
+			cosched_class (pi, COSCHED_CRITICAL, 0);
+			cosched_class (po, COSCHED_CRITICAL, 0);
+		}
+		conut_makepipe (&pi->pipes [0], &po->pipes [0]);
+		conut_makepipe (&po->pipes [1], &pi->pipes [1]);
+		cosched_init (&s);
+		check (cosched_add (&s, &pi->coro) == 0);
+		check (cosched_add (&s, &po->coro) == 0);
+		check (cosched_run (&s) == 0);
+		check ((pi->user.echoed == 100) && (po->user.n == 100));
+		cosched_fini (&s);
+		free (pi);
+		free (po);
+	}
+	//
+	// A channel reader is parked until the other end writes
+	struct chanreader *cr = calloc (1, sizeof (*cr));
+	static cochannel (int) out;
+	int value = 7;
+	coinit (cr->coro, chanreader);
+	cochannel_owner (cr->in, cr, 0);
+	cochannel_makepipe (cr->in, out);
+	cosched_init (&s);
+	check (cosched_add (&s, &cr->coro) == 0);
+	check (cosched_step (&s));
+	check (cr->coro.schedstate == COSCHED_PARKED);
+	check (cosched_run (&s) == -EDEADLK);
+	check (_cochannel_sync (&out.chan, &value, sizeof (value), 1) == sizeof (value));
+	check (cr->coro.schedstate == COSCHED_READY);
+	check (cosched_run (&s) == 0);
+	check (cr->got == 7);
+	cosched_fini (&s);
+	free (cr);
+	//
+	// A reader without a writer is parked, and nothing wakes it
+	coro_waiter *w = calloc (1, sizeof (*w));
+	coro_sender *snd = calloc (1, sizeof (*snd));
+	coinit_args (*w, waiter, .unused = 0);
+	coinit_args (*snd, sender, .value = 42);
+	conut_makepipe (&w->pipes [0], &snd->pipes [0]);
+	cosched_init (&s);
+	check (cosched_add (&s, &w->coro) == 0);
+	check (cosched_step (&s));
+	check (w->coro.schedstate == COSCHED_PARKED);
+	check (!cosched_step (&s));
+	check (cosched_run (&s) == -EDEADLK);
+	//
+	// The writer wakes it up, and both end
+	check (cosched_add (&s, &snd->coro) == 0);
+	check (cosched_run (&s) == 0);
+	check (w->user == 42);
+	check ((w->coro.schedstate == COSCHED_OFF) && (snd->coro.schedstate == COSCHED_OFF));
+	cosched_fini (&s);
+	free (snd);
+	//
+	// A coro in coalt() is parked until its timeout
+	coro_alter *a = calloc (1, sizeof (*a));
+	coinit_args (*a, alter, .timeout = 20);
+	cosched_init (&s);
+	check (cosched_add (&s, &a->coro) == 0);
+	uint64_t start = cotime_now ();
+	check (cosched_step (&s));
+	check ((a->coro.schedstate == COSCHED_PARKED) && (s.timercount == 1));
+	check (cosched_run (&s) == 0);
+	check (a->user == -ETIMEDOUT);
+	check (cotime_now () - start >= 20000000);
+	check ((s.timercount == 0) && (s.parked == 0));
+	cosched_fini (&s);
+	//
+	// A trigger takes the coro out of the timers before its timeout
+	coinit_args (*a, alter, .timeout = 10000);
+	cosched_init (&s);
+	check (cosched_add (&s, &a->coro) == 0);
+	check (cosched_step (&s));
+	check (s.timercount == 1);
+	conut_trigger (0, &a->coro);
+	check (s.timercount == 0);
+	check (cosched_run (&s) == 0);
+	check (a->user == 0);
+	check (cotime_now () - start < 1000000000);
+	cosched_fini (&s);
+	//
+	// Initialising again clears everything but the class
+	memset (&w->coro, 0xff, sizeof (w->coro));
+	w->coro.schedclass = COSCHED_BATCH;
+	coinit (w->coro, waiter);
+	check (w->coro.coswitch == -99997);
+	check (w->coro.schedclass == COSCHED_BATCH);
+	check ((w->coro.sched == NULL) && (w->coro.schedstate == COSCHED_OFF) && !w->coro.cancelled && !w->coro.waiting);
+	check ((w->coro.deadline == 0) && (w->coro.altdeadline == 0) && (w->coro.budget == 0) && (w->coro.runtime == 0));
+	check ((w->coro.coclass == NULL) && (w->coro.altlast == 0) && (w->coro.fairlast == 0));
+	check (!coflags_any (&w->coro.activity) && !coflags_any (&w->coro.resopen));
+	check ((w->coro.subparent == NULL) && (w->coro.subleaf == NULL) && (w->coro.next == NULL));
+	free (w);
+	free (a);
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All scheduler checks passed\n");
+	return 0;
+}
@@ -0,0 +1,228 @@
+/* Check shared memory pipes.  A parent sends data through one pipe to a child
+ * process, which echoes it back through another pipe, with parked coros that
+ * are woken through the eventfds.  The child attaches to its input pipe from
+ * the file descriptors.  More data is sent than fits in the rings, so both
+ * sides have to wait for each other.  Attaching to a memfd that does not hold
+ * a ring fails, and leaves the file descriptors to the caller.
+ *
+ * cc -std=gnu11 -I.. -o test_shmnut test_shmnut.c ../shmnut.c ../pipenut.c \
+ *	../destroy.c ../cocall.c ../cotime.c ../scheduler.c ../simulate.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+
+#include "coconut.h"
+
+
+#define DATASIZE 100000
+#define PIECE    10000
+#define RINGSIZE 4096
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+static uint8_t data [DATASIZE];
+static uint8_t got [DATASIZE + 1];
+
+
+struct sender {
+	coconut_coro_st coro;
+	coconut_shmnut_t out;
+	size_t ofs;
+	int eof;
+};
+
+struct receiver {
+	coconut_coro_st coro;
+	coconut_shmnut_t in;
+	size_t len;
+};
+
+struct echo {
+	coconut_coro_st coro;
+	coconut_shmnut_t in, out;
+	uint8_t buf [RINGSIZE];
+	int len;
+};
+
+
+/* Send the data in pieces, and then EOF.
+ */
+bool sender (struct sender *selfp) {
+	ssize_t _coio;
+cobegin ();
+	while (selfp->ofs < DATASIZE) {
+		conut_shm_write (selfp->out, data + selfp->ofs, PIECE);
+		if (conut_size () != PIECE) {
+			break;
+		}
+		selfp->ofs += PIECE;
+	}
+	conut_shm_write (selfp->out, NULL, 0);
+	selfp->eof = conut_size ();
+coend ();
+}
+
+/* Receive data until EOF.
+ */
+bool receiver (struct receiver *selfp) {
+	ssize_t _coio;
+cobegin ();
+	do {
+		conut_shm_read (selfp->in, got + selfp->len, sizeof (got) - selfp->len);
+		if (conut_size () > 0) {
+			selfp->len += conut_size ();
+		}
+	} while (conut_size () > 0);
+coend ();
+}
+
+/* Pass on what comes in until EOF, and then pass on EOF.
+ */
+bool echo (struct echo *selfp) {
+	ssize_t _coio;
+cobegin ();
+	do {
+		conut_shm_read (selfp->in, selfp->buf, sizeof (selfp->buf));
+		selfp->len = conut_size ();
+		if (selfp->len > 0) {
+			conut_shm_write (selfp->out, selfp->buf, selfp->len);
+		}
+	} while (selfp->len > 0);
+	conut_shm_write (selfp->out, NULL, 0);
+coend ();
+}
+
+
+/* Run the scheduler, and when all its coros wait, pass on the wakeups that
+ * come in over the eventfds of the pipes.  Returns what the scheduler
+ * returned last, or -ETIMEDOUT when no wakeup came.
+ */
+static int pump (coconut_scheduler_t s, coconut_shmnut_t n0, coconut_shmnut_t n1) {
+	int retval;
+	while ((retval = cosched_run (s)) == -EDEADLK) {
+		struct pollfd pfd [2] = {
+			{ .fd = conut_shm_fd (n0), .events = POLLIN },
+			{ .fd = conut_shm_fd (n1), .events = POLLIN },
+		};
+		if (poll (pfd, 2, 5000) <= 0) {
+			return -ETIMEDOUT;
+		}
+		if (pfd [0].revents & POLLIN) {
+			conut_shm_event (n0);
+		}
+		if (pfd [1].revents & POLLIN) {
+			conut_shm_event (n1);
+		}
+	}
+	return retval;
+}
+
+
+/* Echo what comes in over the first pipe, attached from its descriptors,
+ * back over the second pipe.  This runs in the child process.
+ */
+static int child (coconut_shmnut_t there, coconut_shmnut_t reply) {
+	coconut_shmnut_st in;
+	coconut_scheduler_st s;
+	struct echo e = { 0 };
+	int retval;
+	if (conut_shm_attach (&in, there->memfd, there->evfd [0], there->evfd [1]) != 0) {
+		return 2;
+	}
+	coinit (e.coro, echo);
+	e.in = &in;
+	e.out = reply;
+	conut_shm_reader (&in, &e.coro, 0);
+	conut_shm_writer (reply, &e.coro, 1);
+	cosched_init (&s);
+	cosched_add (&s, &e.coro);
+	retval = pump (&s, &in, reply);
+	cosched_fini (&s);
+	conut_shm_unmap (&in);
+	return (retval == 0)? 0: 3;
+}
+
+
+int main (void) {
+	coconut_shmnut_st there, reply, bad;
+	coconut_scheduler_st s;
+	struct sender snd = { 0 };
+	struct receiver rcv = { 0 };
+	int memfd, evfd, status;
+	pid_t pid;
+	size_t i;
+	for (i = 0; i < DATASIZE; i++) {
+		data [i] = (uint8_t) (i * 7 + i / 251);
+	}
+	//
+	// A memfd without a ring is refused, and its descriptors stay open
+	memfd = memfd_create ("test-shmnut", 0);
+	evfd = eventfd (0, EFD_NONBLOCK);
+	check ((memfd >= 0) && (evfd >= 0));
+	check (ftruncate (memfd, 8) == 0);
+	check (conut_shm_attach (&bad, memfd, evfd, evfd) == -EINVAL);
+	check ((bad.ring == NULL) && (bad.memfd == -1) && (bad.evfd [0] == -1) && (bad.evfd [1] == -1));
+	check (ftruncate (memfd, sizeof (coconut_shmring_st) + RINGSIZE) == 0);
+	check (conut_shm_attach (&bad, memfd, evfd, evfd) == -EINVAL);
+	check (bad.ring == NULL);
+	conut_shm_unmap (&bad);
+	check (fcntl (memfd, F_GETFD) >= 0);
+	check (fcntl (evfd, F_GETFD) >= 0);
+	check (conut_shm_attach (&bad, -1, evfd, evfd) == -EBADF);
+	check (fcntl (evfd, F_GETFD) >= 0);
+	close (memfd);
+	close (evfd);
+	//
+	// A round trip through a child process, over two pipes
+	check (conut_shm_pipe (&there, RINGSIZE) == 0);
+	check (conut_shm_pipe (&reply, RINGSIZE) == 0);
+	check (there.ring->size == RINGSIZE);
+	fflush (stdout);
+	fflush (stderr);
+	pid = fork ();
+	check (pid >= 0);
+	if (pid == 0) {
+		_exit (child (&there, &reply));
+	}
+	coinit (snd.coro, sender);
+	coinit (rcv.coro, receiver);
+	snd.out = &there;
+	rcv.in = &reply;
+	conut_shm_writer (&there, &snd.coro, 0);
+	conut_shm_reader (&reply, &rcv.coro, 0);
+	cosched_init (&s);
+	check (cosched_add (&s, &snd.coro) == 0);
+	check (cosched_add (&s, &rcv.coro) == 0);
+	check (pump (&s, &there, &reply) == 0);
+	cosched_fini (&s);
+	check (snd.ofs == DATASIZE);
+	check (snd.eof == 0);
+	check (rcv.len == DATASIZE);
+	check (memcmp (data, got, DATASIZE) == 0);
+	check (waitpid (pid, &status, 0) == pid);
+	check (WIFEXITED (status) && (WEXITSTATUS (status) == 0));
+	conut_shm_unmap (&there);
+	conut_shm_unmap (&reply);
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All shared memory pipe checks passed\n");
+	return 0;
+}
@@ -0,0 +1,211 @@
+/* Check the simulator.  The same seed gives the same run, down to the order
+ * and virtual time of every step, while the results of the coronet do not
+ * depend on the seed.  The virtual clock starts at 1, coros that wait for a
+ * pipe nut are parked, and runs without progress only cost pollcost.
+ *
+ * cc -std=gnu11 -I.. -o test_simulate test_simulate.c ../simulate.c \
+ *	../scheduler.c ../pipenut.c ../destroy.c ../cocall.c ../cotime.c
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "coconut.h"
+
+
+#define UPTO     50
+#define PIPES    3
+#define MAXTRACE 4096
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+
+/* Every step of a summer is traced with its virtual time.
+ */
+struct step {
+	int id;
+	int v;
+	uint64_t at;
+};
+
+static struct step trace [MAXTRACE];
+static int traced = 0;
+
+static void tracestep (int id, int v) {
+	if (traced < MAXTRACE) {
+		trace [traced].id = id;
+		trace [traced].v = v;
+		trace [traced].at = cotime_now ();
+		traced++;
+	}
+}
+
+
+/* Write the numbers 1 to upto, and then EOF.
+ */
+coroutine_decl_args (int, 1, counter, struct { int upto; });
+
+coroutine_args (int, 1, counter)
+	copipenuts { out };
+	cobody_typed {
+		self++;
+		if (self > coargs.upto) {
+			conut_push (out);
+			codone ();
+		}
+		conut_write (out, &self, sizeof (self));
+	}
+coroutine_args_end
+
+
+/* Add up numbers until EOF, and trace each one.
+ */
+struct summer_data {
+	int v;
+	int sum;
+};
+
+coroutine_decl_args (struct summer_data, 1, summer, struct { int id; });
+
+coroutine_args (struct summer_data, 1, summer)
+	copipenuts { in };
+	cobody_typed {
+		conut_read (in, &self.v, sizeof (self.v));
+		if (conut_size () <= 0) {
+			codone ();
+		}
+		self.sum += self.v;
+		tracestep (coargs.id, self.v);
+		cosim_items (1);
+	}
+coroutine_args_end
+
+
+/* Poll a flag until a setter raises it after a timeout.
+ */
+static int flag = 0;
+
+struct plain {
+	coconut_coro_st coro;
+};
+
+bool poller (struct plain *selfp) {
+cobegin ();
+	while (!flag) {
+		coyield ();
+	}
+coend ();
+}
+
+bool setter (struct plain *selfp) {
+	ssize_t _coio;
+cobegin ();
+	coalt (conut_bit (0), 1, COALT_PRIORITY);
+	flag = 1;
+coend ();
+}
+
+
+/* Run some pipes in a simulation with a seed, and trace it.
+ */
+struct outcome {
+	int retval;
+	uint64_t runs;
+	uint64_t items;
+	uint64_t first;
+	uint64_t summerruns;
+	int sums [PIPES];
+	int traced;
+	struct step trace [MAXTRACE];
+};
+
+static void simulate (uint64_t seed, struct outcome *out) {
+	coconut_simulator_st sim;
+	coro_counter *c = calloc (PIPES, sizeof (*c));
+	coro_summer *s = calloc (PIPES, sizeof (*s));
+	int i;
+	traced = 0;
+	cosim_init (&sim, seed);
+	for (i = 0; i < PIPES; i++) {
+		coinit_args_class (c [i], counter, .upto = UPTO);
+		coinit_args_class (s [i], summer, .id = i);
+		conut_makepipe (&c [i].pipes [0], &s [i].pipes [0]);
+		cosched_add (&sim.sched, &c [i].coro);
+		cosched_add (&sim.sched, &s [i].coro);
+	}
+	out->retval = cosim_run (&sim, 0);
+	out->runs = sim.runs;
+	out->items = sim.items;
+	out->summerruns = 0;
+	for (i = 0; i < 2 * PIPES; i++) {
+		if (sim.stages [i].coro->coclass == &coro_summer_class) {
+			out->summerruns += sim.stages [i].runs;
+		}
+	}
+	for (i = 0; i < PIPES; i++) {
+		out->sums [i] = s [i].user.sum;
+	}
+	out->first = (traced > 0)? trace [0].at: 0;
+	out->traced = traced;
+	memcpy (out->trace, trace, sizeof (trace));
+	cosim_fini (&sim);
+	free (c);
+	free (s);
+}
+
+
+int main (void) {
+	static struct outcome a, b, d;
+	int i;
+	//
+	// The same seed gives the same run
+	simulate (42, &a);
+	simulate (42, &b);
+	check ((a.retval == 0) && (b.retval == 0));
+	check (a.traced == PIPES * UPTO);
+	check ((a.runs == b.runs) && (a.items == b.items) && (a.traced == b.traced));
+	check (memcmp (a.trace, b.trace, a.traced * sizeof (struct step)) == 0);
+	check (a.items == PIPES * UPTO);
+	//
+	// Another seed gives the same results
+	simulate (7, &d);
+	check (d.retval == 0);
+	for (i = 0; i < PIPES; i++) {
+		check ((a.sums [i] == UPTO * (UPTO + 1) / 2) && (d.sums [i] == a.sums [i]));
+	}
+	//
+	// The clock starts at 1, and readers are parked while they wait
+	check (a.first >= 1);
+	check (a.summerruns <= PIPES * (UPTO + 2));
+	//
+	// Polls cost pollcost, not runcost
+	coconut_simulator_st sim;
+	struct plain p, q;
+	memset (&p, 0, sizeof (p));
+	memset (&q, 0, sizeof (q));
+	coinit (p.coro, poller);
+	coinit (q.coro, setter);
+	cosim_init (&sim, 1);
+	check (sim.now == 1);
+	sim.pollcost = 1000;
+	cosched_add (&sim.sched, &p.coro);
+	cosched_add (&sim.sched, &q.coro);
+	check (cosim_run (&sim, 0) == 0);
+	coconut_simstage_t ps = &sim.stages [0];
+	check ((ps->runs > 100) && (ps->runs < 2000));
+	check (ps->busy == 2 * sim.runcost + (ps->runs - 2) * sim.pollcost);
+	cosim_fini (&sim);
+	if (failures > 0) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All simulator checks passed\n");
+	return 0;
+}
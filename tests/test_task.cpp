@@ -0,0 +1,197 @@
+/* Check C++20 tasks in a scheduler with coros written in C.  A task sends
+ * windows over a pipe nut to a cofile_writer coro, many more than handofflimit
+ * in the normal and critical class, and the file has what was sent.  A task
+ * reads windows from a cofile_reader coro until EOF.  Resources that a task
+ * links to its coro are flagged in resopen, and they are cleaned up, in the
+ * order of their bits, by codestroy() on the coro of a task that waits.
+ *
+ * cc -std=gnu11 -I.. -c ../filenut.c ../scheduler.c ../pipenut.c \
+ *	../destroy.c ../cocall.c ../cotime.c ../simulate.c
+ * c++ -std=c++20 -I.. -o test_task test_task.cpp *.o
+ *
+ * The program returns 0 when all checks pass.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "coconut.hpp"
+
+
+#define CHUNKS 100
+#define CHUNK  1000
+
+static int failures = 0;
+
+#define check(C) if (!(C)) { fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, # C); failures++; }
+
+static uint8_t data [CHUNKS * CHUNK];
+static uint8_t back [CHUNKS * CHUNK + 1];
+
+
+/* Send the data in windows, one chunk at a time, and then EOF.
+ */
+static coconut::task send (int *sent) {
+	coconut::conut out { 0 };
+	for (int i = 0; i < CHUNKS; i++) {
+		coconut_window_st win = { data + i * CHUNK, CHUNK, (uint64_t) i * CHUNK, 1 };
+		if (co_await out.write (&win, sizeof (win)) == sizeof (win)) {
+			(*sent)++;
+		}
+	}
+	check (co_await out.close () == 0);
+}
+
+/* Receive windows until EOF, and copy them to where they belong.
+ */
+static coconut::task receive (size_t *total) {
+	coconut::conut in { 0 };
+	coconut_window_st win;
+	while (co_await in.read (&win, sizeof (win), sizeof (win)) == sizeof (win)) {
+		memcpy (back + win.ofs, win.ptr, win.len);
+		*total += win.len;
+	}
+}
+
+static int cleaned [4];
+static int ncleaned = 0;
+
+static void note (int id) {
+	cleaned [ncleaned++] = id;
+}
+
+/* Hold resources on bits 0, 1 and 2, let go of the one on bit 1, and wait
+ * for input that never comes.
+ */
+static coconut::task hold (bool *kept) {
+	coconut_coro_t me = co_await coconut::this_coro ();
+	coconut::resource first (me, 0, 10, note);
+	coconut::resource second (me, 1, 11, note);
+	coconut::resource third (me, 2, 12, note);
+	second.done ();
+	*kept = coflags_test (&me->resopen, 0) && !coflags_test (&me->resopen, 1) && coflags_test (&me->resopen, 2);
+	coconut::conut in { 0 };
+	int value;
+	co_await in.read (&value, sizeof (value));
+	note (99);
+}
+
+
+int main (void) {
+	coconut_scheduler_st s;
+	coconut_pipenut_st idle [2] = { };
+	char path [] = "/tmp/test_task_XXXXXX";
+	int fd;
+	for (size_t i = 0; i < sizeof (data); i++) {
+		data [i] = (uint8_t) (i * 7 + i / 251);
+	}
+
+	/* A task writes to a file through a coro, in the normal and critical
+	 * class.  Each window is a handoff from the task to the coro and back.
+	 */
+	for (int critical = 0; critical <= 1; critical++) {
+		int sent = 0;
+		coro_cofile_writer *w = (coro_cofile_writer *) calloc (1, sizeof (*w));
+		fd = mkstemp (path);
+		check (fd >= 0);
+		coinit_args (*w, cofile_writer, .fd = fd, .batch = 4096, .direct = 0);
+		coconut::task t = send (&sent);
+		if (critical) {
+			cosched_class (t.co (), COSCHED_CRITICAL, 0);
+			cosched_class (w, COSCHED_CRITICAL, 0);
+		}
+		conut_makepipe (t.conut (0), &w->pipes [0]);
+		cosched_init (&s);
+		check (cosched_add (&s, t.co ()) == 0);
+		check (cosched_add (&s, &w->coro) == 0);
+		check (cosched_run (&s) == 0);
+		check (t.done ());
+		check (sent == CHUNKS);
+		check (w->user.err == 0);
+		cosched_fini (&s);
+		free (w);
+		memset (back, 0, sizeof (back));
+		fd = open (path, O_RDONLY);
+		check (read (fd, back, sizeof (back)) == sizeof (data));
+		check (memcmp (data, back, sizeof (data)) == 0);
+		close (fd);
+		unlink (path);
+		strcpy (path, "/tmp/test_task_XXXXXX");
+	}
+
+	/* A task reads a file through a coro.  Run the task first, so it parks
+	 * until the coro is added.
+	 */
+	{
+		size_t total = 0;
+		coro_cofile_reader *r = (coro_cofile_reader *) calloc (1, sizeof (*r));
+		fd = mkstemp (path);
+		check ((fd >= 0) && (write (fd, data, sizeof (data)) == sizeof (data)));
+		check (lseek (fd, 0, SEEK_SET) == 0);
+		coinit_args (*r, cofile_reader, .fd = fd, .window = 4096);
+		coconut::task t = receive (&total);
+		conut_makepipe (&r->pipes [0], t.conut (0));
+		memset (back, 0, sizeof (back));
+		cosched_init (&s);
+		check (cosched_add (&s, t.co ()) == 0);
+		check (cosched_step (&s));
+		check (!cosched_step (&s));
+		check (cosched_run (&s) == -EDEADLK);
+		check (cosched_add (&s, &r->coro) == 0);
+		check (cosched_run (&s) == 0);
+		check (t.done ());
+		check (total == sizeof (data));
+		check (memcmp (data, back, sizeof (data)) == 0);
+		cosched_fini (&s);
+		free (r);
+		unlink (path);
+	}
+
+	/* Destroy the coro of a waiting task, which cleans up its resources.
+	 */
+	{
+		bool kept = false;
+		coconut::task t = hold (&kept);
+		conut_makepipe (&idle [0], t.conut (0));
+		cosched_init (&s);
+		check (cosched_add (&s, t.co ()) == 0);
+		check (cosched_run (&s) == -EDEADLK);
+		check (kept);
+		check (ncleaned == 0);
+		codestroy (*t.co ());
+		check (ncleaned == 2);
+		check ((cleaned [0] == 10) && (cleaned [1] == 12));
+		check (!coflags_any (&t.co ()->resopen));
+		check (t.done ());
+		check (!cogo (*t.co ()));
+		check (ncleaned == 2);
+		cosched_fini (&s);
+	}
+
+	/* Without codestroy(), the resources are cleaned up with the task.
+	 */
+	{
+		bool kept = false;
+		ncleaned = 0;
+		{
+			coconut::task t = hold (&kept);
+			conut_makepipe (&idle [1], t.conut (0));
+			check (cogo (*t.co ()));
+			check (kept);
+		}
+		check (ncleaned == 2);
+		check ((cleaned [0] == 12) && (cleaned [1] == 10));
+	}
+
+	if (failures) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf ("All task checks passed\n");
+	return 0;
+}